@@ -0,0 +1,756 @@
+/* broker.c: In-process stand-in broker for benchmarks */
+
+#define _GNU_SOURCE
+
+#include "broker.h"
+#include "mq/frame.h"
+#include "mq/socket.h"
+#include "mq/string.h"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Internal Constants */
+
+#define BROKER_WAIT     100             /* Milliseconds a stream waits before checking its client */
+#define BROKER_FRAMES   64              /* Most messages sent in one stream chunk */
+#define BROKER_POLL     30              /* Seconds a GET /queue waits by default */
+
+/* Internal Structures */
+
+typedef struct BrokerConnection BrokerConnection;
+struct BrokerConnection {
+    Broker *    broker;
+    int         fd;
+    char        buffer[BROKER_BUFFER];
+    size_t      start;                  // First unconsumed byte of buffer
+    size_t      end;                    // One past last byte read into buffer
+    uint64_t    arrived;                // When bytes last read came in (see broker_clock)
+};
+
+/* Internal Prototypes */
+
+void *          broker_accept(void *arg);
+void *          broker_serve(void *arg);
+char *          broker_head(BrokerConnection *c, size_t *length);
+char *          broker_body(BrokerConnection *c, size_t length);
+bool            broker_read(BrokerConnection *c, char *data, size_t length);
+ssize_t         broker_recv(BrokerConnection *c, char *data, size_t length);
+void            broker_hold(BrokerConnection *c);
+uint64_t        broker_clock();
+bool            broker_reply(BrokerConnection *c, bool keep, int status, const char *body);
+bool            broker_route(BrokerConnection *c, bool keep, const char *method, char *uri, char *body, size_t length);
+bool            broker_stream(BrokerConnection *c, bool keep, BrokerQueue *q);
+bool            broker_binary(BrokerConnection *c, const char *queue);
+bool            broker_fetch(BrokerConnection *c, BrokerQueue *q, size_t limit);
+BrokerQueue *   broker_queue(Broker *b, const char *name, bool create);
+size_t          broker_publish(Broker *b, const char *topic, const char *body, size_t length, const char *from);
+bool            broker_subscribe(Broker *b, const char *queue, const char *topic, bool add, bool no_local);
+bool            broker_option(const char *query, const char *name, char *value, size_t size);
+size_t          broker_hash(const char *name);
+bool            broker_wait(Broker *b, BrokerQueue *q, long milliseconds);
+bool            broker_closed(int fd);
+
+/* External Functions */
+
+/**
+ * Start a broker listening on an ephemeral loopback port (stored in
+ * b->port) that understands the same routes as the Go server:
+ *
+ *  PUT     /topic/$TOPIC?from=$QUEUE
+ *  PUT     /batch?from=$QUEUE
+ *  PUT     /subscription/$QUEUE/$TOPIC?nolocal=1
+ *  DELETE  /subscription/$QUEUE/$TOPIC
+ *  GET     /queue/$QUEUE?timeout=$SECONDS
+ *  GET     /stream/$QUEUE
+ *  GET     /binary/$QUEUE          (switches to binary frames)
+ *
+ * Each connection is served by its own thread, so the broker keeps up with
+ * a client without being the thing that is measured.  Setting delay holds
+ * every answer back to simulate a longer round trip.  The broker runs
+ * until the process exits.
+ * @return  Newly started Broker structure (NULL on failure).
+ */
+Broker *    broker_start() {
+    Broker *b = calloc(1, sizeof(Broker));
+    if (!b) return NULL;
+    mutex_init(&b->lock, NULL);
+
+    struct sockaddr_in address = { .sin_family = AF_INET, .sin_port = 0 };
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(address);
+    int on = 1;
+    if ((b->fd = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+        setsockopt(b->fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+        bind(b->fd, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+        listen(b->fd, SOMAXCONN) < 0 ||
+        getsockname(b->fd, (struct sockaddr *)&address, &length) < 0) {
+        error("Unable to listen: %s", strerror(errno));
+        if (b->fd >= 0) close(b->fd);
+        free(b);
+        return NULL;
+    }
+    snprintf(b->port, sizeof(b->port), "%d", ntohs(address.sin_port));
+    thread_create(&b->thread, NULL, broker_accept, b);
+    thread_detach(b->thread);
+    return b;
+}
+
+/**
+ * Count the queues subscribed to topic (lets a benchmark wait for its
+ * subscriptions to land before it starts publishing).
+ * @param   b       Broker structure.
+ * @param   topic   Topic to count subscribers of.
+ * @return  Number of subscribed queues.
+ */
+size_t      broker_subscribers(Broker *b, const char *topic) {
+    size_t count = 0;
+    mutex_lock(&b->lock);
+    for (BrokerSubscription *s = b->subscriptions[broker_hash(topic)]; s; s = s->next) {
+        if (streq(s->topic, topic)) count++;
+    }
+    mutex_unlock(&b->lock);
+    return count;
+}
+
+/* Internal Functions */
+
+/**
+ * Accept connections forever, handing each to a detached thread.
+ * @param   arg     Broker structure.
+ */
+void *          broker_accept(void *arg) {
+    Broker *b = (Broker *)arg;
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    pthread_attr_setstacksize(&attributes, BROKER_STACK);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+
+    while (true) {
+        int fd = accept(b->fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EINTR && errno != ECONNABORTED) error("Unable to accept: %s", strerror(errno));
+            continue;
+        }
+        BrokerConnection *c = calloc(1, sizeof(BrokerConnection));
+        if (!c) {
+            close(fd);
+            continue;
+        }
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        // Lets broker_hold measure delay from when requests came in
+        setsockopt(fd, SOL_SOCKET, SO_TIMESTAMP, &on, sizeof(on));
+        c->broker = b;
+        c->fd     = fd;
+        Thread thread;
+        thread_create(&thread, &attributes, broker_serve, c);
+    }
+    return NULL;
+}
+
+/**
+ * Serve requests on one connection until the client closes it (or sends
+ * an HTTP/1.0 request, which gets a one-shot response).
+ * @param   arg     BrokerConnection structure.
+ */
+void *          broker_serve(void *arg) {
+    BrokerConnection *c = (BrokerConnection *)arg;
+    char *head;
+    size_t length;
+
+    while ((head = broker_head(c, &length))) {
+        char method[16], uri[BUFSIZ], version[16];
+        if (sscanf(head, "%15s %8191s %15s", method, uri, version) != 3) break;
+        bool keep = !strcmp(version, "HTTP/1.1");
+        char *body = broker_body(c, length);
+        if (length && !body) break;
+        bool served = broker_route(c, keep, method, uri, body, length);
+        free(body);
+        if (!served || !keep) break;
+    }
+    close(c->fd);
+    free(c);
+    return NULL;
+}
+
+/**
+ * Read the next request head, leaving c->start at the body that follows.
+ * @param   c       BrokerConnection structure.
+ * @param   length  Where to store the Content-Length of the body.
+ * @return  Request head (NUL terminated, inside c->buffer) or NULL on EOF.
+ */
+char *          broker_head(BrokerConnection *c, size_t *length) {
+    char *end;
+    while (!(end = memmem(c->buffer + c->start, c->end - c->start, "\r\n\r\n", 4))) {
+        if (c->start) {
+            memmove(c->buffer, c->buffer + c->start, c->end - c->start);
+            c->end  -= c->start;
+            c->start = 0;
+        }
+        if (c->end == sizeof(c->buffer) - 1) return NULL;
+        ssize_t n = broker_recv(c, c->buffer + c->end, sizeof(c->buffer) - 1 - c->end);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return NULL;
+        c->end += n;
+    }
+    *end = 0;
+    char *head = c->buffer + c->start;
+    c->start   = end + 4 - c->buffer;
+
+    *length = 0;
+    for (char *line = strstr(head, "\r\n"); line; line = strstr(line + 2, "\r\n")) {
+        if (!strncasecmp(line + 2, "Content-Length:", 15)) *length = strtoul(line + 17, NULL, 10);
+    }
+    return head;
+}
+
+/**
+ * Read length bytes of request body (starting with any already buffered).
+ * @param   c       BrokerConnection structure.
+ * @param   length  Length of body.
+ * @return  Allocated NUL terminated body (NULL if empty or truncated).
+ */
+char *          broker_body(BrokerConnection *c, size_t length) {
+    if (!length) return NULL;
+    char *body = malloc(length + 1);
+    if (!body) return NULL;
+    if (!broker_read(c, body, length)) {
+        free(body);
+        return NULL;
+    }
+    body[length] = 0;
+    return body;
+}
+
+/**
+ * Read exactly length bytes (starting with any already buffered).
+ * @param   c       BrokerConnection structure.
+ * @param   data    Where to store bytes.
+ * @param   length  Number of bytes.
+ * @return  Whether or not all of them were read.
+ */
+bool            broker_read(BrokerConnection *c, char *data, size_t length) {
+    size_t have = c->end - c->start < length ? c->end - c->start : length;
+    memcpy(data, c->buffer + c->start, have);
+    c->start += have;
+    while (have < length) {
+        // Small reads go through the buffer so the next frame comes along
+        if (length - have < sizeof(c->buffer) / 2) {
+            ssize_t n = broker_recv(c, c->buffer, sizeof(c->buffer) - 1);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            size_t used = (size_t)n < length - have ? (size_t)n : length - have;
+            memcpy(data + have, c->buffer, used);
+            c->start = used;
+            c->end   = n;
+            have    += used;
+            continue;
+        }
+        ssize_t n = broker_recv(c, data + have, length - have);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        have += n;
+    }
+    return true;
+}
+
+/**
+ * Read whatever has come in on the connection (up to length bytes), noting
+ * when the kernel received it rather than when this thread got to it.
+ * @param   c       BrokerConnection structure.
+ * @param   data    Where to store bytes.
+ * @param   length  Most bytes to read.
+ * @return  Number of bytes read (as read returns).
+ */
+ssize_t         broker_recv(BrokerConnection *c, char *data, size_t length) {
+    char control[CMSG_SPACE(sizeof(struct timeval))];
+    struct iovec iov = { .iov_base = data, .iov_len = length };
+    struct msghdr message = {
+        .msg_iov        = &iov,
+        .msg_iovlen     = 1,
+        .msg_control    = control,
+        .msg_controllen = sizeof(control),
+    };
+    ssize_t n = recvmsg(c->fd, &message, 0);
+    if (n <= 0) return n;
+    c->arrived = broker_clock();
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message); cmsg; cmsg = CMSG_NXTHDR(&message, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMP) {
+            struct timeval tv;
+            memcpy(&tv, CMSG_DATA(cmsg), sizeof(tv));
+            c->arrived = tv.tv_sec * 1000000ULL + tv.tv_usec;
+        }
+    }
+    return n;
+}
+
+/**
+ * Hold an answer back until the broker's delay has passed since the bytes
+ * of the request it answers came in, as if it had crossed a slower link.
+ * Requests that came in while it was held are not held back again, so a
+ * client with several in flight waits out the delay once for all of them.
+ * @param   c       BrokerConnection structure.
+ */
+void            broker_hold(BrokerConnection *c) {
+    long delay = __atomic_load_n(&c->broker->delay, __ATOMIC_RELAXED);
+    if (delay <= 0) return;
+    uint64_t due = c->arrived + delay, now = broker_clock();
+    if (due > now) usleep(due - now);
+}
+
+/**
+ * Returns wall clock time in microseconds (the clock the kernel stamps
+ * received bytes with).
+ */
+uint64_t        broker_clock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/**
+ * Send a complete response with a text body.
+ * @param   c       BrokerConnection structure.
+ * @param   keep    Whether or not the connection stays open afterwards.
+ * @param   status  HTTP status code.
+ * @param   body    Response body.
+ * @return  Whether or not the response was sent.
+ */
+bool            broker_reply(BrokerConnection *c, bool keep, int status, const char *body) {
+    char header[BUFSIZ];
+    size_t length = strlen(body);
+    int used = snprintf(header, sizeof(header), "%s %d %s\r\nContent-Length: %zu\r\nContent-Type: text/plain\r\n\r\n",
+                        keep ? "HTTP/1.1" : "HTTP/1.0", status, status == 200 ? "OK" : "Error", length);
+    struct iovec iov[2] = {
+        { .iov_base = header,       .iov_len = used },
+        { .iov_base = (char *)body, .iov_len = length },
+    };
+    broker_hold(c);
+    return socket_sendv(c->fd, iov, length ? 2 : 1);
+}
+
+/**
+ * Dispatch one request to the route it names.
+ * @param   c       BrokerConnection structure.
+ * @param   keep    Whether or not the connection stays open afterwards.
+ * @param   method  Request method.
+ * @param   uri     Request URI (modified).
+ * @param   body    Request body (NULL if empty).
+ * @param   length  Length of request body.
+ * @return  Whether or not the connection can serve another request.
+ */
+bool            broker_route(BrokerConnection *c, bool keep, const char *method, char *uri, char *body, size_t length) {
+    Broker *b = c->broker;
+    char response[BUFSIZ];
+    // Queues grow without bound here, so capacity and overflow are not honoured
+    char *query = strchr(uri, '?');
+    if (query) *query++ = 0;
+
+    char from[NI_MAXHOST] = "";
+    broker_option(query, "from", from, sizeof(from));
+
+    if (streq(method, "PUT") && !strncmp(uri, "/topic/", 7)) {
+        size_t subscribers = broker_publish(b, uri + 7, body ? body : "", length, from);
+        if (!subscribers) {
+            snprintf(response, sizeof(response), "There are no subscribers for topic %s", uri + 7);
+            return broker_reply(c, keep, 404, response);
+        }
+        snprintf(response, sizeof(response), "Published message (%zu bytes) to %zu subscribers", length, subscribers);
+        return broker_reply(c, keep, 200, response);
+    }
+
+    if (streq(method, "PUT") && streq(uri, "/batch")) {
+        // Each message in the batch is framed as "$TOPIC $LENGTH\n$BODY"
+        size_t messages = 0, subscribers = 0, offset = 0;
+        while (offset < length) {
+            char *header  = body + offset;
+            char *newline = memchr(header, '\n', length - offset);
+            char *space   = newline ? memchr(header, ' ', newline - header) : NULL;
+            if (!space) return broker_reply(c, keep, 400, "Bad batch header");
+            *space = 0;
+            size_t size = strtoul(space + 1, NULL, 10);
+            offset = newline + 1 - body;
+            if (size > length - offset) return broker_reply(c, keep, 400, "Truncated batch");
+            subscribers += broker_publish(b, header, body + offset, size, from);
+            offset += size;
+            messages++;
+        }
+        snprintf(response, sizeof(response), "Published %zu messages to %zu subscribers", messages, subscribers);
+        return broker_reply(c, keep, 200, response);
+    }
+
+    char *queue = uri + (strncmp(uri, "/subscription/", 14) ? 0 : 14);
+    char *topic = queue != uri ? strchr(queue, '/') : NULL;
+    if (topic) {
+        *topic++ = 0;
+        bool add = streq(method, "PUT");
+        if (!add && !streq(method, "DELETE")) return broker_reply(c, keep, 405, "Method not allowed");
+        char no_local[8] = "";
+        broker_option(query, "nolocal", no_local, sizeof(no_local));
+        if (!broker_subscribe(b, queue, topic, add, streq(no_local, "1"))) return broker_reply(c, keep, 404, "Subscription not found");
+        snprintf(response, sizeof(response), "%s %s to %s", add ? "Subscribed" : "Unsubscribed", queue, topic);
+        return broker_reply(c, keep, 200, response);
+    }
+
+    if (streq(method, "GET") && !strncmp(uri, "/stream/", 8)) {
+        return broker_stream(c, keep, broker_queue(b, uri + 8, true));
+    }
+
+    if (streq(method, "GET") && !strncmp(uri, "/binary/", 8)) {
+        const char *upgrade = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: " FRAME_PROTOCOL "\r\n\r\n";
+        struct iovec iov = { .iov_base = (char *)upgrade, .iov_len = strlen(upgrade) };
+        return socket_sendv(c->fd, &iov, 1) && broker_binary(c, uri + 8);
+    }
+
+    if (streq(method, "GET") && !strncmp(uri, "/queue/", 7)) {
+        // Hold the request open until a message arrives or the wait runs out
+        char *option = query ? strstr(query, "timeout=") : NULL;
+        long timeout = option ? strtol(option + 8, NULL, 10) : BROKER_POLL;
+        BrokerQueue *q = broker_queue(b, uri + 7, false);
+        if (!q) return broker_reply(c, keep, 404, "There is no queue");
+        mutex_lock(&b->lock);
+        BrokerMessage *m = NULL;
+        if (broker_wait(b, q, timeout * 1000) && (m = q->head) && !(q->head = m->next)) q->tail = NULL;
+        mutex_unlock(&b->lock);
+        if (!m) return broker_reply(c, keep, 204, "");
+        bool sent = broker_reply(c, keep, 200, m->body);
+        free(m);
+        return sent;
+    }
+
+    return broker_reply(c, keep, 404, "Not found");
+}
+
+/**
+ * Send messages from queue as one long-lived response, each framed as
+ * "$LENGTH\n$BODY" (in HTTP chunks when the connection is HTTP/1.1), until
+ * the client goes away.
+ * @param   c       BrokerConnection structure.
+ * @param   keep    Whether or not the response is chunked.
+ * @param   q       Queue to stream.
+ * @return  Always false (a stream only ends when the connection does).
+ */
+bool            broker_stream(BrokerConnection *c, bool keep, BrokerQueue *q) {
+    Broker *b = c->broker;
+    const char *header = keep ? "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\nTransfer-Encoding: chunked\r\n\r\n"
+                              : "HTTP/1.0 200 OK\r\nContent-Type: application/octet-stream\r\n\r\n";
+    struct iovec iov[2 + 2 * BROKER_FRAMES];
+    char frames[BROKER_FRAMES][32], chunk[32];
+    BrokerMessage *messages[BROKER_FRAMES];
+
+    iov[0].iov_base = (char *)header;
+    iov[0].iov_len  = strlen(header);
+    if (!socket_sendv(c->fd, iov, 1)) return false;
+
+    while (true) {
+        // Take whatever is already waiting (up to a chunk's worth)
+        size_t count = 0;
+        mutex_lock(&b->lock);
+        broker_wait(b, q, BROKER_WAIT);
+        while (q->head && count < BROKER_FRAMES) {
+            messages[count++] = q->head;
+            if (!(q->head = q->head->next)) q->tail = NULL;
+        }
+        mutex_unlock(&b->lock);
+        if (!count) {
+            if (broker_closed(c->fd)) return false;
+            continue;
+        }
+
+        int iovcnt = 1;
+        size_t total = 0;
+        for (size_t i = 0; i < count; i++) {
+            int used = sprintf(frames[i], "%zu\n", messages[i]->length);
+            iov[iovcnt].iov_base   = frames[i];
+            iov[iovcnt++].iov_len  = used;
+            iov[iovcnt].iov_base   = messages[i]->body;
+            iov[iovcnt++].iov_len  = messages[i]->length;
+            total += used + messages[i]->length;
+        }
+        if (keep) {
+            iov[0].iov_base       = chunk;
+            iov[0].iov_len        = sprintf(chunk, "%zx\r\n", total);
+            iov[iovcnt].iov_base  = "\r\n";
+            iov[iovcnt++].iov_len = 2;
+        }
+        bool sent = socket_sendv(c->fd, keep ? iov : iov + 1, keep ? iovcnt : iovcnt - 1);
+        for (size_t i = 0; i < count; i++) free(messages[i]);
+        if (!sent) return false;
+    }
+}
+
+/**
+ * Serve binary frames (see frame.h) on behalf of queue until the client
+ * closes the connection.  Answers are sent together once every frame
+ * already read has been handled.
+ * @param   c       BrokerConnection structure.
+ * @param   queue   Name of queue the connection belongs to.
+ * @return  Always false (binary frames only end with the connection).
+ */
+bool            broker_binary(BrokerConnection *c, const char *queue) {
+    Broker *b = c->broker;
+    char header[FRAME_HEADER], answers[BROKER_FRAMES][FRAME_HEADER];
+    char **topics = NULL;
+    size_t named = 0, answered = 0;
+    bool open = true;
+
+    while (open && broker_read(c, header, FRAME_HEADER)) {
+        Opcode opcode;
+        uint32_t id;
+        size_t length;
+        frame_parse(header, &opcode, &id, &length);
+        char *payload = broker_body(c, length);
+        if (length && !payload) break;
+        const char *topic = id < named ? topics[id] : NULL;
+        int status = 0;
+
+        switch (opcode) {
+            case OP_TOPIC:
+                if (id >= named) {
+                    char **grown = realloc(topics, (id + 1) * sizeof(char *));
+                    if (!grown) {
+                        open = false;
+                        break;
+                    }
+                    memset(grown + named, 0, (id + 1 - named) * sizeof(char *));
+                    topics = grown;
+                    named  = id + 1;
+                }
+                free(topics[id]);
+                topics[id] = payload;
+                payload    = NULL;
+                break;
+            case OP_PUBLISH:
+                status = topic && broker_publish(b, topic, payload ? payload : "", length, queue) ? 200 : 404;
+                break;
+            case OP_SUBSCRIBE:
+            case OP_UNSUBSCRIBE: {
+                // Subscription options come as the payload, in the same form as the HTTP query
+                char no_local[8] = "";
+                broker_option(payload, "nolocal", no_local, sizeof(no_local));
+                status = topic && broker_subscribe(b, queue, topic, opcode == OP_SUBSCRIBE, streq(no_local, "1")) ? 200 : 404;
+                break;
+            }
+            case OP_FETCH:
+                open = broker_fetch(c, broker_queue(b, queue, true), id);
+                break;
+            default:
+                status = 400;
+        }
+        free(payload);
+
+        if (status) frame_header(answers[answered++], OP_STATUS, status, 0);
+        if (answered && (answered == BROKER_FRAMES || c->start == c->end || !open)) {
+            struct iovec iov = { .iov_base = answers, .iov_len = answered * FRAME_HEADER };
+            broker_hold(c);
+            open    = open && socket_sendv(c->fd, &iov, 1);
+            answered = 0;
+        }
+    }
+    for (size_t i = 0; i < named; i++) free(topics[i]);
+    free(topics);
+    return false;
+}
+
+/**
+ * Send messages from queue as OP_MESSAGE frames until limit of them have
+ * been sent (ending with an OP_STATUS frame) or the client goes away.
+ * @param   c       BrokerConnection structure.
+ * @param   q       Queue to fetch from.
+ * @param   limit   Most messages to send (0 for no limit).
+ * @return  Whether or not the connection can carry more frames.
+ */
+bool            broker_fetch(BrokerConnection *c, BrokerQueue *q, size_t limit) {
+    Broker *b = c->broker;
+    struct iovec iov[2 * BROKER_FRAMES + 1];
+    char frames[BROKER_FRAMES + 1][FRAME_HEADER];
+    BrokerMessage *messages[BROKER_FRAMES];
+    size_t sent = 0;
+
+    while (!limit || sent < limit) {
+        size_t count = 0;
+        mutex_lock(&b->lock);
+        broker_wait(b, q, BROKER_WAIT);
+        while (q->head && count < BROKER_FRAMES && (!limit || sent + count < limit)) {
+            messages[count++] = q->head;
+            if (!(q->head = q->head->next)) q->tail = NULL;
+        }
+        mutex_unlock(&b->lock);
+        if (!count) {
+            if (broker_closed(c->fd)) return false;
+            continue;
+        }
+
+        int iovcnt = 0;
+        for (size_t i = 0; i < count; i++) {
+            frame_header(frames[i], OP_MESSAGE, 0, messages[i]->length);
+            iov[iovcnt].iov_base   = frames[i];
+            iov[iovcnt++].iov_len  = FRAME_HEADER;
+            iov[iovcnt].iov_base   = messages[i]->body;
+            iov[iovcnt++].iov_len  = messages[i]->length;
+        }
+        sent += count;
+        if (limit && sent == limit) {
+            frame_header(frames[count], OP_STATUS, 200, 0);
+            iov[iovcnt].iov_base   = frames[count];
+            iov[iovcnt++].iov_len  = FRAME_HEADER;
+        }
+        bool ok = socket_sendv(c->fd, iov, iovcnt);
+        for (size_t i = 0; i < count; i++) free(messages[i]);
+        if (!ok) return false;
+    }
+    return true;
+}
+
+/**
+ * Find queue by name.
+ * @param   b       Broker structure.
+ * @param   name    Name of queue.
+ * @param   create  Whether or not to create the queue if it does not exist.
+ * @return  Queue (NULL if it does not exist and was not created).
+ */
+BrokerQueue *   broker_queue(Broker *b, const char *name, bool create) {
+    BrokerQueue *q;
+    mutex_lock(&b->lock);
+    BrokerQueue **bucket = &b->queues[broker_hash(name)];
+    for (q = *bucket; q && !streq(q->name, name); q = q->next);
+    if (!q && create && (q = calloc(1, sizeof(BrokerQueue)))) {
+        snprintf(q->name, sizeof(q->name), "%s", name);
+        cond_init(&q->ready, NULL);
+        q->next = *bucket;
+        *bucket = q;
+    }
+    mutex_unlock(&b->lock);
+    return q;
+}
+
+/**
+ * Append a copy of message to every queue subscribed to topic, except the
+ * publisher's own if it subscribed with nolocal.
+ * @param   b       Broker structure.
+ * @param   topic   Topic message was published to.
+ * @param   body    Message body.
+ * @param   length  Length of message body.
+ * @param   from    Queue of the client that published it (empty if unknown).
+ * @return  Number of queues the message was appended to.
+ */
+size_t          broker_publish(Broker *b, const char *topic, const char *body, size_t length, const char *from) {
+    size_t subscribers = 0;
+    mutex_lock(&b->lock);
+    for (BrokerSubscription *s = b->subscriptions[broker_hash(topic)]; s; s = s->next) {
+        if (!streq(s->topic, topic) || (s->no_local && streq(s->queue->name, from))) continue;
+        BrokerMessage *m = malloc(sizeof(BrokerMessage) + length + 1);
+        if (!m) break;
+        m->next   = NULL;
+        m->length = length;
+        memcpy(m->body, body, length);
+        m->body[length] = 0;
+        if (s->queue->tail) s->queue->tail->next = m;
+        else s->queue->head = m;
+        s->queue->tail = m;
+        cond_signal(&s->queue->ready);
+        subscribers++;
+    }
+    mutex_unlock(&b->lock);
+    return subscribers;
+}
+
+/**
+ * Subscribe queue to topic (creating the queue), or unsubscribe it.
+ * @param   b       Broker structure.
+ * @param   queue   Name of queue.
+ * @param   topic   Topic to subscribe to.
+ * @param   add     Whether to subscribe (true) or unsubscribe (false).
+ * @param   no_local    Whether to leave out messages the queue's own client publishes.
+ * @return  Whether or not the subscription was changed.
+ */
+bool            broker_subscribe(Broker *b, const char *queue, const char *topic, bool add, bool no_local) {
+    BrokerQueue *q = broker_queue(b, queue, add);
+    if (!q) return false;
+
+    bool changed = false;
+    mutex_lock(&b->lock);
+    BrokerSubscription **s = &b->subscriptions[broker_hash(topic)];
+    while (*s && !((*s)->queue == q && streq((*s)->topic, topic))) s = &(*s)->next;
+    if (add && !*s && (*s = calloc(1, sizeof(BrokerSubscription)))) {
+        snprintf((*s)->topic, sizeof((*s)->topic), "%s", topic);
+        (*s)->queue = q;
+        changed = true;
+    } else if (!add && *s) {
+        BrokerSubscription *old = *s;
+        *s = old->next;
+        free(old);
+        changed = true;
+    } else if (add) {
+        changed = true;
+    }
+    if (add && *s) (*s)->no_local = no_local;
+    mutex_unlock(&b->lock);
+    return changed;
+}
+
+/**
+ * Find an option in a query string.
+ * @param   query   Query (after the '?'; NULL if there is none).
+ * @param   name    Name of option.
+ * @param   value   Where to copy its value (left alone if it is not given).
+ * @param   size    Size of value buffer.
+ * @return  Whether or not the option was given.
+ */
+bool            broker_option(const char *query, const char *name, char *value, size_t size) {
+    size_t length = strlen(name);
+    for (const char *option = query; option && *option; option = strchr(option, '&') ? strchr(option, '&') + 1 : NULL) {
+        if (strncmp(option, name, length) || option[length] != '=') continue;
+        snprintf(value, size, "%.*s", (int)strcspn(option + length + 1, "&"), option + length + 1);
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Hash queue or topic name to its bucket (FNV-1a).
+ * @param   name    Name to hash.
+ */
+size_t          broker_hash(const char *name) {
+    uint32_t hash = 2166136261u;
+    for (const unsigned char *c = (const unsigned char *)name; *c; c++) hash = (hash ^ *c) * 16777619u;
+    return hash % BROKER_BUCKETS;
+}
+
+/**
+ * Wait (with b->lock held) for queue to have a message.
+ * @param   b               Broker structure.
+ * @param   q               Queue to wait on.
+ * @param   milliseconds    Longest time to wait.
+ * @return  Whether or not queue has a message.
+ */
+bool            broker_wait(Broker *b, BrokerQueue *q, long milliseconds) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec  += milliseconds / 1000;
+    deadline.tv_nsec += (milliseconds % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec  += 1;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    while (!q->head && pthread_cond_timedwait(&q->ready, &b->lock, &deadline) != ETIMEDOUT);
+    return q->head != NULL;
+}
+
+/**
+ * Check without blocking whether the client has closed connection.
+ * @param   fd      Connection socket.
+ */
+bool            broker_closed(int fd) {
+    char byte;
+    ssize_t n = recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
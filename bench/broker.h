@@ -0,0 +1,61 @@
+/* broker.h: In-process stand-in broker for benchmarks */
+
+#ifndef BROKER_H
+#define BROKER_H
+
+#include "mq/thread.h"
+
+#include <netdb.h>
+#include <stdbool.h>
+
+/* Constants */
+
+#define BROKER_BUFFER   (8 * BUFSIZ)    /* Bytes of request head buffered per connection */
+#define BROKER_STACK    (256 * 1024)    /* Stack size of connection threads */
+#define BROKER_BUCKETS  16384           /* Hash buckets for queues and for topics */
+
+/* Structures */
+
+typedef struct BrokerMessage BrokerMessage;
+struct BrokerMessage {
+    BrokerMessage * next;
+    size_t          length;
+    char            body[];
+};
+
+typedef struct BrokerQueue BrokerQueue;
+struct BrokerQueue {
+    char            name[NI_MAXHOST];
+    BrokerMessage * head;
+    BrokerMessage * tail;
+    Cond            ready;          // Signalled when a message is appended
+    BrokerQueue *   next;
+};
+
+typedef struct BrokerSubscription BrokerSubscription;
+struct BrokerSubscription {
+    char            topic[NI_MAXHOST];
+    BrokerQueue *   queue;
+    bool            no_local;       // Leave out messages the queue's own client publishes
+    BrokerSubscription *next;
+};
+
+typedef struct Broker Broker;
+struct Broker {
+    int             fd;             // Listening socket
+    char            port[NI_MAXSERV];
+    Thread          thread;         // Accepts connections
+    Mutex           lock;           // Guards queues and subscriptions
+    long            delay;          // Microseconds answers are held back (simulated round trip)
+    BrokerQueue *   queues[BROKER_BUCKETS];                 // By hash of name
+    BrokerSubscription *subscriptions[BROKER_BUCKETS];      // By hash of topic
+};
+
+/* Functions */
+
+Broker *    broker_start();
+size_t      broker_subscribers(Broker *b, const char *topic);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
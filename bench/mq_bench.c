@@ -0,0 +1,467 @@
+/* mq_bench.c: Client benchmarks against an in-process broker */
+
+#include "broker.h"
+#include "mq/client.h"
+#include "mq/io_pool.h"
+#include "mq/response.h"
+#include "mq/socket.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define THROUGHPUT_MESSAGES 100000      /* Messages published per throughput run */
+#define THROUGHPUT_WARMUP   16384       /* Messages published before it (several incoming rings' worth) */
+#define LATENCY_SAMPLES     10000       /* Round trips timed per latency run */
+#define IDLE_SAMPLES        1000        /* Round trips timed per idle queue run */
+#define IDLE_GAP            2000        /* Microseconds a queue sits idle between them */
+#define FANOUT_DELIVERIES   100000      /* Deliveries aimed for per fan-out run */
+#define FANOUT_MAX          1000        /* Largest number of subscribers */
+#define FANOUT_FDS          10          /* Descriptors a subscriber costs (client and broker) */
+#define CROWD_QUEUES        100000      /* Idle queues registered before the crowded run */
+#define CROWD_WINDOW        64          /* Subscriptions sent per round trip while registering them */
+#define PIPELINE_TIME       1000000     /* Microseconds of round trips per pipelined run (roughly) */
+#define PIPELINE_WINDOW     16          /* Requests in flight when pipelining */
+#define MESSAGE_SIZE        64          /* Bytes of payload per message */
+#define RECEIVE_TIMEOUT     10000       /* Milliseconds without a message before giving up */
+#define RECEIVE_MAX         256         /* Most messages taken from a client at once */
+#define SETTLE_TIMEOUT      10000       /* Milliseconds to wait for subscriptions to land */
+#define SETTLE_DELAY        500000      /* Microseconds allowed for them on an external server */
+
+/* Globals */
+
+Broker *    TheBroker = NULL;
+const char *Host      = "127.0.0.1";
+const char *Port      = NULL;
+FILE *      Results   = NULL;
+
+/* Helpers */
+
+uint64_t now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Print a result and append it to the results file as a CSV row:
+ *
+ *  benchmark,variant,size,metric,value
+ */
+void record(const char *benchmark, const char *variant, size_t size, const char *metric, double value) {
+    printf("%-20s %-10s %6zu %-24s %14.1f\n", benchmark, variant, size, metric, value);
+    fflush(stdout);
+    if (Results) fprintf(Results, "%s,%s,%zu,%s,%.1f\n", benchmark, variant, size, metric, value);
+}
+
+MessageQueue * client(const char *name, MQMode mode, IOPool *pool) {
+    MessageQueue *mq = mq_create(name, Host, Port);
+    if (!mq) return NULL;
+    mq->mode    = mode;
+    mq->io_pool = pool;
+    return mq;
+}
+
+const char * mode_name(MQMode mode) {
+    switch (mode) {
+        case MQ_THREADED:   return "threaded";
+        case MQ_EVENTS:     return "events";
+        case MQ_POOLED:     return "pooled";
+    }
+    return "unknown";
+}
+
+/**
+ * Wait until count queues are subscribed to topic (or, when running
+ * against an external server that cannot be asked, long enough for them
+ * to have been).
+ */
+bool settle(const char *topic, size_t count) {
+    if (!TheBroker) {
+        usleep(SETTLE_DELAY);
+        return true;
+    }
+    for (int waited = 0; waited < SETTLE_TIMEOUT; waited++) {
+        if (broker_subscribers(TheBroker, topic) >= count) return true;
+        usleep(1000);
+    }
+    error("Only %zu of %zu subscriptions to %s landed", broker_subscribers(TheBroker, topic), count, topic);
+    return false;
+}
+
+/**
+ * Take expected messages from any of the given clients, waiting on their
+ * descriptors in between.
+ * @return  Number of messages taken (short if RECEIVE_TIMEOUT passed).
+ */
+size_t receive(MessageQueue **mqs, size_t count, size_t expected) {
+    struct pollfd *fds = calloc(count, sizeof(struct pollfd));
+    size_t received = 0;
+    if (!fds) return 0;
+    for (size_t i = 0; i < count; i++) {
+        fds[i].fd     = mq_fd(mqs[i]);
+        fds[i].events = POLLIN;
+    }
+
+    while (received < expected) {
+        size_t ready = 0;
+        for (size_t i = 0; i < count; i++) {
+            char *messages[RECEIVE_MAX];
+            size_t n;
+            // The sentinel of a stopped client is never handed back, so is not counted
+            ready += mq_process_events(mqs[i]);
+            while ((n = mq_retrieve_many(mqs[i], messages, RECEIVE_MAX)) > 0) {
+                for (size_t m = 0; m < n; m++) mq_release(mqs[i], messages[m]);
+                received += n;
+            }
+        }
+        if (!ready && received < expected && poll(fds, count, RECEIVE_TIMEOUT) <= 0) break;
+    }
+    free(fds);
+    return received;
+}
+
+/**
+ * Publish messages from a thread of their own, so that the receiving side
+ * keeps draining while a server that pushes back holds up the publisher.
+ */
+typedef struct Publisher Publisher;
+struct Publisher {
+    MessageQueue *  mq;
+    const char *    topic;
+    const char *    payload;
+    size_t          count;
+};
+
+void * publisher(void *arg) {
+    Publisher *p = (Publisher *)arg;
+    for (size_t i = 0; i < p->count; i++) mq_publish(p->mq, p->topic, p->payload);
+    return NULL;
+}
+
+void stop(MessageQueue **mqs, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (!mqs[i]) continue;
+        mq_stop(mqs[i]);
+        mq_delete(mqs[i]);
+    }
+}
+
+/**
+ * Register count idle queues with the server, each subscribed to a topic
+ * of its own, pipelining CROWD_WINDOW subscriptions per round trip.
+ * @return  Whether or not every subscription was accepted.
+ */
+bool crowd(size_t count) {
+    RequestPool *pool   = request_pool_create();
+    Response *response  = calloc(1, sizeof(Response));
+    char (*headers)[REQUEST_HEADER] = calloc(CROWD_WINDOW, REQUEST_HEADER);
+    struct iovec iov[CROWD_WINDOW];
+    int fd = socket_dial(Host, Port);
+    bool accepted = pool && response && headers && fd >= 0;
+    uint64_t start = now();
+
+    if (accepted) response_init(response);
+    for (size_t sent = 0; accepted && sent < count; ) {
+        size_t window = count - sent < CROWD_WINDOW ? count - sent : CROWD_WINDOW;
+        for (size_t i = 0; i < window; i++) {
+            char uri[BUFSIZ];
+            snprintf(uri, sizeof(uri), "/subscription/idle-%zu/idle-%zu", sent + i, sent + i);
+            Request request = { .method = METHOD_PUT, .uri = uri };
+            if (!request_iovec(&request, Host, headers[i], REQUEST_HEADER, &iov[i])) accepted = false;
+        }
+        if (!accepted || !socket_sendv(fd, iov, window)) break;
+        for (size_t i = 0; i < window; i++) {
+            int done;
+            while ((done = response_read(response, fd, pool, false)) == 0);
+            if (done < 0 || response->status != 200) accepted = false;
+            response_next(response);
+        }
+        sent += window;
+    }
+    if (accepted) record("crowd_registration", "pipelined", count, "subscriptions_per_second", count / ((now() - start) / 1e9));
+    else error("Unable to register %zu idle queues", count);
+
+    if (fd >= 0) close(fd);
+    if (response) response_init(response);
+    free(response);
+    free(headers);
+    if (pool) request_pool_delete(pool);
+    return accepted;
+}
+
+/* Benchmarks */
+
+/**
+ * Time how long a stream of messages takes to get from one publisher to
+ * one subscriber, sent one request per message or in batches.  The result
+ * is recorded under benchmark with the given size, along with how many heap
+ * allocations either client's request pool made once warmed up.
+ * @return  Those allocations (which should be none).
+ */
+size_t throughput(const char *benchmark, MQMode mode, size_t batch, size_t size, IOPool *pool) {
+    char topic[NI_MAXSERV], name[BUFSIZ], payload[MESSAGE_SIZE + 1];
+    MessageQueue *mqs[2] = { NULL, NULL };
+    size_t mallocs = 0;
+
+    snprintf(topic, sizeof(topic), "%s-%s-%zu", benchmark, mode_name(mode), batch);
+    memset(payload, 'x', MESSAGE_SIZE);
+    payload[MESSAGE_SIZE] = 0;
+    snprintf(name, sizeof(name), "%s-sub", topic);
+    if (!(mqs[0] = client(name, mode, pool))) return 0;
+    mqs[0]->capacity = THROUGHPUT_MESSAGES;     // Nothing overflows, however far ahead the publisher gets
+    snprintf(name, sizeof(name), "%s-pub", topic);
+    if (!(mqs[1] = client(name, mode, pool))) goto done;
+    mqs[1]->batch_count = batch;
+
+    mq_subscribe(mqs[0], topic);
+    mq_start(mqs[0]);
+    mq_start(mqs[1]);
+    if (!settle(topic, 1)) goto done;
+
+    // Warm up with the subscriber's backlog as deep as it gets (publishing
+    // everything before draining any), so that its pool carves as many
+    // requests as can be live at once before the timed run starts
+    Publisher args = { mqs[1], topic, payload, THROUGHPUT_WARMUP };
+    Thread thread;
+    publisher(&args);
+    size_t received = receive(mqs, 1, THROUGHPUT_WARMUP);
+    if (received < THROUGHPUT_WARMUP) {
+        error("Received %zu of %d warm-up messages", received, THROUGHPUT_WARMUP);
+        goto done;
+    }
+
+    // Past warm-up every request should come from a slab already carved
+    mallocs        = __atomic_load_n(&mqs[0]->pool->mallocs, __ATOMIC_RELAXED) +
+                     __atomic_load_n(&mqs[1]->pool->mallocs, __ATOMIC_RELAXED);
+    args.count     = THROUGHPUT_MESSAGES;
+    uint64_t start = now();
+    thread_create(&thread, NULL, publisher, &args);
+    received        = receive(mqs, 1, THROUGHPUT_MESSAGES);
+    double seconds  = (now() - start) / 1e9;
+    thread_join(thread, NULL);
+    mallocs = __atomic_load_n(&mqs[0]->pool->mallocs, __ATOMIC_RELAXED) +
+              __atomic_load_n(&mqs[1]->pool->mallocs, __ATOMIC_RELAXED) - mallocs;
+
+    if (received < THROUGHPUT_MESSAGES) error("Received %zu of %d messages", received, THROUGHPUT_MESSAGES);
+    record(benchmark, mode_name(mode), size, "messages_per_second", received / seconds);
+    record(benchmark, mode_name(mode), size, "steady_mallocs", mallocs);
+
+done:
+    stop(mqs, 2);
+    return mallocs;
+}
+
+/**
+ * Time publishing single messages over a link with the given round trip,
+ * waiting for each answer before sending the next request or keeping
+ * window of them in flight.  Only the in-process broker can hold its
+ * answers back, so this is skipped against an external server.
+ */
+void pipeline(long rtt, size_t window) {
+    char topic[NI_MAXSERV], name[BUFSIZ], variant[NI_MAXSERV], payload[MESSAGE_SIZE + 1];
+    MessageQueue *mqs[2] = { NULL, NULL };
+    size_t messages = PIPELINE_TIME / rtt * window;
+    if (!TheBroker) return;
+    if (messages > THROUGHPUT_MESSAGES) messages = THROUGHPUT_MESSAGES;
+
+    snprintf(variant, sizeof(variant), "%gms", rtt / 1e3);
+    snprintf(topic, sizeof(topic), "pipeline-%ld-%zu", rtt, window);
+    memset(payload, 'x', MESSAGE_SIZE);
+    payload[MESSAGE_SIZE] = 0;
+    snprintf(name, sizeof(name), "%s-sub", topic);
+    if (!(mqs[0] = client(name, MQ_THREADED, NULL))) return;
+    mqs[0]->capacity = messages;
+    snprintf(name, sizeof(name), "%s-pub", topic);
+    if (!(mqs[1] = client(name, MQ_THREADED, NULL))) goto done;
+    mqs[1]->window = window;
+
+    mq_subscribe(mqs[0], topic);
+    mq_start(mqs[0]);
+    mq_start(mqs[1]);
+    if (!settle(topic, 1)) goto done;
+
+    __atomic_store_n(&TheBroker->delay, rtt, __ATOMIC_RELAXED);
+    Publisher args = { mqs[1], topic, payload, messages };
+    Thread thread;
+    uint64_t start = now();
+    thread_create(&thread, NULL, publisher, &args);
+    size_t received = receive(mqs, 1, messages);
+    double seconds  = (now() - start) / 1e9;
+    thread_join(thread, NULL);
+
+    if (received < messages) error("Received %zu of %zu messages", received, messages);
+    record("pipelined_publish", variant, window, "messages_per_second", received / seconds);
+
+done:
+    stop(mqs, 2);
+    __atomic_store_n(&TheBroker->delay, 0, __ATOMIC_RELAXED);
+}
+
+static int compare(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Time round trips of single messages from publish to retrieve, either
+ * back to back over a stream or after the queue has sat idle with a
+ * GET /queue waiting on it.
+ */
+void latency(MQMode mode, IOPool *pool, bool streaming) {
+    char topic[NI_MAXSERV], name[BUFSIZ], payload[MESSAGE_SIZE + 1];
+    MessageQueue *mqs[2] = { NULL, NULL };
+    size_t samples_max = streaming ? LATENCY_SAMPLES : IDLE_SAMPLES;
+    uint64_t *samples  = calloc(samples_max, sizeof(uint64_t));
+    size_t count = 0;
+    if (!samples) return;
+
+    snprintf(topic, sizeof(topic), "latency-%s-%s", mode_name(mode), streaming ? "stream" : "idle");
+    memset(payload, 'x', MESSAGE_SIZE);
+    payload[MESSAGE_SIZE] = 0;
+    snprintf(name, sizeof(name), "%s-sub", topic);
+    if (!(mqs[0] = client(name, mode, pool))) goto done;
+    mqs[0]->streaming = streaming;
+    snprintf(name, sizeof(name), "%s-pub", topic);
+    if (!(mqs[1] = client(name, mode, pool))) goto done;
+
+    mq_subscribe(mqs[0], topic);
+    mq_start(mqs[0]);
+    mq_start(mqs[1]);
+    if (!settle(topic, 1)) goto done;
+
+    for (count = 0; count < samples_max; count++) {
+        if (!streaming) usleep(IDLE_GAP);
+        uint64_t start = now();
+        mq_publish(mqs[1], topic, payload);
+        if (!receive(mqs, 1, 1)) break;
+        samples[count] = now() - start;
+    }
+    if (count < samples_max) error("Timed %zu of %zu round trips", count, samples_max);
+    if (!count) goto done;
+
+    const char *benchmark = streaming ? "latency" : "idle_latency";
+    qsort(samples, count, sizeof(uint64_t), compare);
+    record(benchmark, mode_name(mode), MESSAGE_SIZE, "p50_usec",  samples[count * 500 / 1000] / 1e3);
+    record(benchmark, mode_name(mode), MESSAGE_SIZE, "p99_usec",  samples[count * 990 / 1000] / 1e3);
+    record(benchmark, mode_name(mode), MESSAGE_SIZE, "p999_usec", samples[count * 999 / 1000] / 1e3);
+
+done:
+    stop(mqs, 2);
+    free(samples);
+}
+
+/**
+ * Time delivery of messages from one publisher to many subscribers (run
+ * on a shared I/O pool so a thousand of them stay affordable).
+ */
+void fanout(size_t subscribers, IOPool *pool) {
+    char topic[NI_MAXSERV], name[BUFSIZ], payload[MESSAGE_SIZE + 1];
+    MessageQueue **mqs = calloc(subscribers, sizeof(MessageQueue *));
+    MessageQueue *source = NULL;
+    size_t messages = FANOUT_DELIVERIES / subscribers < 100 ? 100 : FANOUT_DELIVERIES / subscribers;
+    if (!mqs) return;
+
+    snprintf(topic, sizeof(topic), "fanout-%zu", subscribers);
+    memset(payload, 'x', MESSAGE_SIZE);
+    payload[MESSAGE_SIZE] = 0;
+    for (size_t i = 0; i < subscribers; i++) {
+        snprintf(name, sizeof(name), "%s-sub-%zu", topic, i);
+        if (!(mqs[i] = client(name, MQ_POOLED, pool))) goto done;
+        mqs[i]->capacity = messages;
+        mq_subscribe(mqs[i], topic);
+        mq_start(mqs[i]);
+    }
+    snprintf(name, sizeof(name), "%s-pub", topic);
+    if (!(source = client(name, MQ_THREADED, NULL))) goto done;
+    source->batch_count = 64;
+    mq_start(source);
+    if (!settle(topic, subscribers)) goto done;
+
+    Publisher args = { source, topic, payload, messages };
+    Thread thread;
+    uint64_t start = now();
+    thread_create(&thread, NULL, publisher, &args);
+    size_t received = receive(mqs, subscribers, messages * subscribers);
+    double seconds  = (now() - start) / 1e9;
+    thread_join(thread, NULL);
+
+    if (received < messages * subscribers) error("Received %zu of %zu deliveries", received, messages * subscribers);
+    record("fanout", "pooled", subscribers, "deliveries_per_second", received / seconds);
+
+done:
+    // Subscribers go first so the publisher's sentinel has fewer queues to reach
+    stop(mqs, subscribers);
+    stop(&source, 1);
+    free(mqs);
+}
+
+/* Main Execution */
+
+int main(int argc, char *argv[]) {
+    const char *path = argc > 1 ? argv[1] : NULL;
+
+    if (path) {
+        if (!(Results = fopen(path, "a"))) {
+            error("Unable to open %s: %s", path, strerror(errno));
+            return EXIT_FAILURE;
+        }
+        if (!ftell(Results)) fprintf(Results, "benchmark,variant,size,metric,value\n");
+    }
+    // MQ_BENCH_HOST and MQ_BENCH_PORT point the benchmarks at a real server
+    if ((Port = getenv("MQ_BENCH_PORT"))) {
+        if (getenv("MQ_BENCH_HOST")) Host = getenv("MQ_BENCH_HOST");
+    } else {
+        if (!(TheBroker = broker_start())) return EXIT_FAILURE;
+        Port = TheBroker->port;
+    }
+
+    // Fan-out keeps a handful of descriptors open per subscriber
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    getrlimit(RLIMIT_NOFILE, &limit);
+
+    IOPool *pool = io_pool_create(0);
+    if (!pool) return EXIT_FAILURE;
+
+    printf("%-20s %-10s %6s %-24s %14s\n", "benchmark", "variant", "size", "metric", "value");
+    throughput("publish_throughput", MQ_THREADED, 1, 1, NULL);
+    throughput("publish_throughput", MQ_THREADED, 64, 64, NULL);
+    // A pooled client should not touch the heap per message once warmed up
+    size_t steady = throughput("publish_throughput", MQ_POOLED, 1, 1, pool);
+    steady       += throughput("publish_throughput", MQ_POOLED, 64, 64, pool);
+    // Keeping requests in flight matters more the longer the round trip
+    pipeline(100, 1);
+    pipeline(100, PIPELINE_WINDOW);
+    pipeline(10000, 1);
+    pipeline(10000, PIPELINE_WINDOW);
+    latency(MQ_THREADED, NULL, true);
+    latency(MQ_POOLED, pool, true);
+    latency(MQ_THREADED, NULL, false);
+    latency(MQ_POOLED, pool, false);
+    for (size_t subscribers = 1; subscribers <= FANOUT_MAX; subscribers *= 10) {
+        if (subscribers * FANOUT_FDS + 64 > limit.rlim_cur) {
+            error("Skipping fan-out to %zu subscribers (descriptor limit is %lu)", subscribers, (unsigned long)limit.rlim_cur);
+            break;
+        }
+        fanout(subscribers, pool);
+    }
+    // Publishing should cost the same however many other queues there are
+    if (crowd(CROWD_QUEUES)) throughput("crowded_throughput", MQ_THREADED, 64, CROWD_QUEUES, NULL);
+
+    io_pool_delete(pool);
+    if (Results) fclose(Results);
+    if (steady) {
+        error("Pooled clients made %zu heap allocations once warmed up", steady);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,393 @@
+/* mq_loadgen.c: Load generator for a broker */
+
+#include "broker.h"
+#include "mq/client.h"
+#include "mq/io_pool.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define STAMP_DIGITS    16          /* Hex digits of publish time at the front of each body */
+#define MAX_SIZE        (BUFSIZ - NI_MAXHOST - NI_MAXSERV)  /* Largest body mq_publish takes */
+#define RECEIVE_MAX     256         /* Most messages taken from a subscriber at once */
+#define POLL_WAIT       100         /* Milliseconds the receiver waits between checks */
+#define DRAIN_WAIT      2000        /* Milliseconds to wait for stragglers after the run */
+#define SETTLE_DELAY    500000      /* Microseconds allowed for subscriptions on an external server */
+
+/* Structures */
+
+typedef enum {
+    ARRIVAL_CONSTANT,       // Evenly spaced
+    ARRIVAL_POISSON,        // Exponentially distributed gaps with the same mean
+    ARRIVAL_BURST,          // Bursts of several back to back, spaced to keep the mean
+} Arrival;
+
+typedef struct Publisher Publisher;
+struct Publisher {
+    MessageQueue *  mq;
+    Thread          thread;
+    char            topic[NI_MAXSERV];
+    unsigned short  seed[3];        // For erand48
+    size_t          published;      // Messages published after warm-up
+    size_t          refused;        // Of those, ones mq_publish turned down
+};
+
+/* Globals */
+
+Broker *    TheBroker   = NULL;
+const char *Host        = "127.0.0.1";
+const char *Port        = NULL;
+MQMode      Mode        = MQ_THREADED;
+size_t      Publishers  = 1;
+size_t      Subscribers = 1;
+size_t      Topics      = 1;
+size_t      SizeMin     = 64;
+size_t      SizeMax     = 64;
+double      Rate        = 1000;     // Messages per second per publisher (0 for as fast as possible)
+Arrival     Pattern     = ARRIVAL_CONSTANT;
+size_t      Burst       = 10;
+double      Duration    = 10;       // Seconds measured
+double      Warmup      = 2;        // Seconds run before measuring
+size_t      Batch       = 1;
+size_t      Window      = 0;        // Requests in flight per publisher (0 for the client's default)
+uint64_t    Measuring   = 0;        // Wall clock microseconds at which warm-up ends
+uint64_t    Finishing   = 0;        // Wall clock microseconds at which the run ends
+bool        Stopped     = false;    // Set once publishers are done
+Stats *     Latency     = NULL;     // Delivery latencies of measured messages
+FILE *      Results     = NULL;
+
+/* Helpers */
+
+uint64_t wall() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/**
+ * Wait until wall clock time usec.  A client in event mode is only driven
+ * while its owner waits on it, so it is kept sending meanwhile.
+ */
+void pause_until(MessageQueue *mq, uint64_t usec) {
+    if (Mode != MQ_EVENTS) {
+        struct timespec ts = { usec / 1000000, (usec % 1000000) * 1000 };
+        while (clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &ts, NULL) == EINTR);
+        return;
+    }
+    struct pollfd pfd = { .fd = mq_fd(mq), .events = POLLIN };
+    for (uint64_t now = wall(); now < usec; now = wall()) {
+        poll(&pfd, 1, (usec - now + 999) / 1000);
+        mq_process_events(mq);
+    }
+}
+
+/**
+ * Print a result and append it to the results file as a CSV row:
+ *
+ *  benchmark,variant,size,metric,value
+ */
+void record(const char *variant, const char *metric, double value) {
+    printf("%-20s %-10s %6zu %-24s %14.1f\n", "loadgen", variant, SizeMax, metric, value);
+    fflush(stdout);
+    if (Results) fprintf(Results, "%s,%s,%zu,%s,%.1f\n", "loadgen", variant, SizeMax, metric, value);
+}
+
+const char * mode_name(MQMode mode) {
+    switch (mode) {
+        case MQ_THREADED:   return "threaded";
+        case MQ_EVENTS:     return "events";
+        case MQ_POOLED:     return "pooled";
+    }
+    return "unknown";
+}
+
+/**
+ * Returns microseconds until a publisher's next message is due.
+ */
+uint64_t gap(Publisher *p, size_t sent) {
+    switch (Pattern) {
+        case ARRIVAL_POISSON:
+            return -log(1 - erand48(p->seed)) * 1e6 / Rate;
+        case ARRIVAL_BURST:
+            return sent % Burst ? 0 : Burst * 1e6 / Rate;
+        default:
+            return 1e6 / Rate;
+    }
+}
+
+/* Threads */
+
+/**
+ * Publish to one topic at the configured rate until the run ends.  Each
+ * body starts with the time the message was due (not when it went out, so
+ * a publisher that falls behind shows up as latency rather than hiding it).
+ */
+void * publisher(void *arg) {
+    Publisher *p = (Publisher *)arg;
+    char       body[MAX_SIZE + 1];
+    uint64_t   due = wall();
+
+    for (size_t sent = 0; due < Finishing; sent++) {
+        size_t size = SizeMin + (SizeMax > SizeMin ? erand48(p->seed) * (SizeMax - SizeMin + 1) : 0);
+        char   stamp[STAMP_DIGITS + 1];
+        snprintf(stamp, sizeof(stamp), "%016" PRIx64, due);
+        memcpy(body, stamp, STAMP_DIGITS);
+        memset(body + STAMP_DIGITS, 'x', size - STAMP_DIGITS);
+        body[size] = 0;
+
+        if (wall() < due) pause_until(p->mq, due);
+        else if (Mode == MQ_EVENTS) mq_process_events(p->mq);
+        bool queued = mq_publish(p->mq, p->topic, body);
+        if (due >= Measuring) {
+            p->published++;
+            if (!queued) p->refused++;
+        }
+        // Flat out, each message is due as soon as the last is queued
+        due = Rate > 0 ? due + gap(p, sent + 1) : wall();
+    }
+    // Whatever is still queued in event mode has to be pushed out from here
+    for (uint64_t until = wall() + DRAIN_WAIT * 1000; Mode == MQ_EVENTS && queue_depth(p->mq->outgoing) && wall() < until;) {
+        pause_until(p->mq, wall() + POLL_WAIT * 1000);
+    }
+    return NULL;
+}
+
+/**
+ * Take messages from every subscriber, recording how long each measured
+ * one took to arrive, until publishers are done and nothing has arrived
+ * for DRAIN_WAIT.
+ * @return  Number of measured messages received (as a pointer-sized value).
+ */
+void * receiver(void *arg) {
+    MessageQueue **mqs      = (MessageQueue **)arg;
+    struct pollfd *fds      = calloc(Subscribers, sizeof(struct pollfd));
+    size_t         received = 0;
+    int            idle     = 0;
+    if (!fds) return NULL;
+    for (size_t i = 0; i < Subscribers; i++) {
+        fds[i].fd     = mq_fd(mqs[i]);
+        fds[i].events = POLLIN;
+    }
+
+    while (!__atomic_load_n(&Stopped, __ATOMIC_ACQUIRE) || idle < DRAIN_WAIT) {
+        size_t ready = 0;
+        for (size_t i = 0; i < Subscribers; i++) {
+            char * messages[RECEIVE_MAX];
+            size_t n;
+            mq_process_events(mqs[i]);
+            while ((n = mq_retrieve_many(mqs[i], messages, RECEIVE_MAX)) > 0) {
+                uint64_t now = wall();
+                for (size_t m = 0; m < n; m++) {
+                    // Messages arrive as "$NAME $TOPIC $BODY"
+                    char *body = strchr(messages[m], ' ');
+                    if (body) body = strchr(body + 1, ' ');
+                    if (body && strlen(body + 1) >= STAMP_DIGITS) {
+                        char stamp[STAMP_DIGITS + 1];
+                        memcpy(stamp, body + 1, STAMP_DIGITS);
+                        stamp[STAMP_DIGITS] = 0;
+                        uint64_t due = strtoull(stamp, NULL, 16);
+                        if (due >= Measuring && due < Finishing) {
+                            stats_latency(Latency, STATS_DELIVER, now > due ? now - due : 0);
+                            received++;
+                        }
+                    }
+                    mq_release(mqs[i], messages[m]);
+                }
+                ready += n;
+            }
+        }
+        if (ready) {
+            idle = 0;
+        } else if (poll(fds, Subscribers, POLL_WAIT) <= 0) {
+            idle += POLL_WAIT;
+        }
+    }
+    free(fds);
+    return (void *)received;
+}
+
+/* Main Execution */
+
+void usage(const char *program, int status) {
+    fprintf(stderr, "Usage: %s [options]\n", program);
+    fprintf(stderr, "    -h HOST     Host of broker (with -p)\n");
+    fprintf(stderr, "    -p PORT     Port of broker (in-process stand-in broker if not given)\n");
+    fprintf(stderr, "    -m MODE     Client mode: threaded, events, or pooled (default threaded)\n");
+    fprintf(stderr, "    -n COUNT    Publishers (default 1)\n");
+    fprintf(stderr, "    -s COUNT    Subscribers (default 1)\n");
+    fprintf(stderr, "    -t COUNT    Topics, shared round robin by both (default 1)\n");
+    fprintf(stderr, "    -b MIN[-MAX] Bytes per message, uniformly distributed (default 64)\n");
+    fprintf(stderr, "    -r RATE     Messages per second per publisher, 0 for flat out (default 1000)\n");
+    fprintf(stderr, "    -a PATTERN  Arrivals: constant, poisson, or burst[:SIZE] (default constant)\n");
+    fprintf(stderr, "    -B COUNT    Messages per publish batch (default 1)\n");
+    fprintf(stderr, "    -W COUNT    Requests in flight per publisher, threaded mode (default 16)\n");
+    fprintf(stderr, "    -d SECONDS  Time measured (default 10)\n");
+    fprintf(stderr, "    -w SECONDS  Warm-up time before measuring (default 2)\n");
+    fprintf(stderr, "    -o PATH     Append results to CSV file\n");
+    exit(status);
+}
+
+void parse(int argc, char *argv[]) {
+    int option;
+    while ((option = getopt(argc, argv, "h:p:m:n:s:t:b:r:a:B:W:d:w:o:")) != -1) {
+        switch (option) {
+            case 'h': Host        = optarg; break;
+            case 'p': Port        = optarg; break;
+            case 'n': Publishers  = strtoul(optarg, NULL, 10); break;
+            case 's': Subscribers = strtoul(optarg, NULL, 10); break;
+            case 't': Topics      = strtoul(optarg, NULL, 10); break;
+            case 'r': Rate        = strtod(optarg, NULL); break;
+            case 'B': Batch       = strtoul(optarg, NULL, 10); break;
+            case 'W': Window      = strtoul(optarg, NULL, 10); break;
+            case 'd': Duration    = strtod(optarg, NULL); break;
+            case 'w': Warmup      = strtod(optarg, NULL); break;
+            case 'm':
+                if (!strcmp(optarg, "threaded"))    Mode = MQ_THREADED;
+                else if (!strcmp(optarg, "events")) Mode = MQ_EVENTS;
+                else if (!strcmp(optarg, "pooled")) Mode = MQ_POOLED;
+                else usage(argv[0], EXIT_FAILURE);
+                break;
+            case 'b': {
+                char *end;
+                SizeMin = SizeMax = strtoul(optarg, &end, 10);
+                if (*end == '-') SizeMax = strtoul(end + 1, NULL, 10);
+                break;
+            }
+            case 'a':
+                if (!strcmp(optarg, "constant"))        Pattern = ARRIVAL_CONSTANT;
+                else if (!strcmp(optarg, "poisson"))    Pattern = ARRIVAL_POISSON;
+                else if (!strncmp(optarg, "burst", 5)) {
+                    Pattern = ARRIVAL_BURST;
+                    if (optarg[5] == ':') Burst = strtoul(optarg + 6, NULL, 10);
+                } else usage(argv[0], EXIT_FAILURE);
+                break;
+            case 'o':
+                if (!(Results = fopen(optarg, "a"))) {
+                    error("Unable to open %s: %s", optarg, strerror(errno));
+                    exit(EXIT_FAILURE);
+                }
+                if (!ftell(Results)) fprintf(Results, "benchmark,variant,size,metric,value\n");
+                break;
+            default:
+                usage(argv[0], EXIT_FAILURE);
+        }
+    }
+    if (!Publishers || !Topics || !Burst || Duration <= 0 || Warmup < 0) usage(argv[0], EXIT_FAILURE);
+    if (SizeMin < STAMP_DIGITS) SizeMin = STAMP_DIGITS;
+    if (SizeMax < SizeMin)      SizeMax = SizeMin;
+    if (SizeMax > MAX_SIZE)     SizeMax = MAX_SIZE;
+    if (SizeMin > SizeMax)      SizeMin = SizeMax;
+}
+
+int main(int argc, char *argv[]) {
+    parse(argc, argv);
+    if (!Port) {
+        if (!(TheBroker = broker_start())) return EXIT_FAILURE;
+        Port = TheBroker->port;
+    }
+    // Every client keeps a few descriptors open
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+
+    IOPool *        pool        = Mode == MQ_POOLED ? io_pool_create(0) : NULL;
+    MessageQueue ** subscribers = calloc(Subscribers ? Subscribers : 1, sizeof(MessageQueue *));
+    Publisher *     publishers  = calloc(Publishers, sizeof(Publisher));
+    size_t *        listening   = calloc(Topics, sizeof(size_t));
+    char            name[BUFSIZ], topic[NI_MAXSERV];
+    if ((Mode == MQ_POOLED && !pool) || !subscribers || !publishers || !listening || !(Latency = stats_create())) {
+        return EXIT_FAILURE;
+    }
+
+    // Subscriber i listens to topic i modulo Topics, and so does publisher i
+    pid_t run = getpid();
+    for (size_t i = 0; i < Subscribers; i++) {
+        snprintf(name, sizeof(name), "loadgen-%d-sub-%zu", run, i);
+        snprintf(topic, sizeof(topic), "loadgen-%d-%zu", run, i % Topics);
+        if (!(subscribers[i] = mq_create(name, Host, Port))) return EXIT_FAILURE;
+        subscribers[i]->mode    = Mode;
+        subscribers[i]->io_pool = pool;
+        mq_subscribe(subscribers[i], topic);
+        mq_start(subscribers[i]);
+        listening[i % Topics]++;
+    }
+    for (size_t i = 0; i < Publishers; i++) {
+        Publisher *p = &publishers[i];
+        snprintf(name, sizeof(name), "loadgen-%d-pub-%zu", run, i);
+        snprintf(p->topic, sizeof(p->topic), "loadgen-%d-%zu", run, i % Topics);
+        if (!(p->mq = mq_create(name, Host, Port))) return EXIT_FAILURE;
+        p->mq->mode        = Mode;
+        p->mq->io_pool     = pool;
+        p->mq->batch_count = Batch;
+        if (Window) p->mq->window = Window;
+        p->seed[0] = i;
+        p->seed[1] = run;
+        p->seed[2] = 0x330E;
+        mq_start(p->mq);
+    }
+    // Give subscriptions time to land before anything is published
+    for (size_t t = 0; TheBroker && t < Topics; t++) {
+        snprintf(topic, sizeof(topic), "loadgen-%d-%zu", run, t);
+        for (int waited = 0; waited < 10000 && broker_subscribers(TheBroker, topic) < listening[t]; waited++) usleep(1000);
+    }
+    if (!TheBroker) usleep(SETTLE_DELAY);
+
+    printf("%-20s %-10s %6s %-24s %14s\n", "benchmark", "variant", "size", "metric", "value");
+    Measuring = wall() + Warmup * 1e6;
+    Finishing = Measuring + Duration * 1e6;
+    Thread receiving;
+    thread_create(&receiving, NULL, receiver, subscribers);
+    for (size_t i = 0; i < Publishers; i++) thread_create(&publishers[i].thread, NULL, publisher, &publishers[i]);
+    for (size_t i = 0; i < Publishers; i++) thread_join(publishers[i].thread, NULL);
+    __atomic_store_n(&Stopped, true, __ATOMIC_RELEASE);
+    void *result;
+    thread_join(receiving, &result);
+    size_t received = (size_t)result;
+
+    // Each measured publish should reach every subscriber of its topic
+    size_t published = 0, refused = 0, expected = 0;
+    for (size_t i = 0; i < Publishers; i++) {
+        published += publishers[i].published;
+        refused   += publishers[i].refused;
+        expected  += (publishers[i].published - publishers[i].refused) * listening[i % Topics];
+    }
+    StatsReport report;
+    stats_report(Latency, &report);
+    const Histogram *h = &report.latency[STATS_DELIVER];
+    const char *     variant = mode_name(Mode);
+
+    record(variant, "published_per_second", published / Duration);
+    record(variant, "delivered_per_second", received / Duration);
+    record(variant, "publish_refused", refused);
+    record(variant, "dropped", expected > received ? expected - received : 0);
+    record(variant, "p50_usec", histogram_percentile(h, 50));
+    record(variant, "p99_usec", histogram_percentile(h, 99));
+    record(variant, "p999_usec", histogram_percentile(h, 99.9));
+    record(variant, "max_usec", h->max);
+
+    for (size_t i = 0; i < Publishers; i++) {
+        mq_stop(publishers[i].mq);
+        mq_delete(publishers[i].mq);
+    }
+    for (size_t i = 0; i < Subscribers; i++) {
+        mq_stop(subscribers[i]);
+        mq_delete(subscribers[i]);
+    }
+    if (pool) io_pool_delete(pool);
+    stats_delete(Latency);
+    free(publishers);
+    free(subscribers);
+    free(listening);
+    if (Results) fclose(Results);
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,219 @@
+/* queue_bench.c: Queue contention microbenchmark */
+
+#include "mq/queue.h"
+
+#include <errno.h>
+#include <semaphore.h>
+#include <time.h>
+
+/* Constants */
+
+#define MESSAGES    1000000
+#define LIMIT_COUNT 256                 /* Most requests a limited queue holds */
+#define LIMIT_BYTES 8192                /* Most body bytes it holds (reached first by large bodies) */
+#define LIMIT_SMALL 8                   /* Bytes of body in rounds the count limit is reached */
+#define LIMIT_LARGE 64                  /* Bytes of body in rounds the byte limit is reached */
+#define LIMIT_OFFERS (4 * LIMIT_COUNT)  /* Requests offered per round */
+#define LIMIT_ROUNDS 8
+
+/*
+ * Semaphore-guarded linked list the ring replaced, kept here so both can be
+ * measured under the same load.
+ */
+
+typedef struct SemQueue SemQueue;
+struct SemQueue {
+    Request *head;
+    Request *tail;
+    sem_t    lock;
+    sem_t    produced;
+};
+
+void sem_queue_push(SemQueue *q, Request *r) {
+    sem_wait(&q->lock);
+    r->next = NULL;
+    if (!q->head) q->head = r;
+    else q->tail->next = r;
+    q->tail = r;
+    sem_post(&q->lock);
+    sem_post(&q->produced);
+}
+
+Request * sem_queue_pop(SemQueue *q) {
+    sem_wait(&q->produced);
+    sem_wait(&q->lock);
+    Request *r = q->head;
+    q->head = r->next;
+    sem_post(&q->lock);
+    return r;
+}
+
+/* Benchmark */
+
+typedef struct Producer Producer;
+struct Producer {
+    void *      queue;
+    bool        ring;
+    Request *   requests;
+    size_t      count;
+};
+
+void * producer(void *arg) {
+    Producer *p = (Producer *)arg;
+    for (size_t i = 0; i < p->count; i++) {
+        if (p->ring) queue_push(p->queue, &p->requests[i]);
+        else sem_queue_push(p->queue, &p->requests[i]);
+    }
+    return NULL;
+}
+
+double run(bool ring, int producers, Request *requests) {
+    Queue    *ring_queue = NULL;
+    SemQueue  sem_queue  = { NULL, NULL };
+    Thread    threads[producers];
+    Producer  args[producers];
+    struct timespec start, stop;
+
+    if (ring) {
+        ring_queue = queue_create(QUEUE_CAPACITY, QUEUE_SINGLE_CONSUMER | (producers == 1 ? QUEUE_SINGLE_PRODUCER : 0));
+    } else {
+        sem_init(&sem_queue.lock, 0, 1);
+        sem_init(&sem_queue.produced, 0, 0);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < producers; i++) {
+        args[i].queue    = ring ? (void *)ring_queue : (void *)&sem_queue;
+        args[i].ring     = ring;
+        args[i].requests = requests + i * (MESSAGES / producers);
+        args[i].count    = MESSAGES / producers;
+        thread_create(&threads[i], NULL, producer, &args[i]);
+    }
+    for (size_t i = 0; i < (MESSAGES / producers) * producers; i++) {
+        if (ring) queue_pop(ring_queue);
+        else sem_queue_pop(&sem_queue);
+    }
+    for (int i = 0; i < producers; i++) thread_join(threads[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+
+    if (ring) queue_delete(ring_queue);
+    else {
+        sem_destroy(&sem_queue.lock);
+        sem_destroy(&sem_queue.produced);
+    }
+    return (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+/* Limits */
+
+typedef struct Marks Marks;
+struct Marks {
+    size_t  calls;
+    bool    high;       // Whether the last call had high set
+    bool    alternated; // Whether every call was the opposite of the one before (high first)
+};
+
+void mark(Queue *q, bool high, void *arg) {
+    Marks *m = (Marks *)arg;
+    if (high == (m->calls ? m->high : false)) m->alternated = false;
+    m->high = high;
+    m->calls++;
+}
+
+/**
+ * Offer rounds of requests to a limited queue while its consumer is
+ * stopped, draining it between rounds, and check that it never held more
+ * than its limits (bytes can go over by the one body that reached them),
+ * that its policy refused or discarded everything else, and that its
+ * watermark was called with high and then low each round.
+ * @param   policy      What queue_offer does once the limits are reached.
+ * @param   results     Results file to add rows to (NULL for none).
+ * @return  Whether or not the queue kept to its limits.
+ */
+bool limited(QueuePolicy policy, FILE *results) {
+    const char * name  = policy == QUEUE_FAIL ? "fail" : "drop_oldest";
+    RequestPool *pool  = request_pool_create();
+    Queue *      q     = queue_create(QUEUE_CAPACITY, QUEUE_SINGLE_PRODUCER | QUEUE_SINGLE_CONSUMER);
+    Marks        marks = { .alternated = true };
+    QueueLimits  limits = { LIMIT_COUNT, LIMIT_BYTES, policy, QUEUE_HIGH_WATER, QUEUE_LOW_WATER, mark, &marks };
+    size_t       depth_max = 0, bytes_max = 0, offered = 0, accepted = 0, taken = 0;
+    char         body[LIMIT_LARGE + 1];
+    bool         kept = pool && q && queue_limit(q, &limits);
+
+    for (size_t round = 0; kept && round < LIMIT_ROUNDS; round++) {
+        size_t length = round % 2 ? LIMIT_LARGE : LIMIT_SMALL;
+        memset(body, 'x', length);
+        body[length] = 0;
+        for (size_t i = 0; kept && i < LIMIT_OFFERS; i++) {
+            Request *r = request_create(pool, METHOD_PUT, NULL, body);
+            if (!r) {
+                kept = false;
+                break;
+            }
+            offered++;
+            if (queue_offer(q, r)) {
+                accepted++;
+            } else {
+                if (errno != EAGAIN) kept = false;
+                request_delete(r);
+            }
+            if (queue_depth(q) > depth_max) depth_max = queue_depth(q);
+            if (q->bytes > bytes_max) bytes_max = q->bytes;
+        }
+        Request *r;
+        while ((r = queue_try_pop(q))) {
+            request_delete(r);
+            taken++;
+        }
+    }
+
+    kept = kept && depth_max <= LIMIT_COUNT && bytes_max < LIMIT_BYTES + LIMIT_LARGE &&
+           q->dropped == offered - taken && accepted == (policy == QUEUE_FAIL ? taken : offered) &&
+           marks.alternated && marks.calls == 2 * LIMIT_ROUNDS;
+    printf("%-12s %10zu %10zu %10zu %10zu %6s\n", name, depth_max, bytes_max, q ? q->dropped : 0, marks.calls, kept ? "ok" : "FAILED");
+    if (results) {
+        fprintf(results, "queue_limits,%s,%d,depth_max,%zu\n", name, LIMIT_COUNT, depth_max);
+        fprintf(results, "queue_limits,%s,%d,bytes_max,%zu\n", name, LIMIT_COUNT, bytes_max);
+        fprintf(results, "queue_limits,%s,%d,dropped,%zu\n", name, LIMIT_COUNT, q ? q->dropped : 0);
+    }
+    if (q) queue_delete(q);
+    if (pool) request_pool_delete(pool);
+    return kept;
+}
+
+int main(int argc, char *argv[]) {
+    FILE *results = NULL;
+    if (argc > 1) {
+        // Rows for the results file shared with mq_bench
+        if (!(results = fopen(argv[1], "a"))) {
+            error("Unable to open %s: %s", argv[1], strerror(errno));
+            return EXIT_FAILURE;
+        }
+        if (!ftell(results)) fprintf(results, "benchmark,variant,size,metric,value\n");
+    }
+
+    Request *requests = calloc(MESSAGES, sizeof(Request));
+    if (!requests) return EXIT_FAILURE;
+
+    printf("%-10s %-10s %14s\n", "queue", "producers", "messages/s");
+    for (int producers = 1; producers <= 8; producers *= 2) {
+        double semaphore = run(false, producers, requests);
+        double ring      = run(true, producers, requests);
+        printf("%-10s %-10d %14.0f\n", "semaphore", producers, MESSAGES / semaphore);
+        printf("%-10s %-10d %14.0f\n", "ring", producers, MESSAGES / ring);
+        if (results) {
+            fprintf(results, "queue_contention,semaphore,%d,messages_per_second,%.1f\n", producers, MESSAGES / semaphore);
+            fprintf(results, "queue_contention,ring,%d,messages_per_second,%.1f\n", producers, MESSAGES / ring);
+        }
+    }
+    free(requests);
+
+    // A consumer that stops must not let the queue grow past its limits
+    printf("\n%-12s %10s %10s %10s %10s %6s\n", "policy", "depth_max", "bytes_max", "dropped", "watermarks", "");
+    bool kept = limited(QUEUE_FAIL, results);
+    kept      = limited(QUEUE_DROP_OLDEST, results) && kept;
+    if (results) fclose(results);
+    return kept ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,193 @@
+/* render_bench.c: Headless chat rendering benchmark */
+
+#include "mq/chat_app.h"
+
+#include <curses.h>
+#include <errno.h>
+#include <time.h>
+
+/* Constants */
+
+#define MESSAGES        200000      /* Messages delivered per run */
+#define EAGER_MESSAGES  10000       /* Messages delivered when each is refreshed (far slower) */
+#define SWITCHES        2000        /* Channel switches per replay run */
+#define SCREEN_ROWS     50          /* Size of the screen drawn to */
+#define SCREEN_COLS     120
+#define BODY_SIZE       64          /* Bytes of message body */
+#define SENDERS         16          /* Distinct senders messages come from */
+#define SELF            "me"        /* Name of the client drawing */
+#define WRAP_CAPACITY   1024        /* Bytes of the ring the wraparound check uses */
+#define WRAP_FIRST      500         /* Bytes of body partly filling it */
+#define WRAP_SECOND     600         /* Bytes of body (over half of it) appended next */
+
+/* Globals */
+
+FILE *  Results = NULL;
+
+/* Helpers */
+
+uint64_t now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Print a result and append it to the results file as a CSV row:
+ *
+ *  benchmark,variant,size,metric,value
+ */
+void record(const char *benchmark, const char *variant, size_t size, const char *metric, double value) {
+    printf("%-20s %-10s %6zu %-24s %14.1f\n", benchmark, variant, size, metric, value);
+    fflush(stdout);
+    if (Results) fprintf(Results, "%s,%s,%zu,%s,%.1f\n", benchmark, variant, size, metric, value);
+}
+
+/* Checks */
+
+/**
+ * Partly fill a small ring, then append a body longer than half of it, so
+ * that everything before has to go and it starts over at the front, and
+ * check that only that body is replayed, intact, either way round.
+ * @return  Whether or not the ring held up.
+ */
+bool wraparound() {
+    History *    h = history_create(WRAP_CAPACITY);
+    HistoryEntry entry;
+    char         body[WRAP_SECOND];
+    uint64_t     cursor;
+    bool         intact = true;
+    if (!h) return false;
+
+    memset(body, 'a', WRAP_FIRST);
+    history_append(h, "first", body, WRAP_FIRST, 1, 0);
+    memset(body, 'b', WRAP_SECOND);
+    history_append(h, "second", body, WRAP_SECOND, 2, 0);
+
+    cursor = h->head;
+    if (h->count != 1 || h->tail - h->head > h->capacity ||
+        !history_next(h, &cursor, &entry) || history_next(h, &cursor, &entry)) intact = false;
+    if (intact && (entry.time != 2 || entry.length != WRAP_SECOND ||
+                   memcmp(entry.body, body, WRAP_SECOND) || entry.body[WRAP_SECOND])) intact = false;
+    cursor = h->tail;
+    if (intact && (!history_prev(h, &cursor, &entry) || entry.time != 2 ||
+                   history_prev(h, &cursor, &entry))) intact = false;
+    history_delete(h);
+    return intact;
+}
+
+/* Benchmarks */
+
+typedef enum {
+    EAGER,      // Draw and refresh every message as it arrives (as chat_app used to)
+    BATCHED,    // Draw each batch once it is in, then refresh
+    FRAMED,     // As batched, but refresh at most once per FRAME_INTERVAL
+} Refresh;
+
+/**
+ * Deliver count messages to the channel being shown, MAX_RETRIEVE at a
+ * time, and return how many were handled per second.
+ */
+double deliver(Channels *channels, Refresh refresh, size_t count) {
+    Node *   channel = find_channel(channels, "general", hash("general"));
+    char     body[BODY_SIZE + 1];
+    char     sender[16];
+    uint64_t started = now(), frame = 0;
+
+    memset(body, 'x', BODY_SIZE);
+    body[BODY_SIZE] = 0;
+    clear();
+    for (size_t m = 0; m < count; m += MAX_RETRIEVE) {
+        size_t fresh = 0;
+        for (; fresh < MAX_RETRIEVE && m + fresh < count; fresh++) {
+            snprintf(sender, sizeof(sender), "user%zu", (m + fresh) % SENDERS);
+            save_message(channel, sender, body, SELF);
+            if (refresh == EAGER) {
+                render_recent(channel, 1, SCREEN_ROWS - 1, SCREEN_COLS);
+                refresh();
+            }
+        }
+        if (refresh == EAGER) continue;
+        render_recent(channel, fresh, SCREEN_ROWS - 1, SCREEN_COLS);
+        if (refresh == FRAMED && now() - frame < FRAME_INTERVAL * 1000000ULL) continue;
+        refresh();
+        frame = now();
+    }
+    refresh();
+    return count / ((now() - started) / 1e9);
+}
+
+/**
+ * Switch to a channel with a full history SWITCHES times, drawing all of it
+ * or only what fits, and return how many switches were made per second.
+ */
+double replay(Channels *channels, bool visible) {
+    Node *   channel = find_channel(channels, "general", hash("general"));
+    uint64_t started = now();
+
+    for (size_t s = 0; s < SWITCHES; s++) {
+        clear();
+        if (visible) {
+            render_recent(channel, channel->history->count, SCREEN_ROWS - 1, SCREEN_COLS);
+        } else {
+            HistoryEntry entry;
+            uint64_t     cursor = channel->history->head;
+            while (history_next(channel->history, &cursor, &entry)) render_message(channel, &entry);
+        }
+        refresh();
+    }
+    return SWITCHES / ((now() - started) / 1e9);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1) {
+        // Rows for the results file shared with the other benchmarks
+        if (!(Results = fopen(argv[1], "a"))) {
+            fprintf(stderr, "Unable to open %s: %s\n", argv[1], strerror(errno));
+            return EXIT_FAILURE;
+        }
+        if (!ftell(Results)) fprintf(Results, "benchmark,variant,size,metric,value\n");
+    }
+
+    if (!wraparound()) {
+        fprintf(stderr, "History ring did not survive wrapping around\n");
+        return EXIT_FAILURE;
+    }
+
+    // Draw to a terminal that is never shown
+    FILE *   null   = fopen("/dev/null", "r+");
+    SCREEN * screen = null ? newterm("xterm-256color", null, null) : NULL;
+    if (!screen) {
+        fprintf(stderr, "Unable to create headless screen\n");
+        return EXIT_FAILURE;
+    }
+    set_term(screen);
+    resizeterm(SCREEN_ROWS, SCREEN_COLS);
+    scrollok(stdscr, TRUE);
+    init_colors();
+
+    Channels channels = { .history = HISTORY_CAPACITY };
+    if (push_node(&channels, "general")) return EXIT_FAILURE;
+
+    double eager   = deliver(&channels, EAGER, EAGER_MESSAGES);
+    double batched = deliver(&channels, BATCHED, MESSAGES);
+    double framed  = deliver(&channels, FRAMED, MESSAGES);
+    double all     = replay(&channels, false);
+    double shown   = replay(&channels, true);
+    size_t kept    = find_channel(&channels, "general", hash("general"))->history->count;
+
+    endwin();
+    delscreen(screen);
+    fclose(null);
+    free_channels(&channels);
+
+    record("render_deliver", "eager", BODY_SIZE, "messages_per_second", eager);
+    record("render_deliver", "batched", BODY_SIZE, "messages_per_second", batched);
+    record("render_deliver", "framed", BODY_SIZE, "messages_per_second", framed);
+    record("render_switch", "all", kept, "switches_per_second", all);
+    record("render_switch", "visible", kept, "switches_per_second", shown);
+    if (Results) fclose(Results);
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -8,25 +8,37 @@
 #include <sys/types.h>
 #include "mq/thread.h"
 #include "mq/client.h"
+#include "mq/history.h"
+#include "mq/journal.h"
 
 /* Constants */
 
 #define BACKSPACE    127
-#define MAX_SUBS     10
-#define MAX_MESSAGES 100
 #define NUM_COLORS   5
+#define MAX_RETRIEVE 64
+#define MIN_CHANNELS 16     /* Slots in the channel table when it is first used */
+#define FRAME_INTERVAL 16   /* Least milliseconds between screen refreshes */
+
+/* Message flags (kept in each history record) */
+
+#define MESSAGE_COLOR   0x0F    /* Color pair of sender */
+#define MESSAGE_MINE    0x10    /* We sent it */
+#define MESSAGE_MENTION 0x20    /* It mentions our name */
 
 /* Structures */
 typedef struct Node {
-    char   *topic;
-    int    read;
-    int    write;
-    char   **buffer_history;
-    struct Node* next;
+    char          *topic;
+    unsigned long hash;     // hash(topic), which the channel is looked up by
+    History       *history;
+    Journal       *journal; // Saved history (NULL if not saved)
 } Node;
 
 typedef struct Channels {
-    Node* head;
+    Node** slots;       // Open addressed by hash of topic (NULL if free)
+    size_t capacity;    // Number of slots (a power of two)
+    size_t count;       // Channels subscribed to
+    size_t history;     // Bytes of history kept per channel (0 for HISTORY_CAPACITY)
+    char*  journal;     // Directory history is saved in (NULL to keep it in memory only)
 } Channels;
 
 enum COLOR {
@@ -43,13 +55,18 @@ enum COLOR {
 int             epoll_setup(MessageQueue* mq);
 int             push_node(Channels* channels, char* topic);
 int             delete_channel(Channels* channels, char* topic);
-Node*           find_channel(Channels* channels, char* topic);
+Node*           find_channel(Channels* channels, char* topic, unsigned long topic_hash);
 void            print_channels(Channels* channels);
-void            save_message(Node* current_chat, char* name, char* temp_buf);
-void            free_buffers(Node* curr);
+void            save_message(Node* current_chat, char* name, char* body, char* self);
+void            render_message(Node* channel, HistoryEntry* entry);
+int             message_rows(Node* channel, HistoryEntry* entry, int cols);
+size_t          render_recent(Node* channel, size_t count, int rows, int cols);
+size_t          render_journal(Node* channel, size_t age, int rows, int cols);
+void            free_channels(Channels* channels);
 void            free_node(Node* curr);
 unsigned long   hash(char* string);
 void            init_curses();
+int             init_colors();
 void            print_menu();
 
 #endif
@@ -3,38 +3,95 @@
 #ifndef CLIENT_H
 #define CLIENT_H
 
+#include "mq/compress.h"
 #include "mq/queue.h"
+#include "mq/stats.h"
+#include "mq/thread.h"
 
 #include <netdb.h>
+#include <semaphore.h>
 #include <stdbool.h>
 
 /* Structures */
 
+typedef enum {
+    MQ_THREADED,		// Pusher and puller threads (default)
+    MQ_EVENTS,			// Non-blocking sockets run by mq_process_events
+    MQ_POOLED,			// Non-blocking sockets run by a shared IOPool
+} MQMode;
+
+typedef enum {
+    MQ_NO_LOCAL = 1 << 0,	// Leave out messages this client publishes itself
+} MQSubscribeFlags;
+
+typedef struct Engine Engine;
+typedef struct IOPool IOPool;
+
 typedef struct MessageQueue MessageQueue;
 struct MessageQueue {
     char    name[NI_MAXHOST];	// Name of message queue
     char    host[NI_MAXHOST];	// Host of server
     char    port[NI_MAXSERV];	// Port of server
     Request* sentinel;
+    RequestPool* pool;		// Requests are carved from (and returned to) here
 
     Queue*  outgoing;		// Requests to be sent to server
     Queue*  incoming;		// Requests received from server
+    QueueLimits outgoing_limits;	// Bounds on requests waiting to be sent (set before mq_start)
+    QueueLimits incoming_limits;	// Bounds on messages waiting to be retrieved (set before mq_start)
     bool    shutdown;		// Whether or not to shutdown
-    int p[2];                // Pipe for communication main chat program
+    bool    keep_alive;		// Reuse server connections between requests
+    size_t  batch_count;	// Most messages per batch (1 disables batching)
+    size_t  batch_bytes;	// Most body bytes per batch
+    long    batch_linger;	// Microseconds to wait for a batch to fill
+    size_t  window;		// Most requests in flight at once (threaded mode; 1 waits for each answer)
+    int     connect_timeout;	// Milliseconds to wait for a server connection
+    bool    streaming;		// Receive messages over one long-lived response
+    int     capacity;		// Messages the server may hold for this queue (0 for its default)
+    const char* overflow;	// What the server does with more (NULL for its default)
+    bool    binary;		// Ask for binary frames (threaded mode; cleared if refused)
+    size_t  compress_threshold;	// Compress bodies at least this long over binary frames (0 never)
+    CompressStats compression;	// Compression counters (see mq_compression_stats)
+    int     notify_fd;		// Eventfd counting messages for the application
+    Stats*  stats;		// Runtime counters and latencies (see mq_stats)
+    int     stats_interval;	// Milliseconds between dumps to stats_file (0 never; set before mq_start)
+    FILE*   stats_file;		// Where periodic dumps go (stderr by default)
+    bool    timestamps;		// Embed publish time in bodies to measure delivery delay
+    MQMode  mode;		// How requests are sent and received (set before mq_start)
+    Engine* engine;		// Event engine (event and pooled modes)
+    IOPool* io_pool;		// Threads running engine (pooled mode only)
+    sem_t   lock;		// Guards shutdown
+    sem_t   detached;		// Posted once io_pool lets go of engine
+    Thread  pusher;		// Pusher thread (threaded mode only)
+    Thread  puller;		// Puller thread (threaded mode only)
+    Thread  dumper;		// Dumps stats every stats_interval (if set)
+    sem_t   dumping;		// Posted by mq_stop to end dumper
 };
 
 MessageQueue *	mq_create(const char *name, const char *host, const char *port);
 void		mq_delete(MessageQueue *mq);
 
-void		mq_publish(MessageQueue *mq, const char *topic, const char *body);
+bool		mq_publish(MessageQueue *mq, const char *topic, const char *body);
+bool		mq_publish_batch(MessageQueue *mq, const char *topic, const char **bodies, size_t n);
 char *		mq_retrieve(MessageQueue *mq);
+char *		mq_try_retrieve(MessageQueue *mq);
+size_t		mq_retrieve_many(MessageQueue *mq, char **messages, size_t max);
+void		mq_release(MessageQueue *mq, char *message);
 
-void		mq_subscribe(MessageQueue *mq, const char *topic);
-void		mq_unsubscribe(MessageQueue *mq, const char *topic);
+bool		mq_subscribe(MessageQueue *mq, const char *topic);
+bool		mq_subscribe_flags(MessageQueue *mq, const char *topic, int flags);
+bool		mq_unsubscribe(MessageQueue *mq, const char *topic);
 
 void		mq_start(MessageQueue *mq);
 void		mq_stop(MessageQueue *mq);
 
 bool		mq_shutdown(MessageQueue *mq);
 
+int		mq_fd(MessageQueue *mq);
+int		mq_process_events(MessageQueue *mq);
+
+void		mq_compression_stats(MessageQueue *mq, CompressStats *stats);
+void		mq_stats(MessageQueue *mq, StatsReport *report);
+void		mq_stats_dump(MessageQueue *mq, FILE *stream);
+
 #endif
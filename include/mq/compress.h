@@ -0,0 +1,40 @@
+/* compress.h: Message body compression */
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include "mq/request.h"
+
+#include <stdint.h>
+
+/* Constants */
+
+#define COMPRESS_THRESHOLD  1024    /* Default smallest body worth compressing */
+#define COMPRESS_PREFIX     4       /* Bytes of inflated length before zlib stream */
+#define COMPRESS_MAX        (64 << 20)  /* Longest body inflated (as the server's maxInflated) */
+
+/* Structures */
+
+typedef struct CompressStats CompressStats;
+struct CompressStats {
+    size_t      compressed;         // Bodies (or batches) sent compressed
+    size_t      incompressible;     // Bodies (or batches) that did not shrink
+    uint64_t    plain_bytes;        // Bytes handed to deflate
+    uint64_t    wire_bytes;         // Bytes sent for them (compressed or not)
+    uint64_t    compress_usec;      // CPU time spent compressing
+    size_t      inflated;           // Bodies inflated on retrieve
+    uint64_t    inflated_bytes;     // Bytes they inflated to
+    uint64_t    inflate_usec;       // CPU time spent inflating
+    size_t      corrupt;            // Bodies dropped because they would not inflate
+};
+
+/* Functions */
+
+size_t      compress_bound(size_t length);
+size_t      compress_data(const char *data, size_t length, char *buffer, size_t size, CompressStats *stats);
+Request *   compress_inflate(RequestPool *pool, Request *r, CompressStats *stats);
+double      compress_ratio(const CompressStats *stats);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,39 @@
+/* engine.h: Single-threaded event engine for Message Queue client */
+
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include "mq/client.h"
+
+#include <sys/uio.h>
+
+/* Constants */
+
+#define RECONNECT_DELAY 100000  /* Microseconds to wait before reconnecting */
+#define BATCH_MAX       ((UIO_MAXIOV - 1) / 2) /* Most messages one writev can carry */
+#define POLL_TIMEOUT    30      /* Seconds the server may hold a GET /queue open */
+#define OPTIONS_MAX     128     /* Bytes of query mq_queue_options may format */
+
+/* Functions */
+
+Engine *    engine_create(MessageQueue *mq);
+void        engine_delete(Engine *e);
+int         engine_fd(Engine *e);
+int         engine_process(MessageQueue *mq);
+void        engine_wait(MessageQueue *mq);
+void        engine_flush(MessageQueue *mq);
+void        engine_notify(Engine *e);
+bool        engine_stalled(Engine *e);
+
+/* Client Functions (shared by all modes) */
+
+const char *mq_host(MessageQueue *mq);
+void        mq_queue_options(MessageQueue *mq, char *query, size_t size);
+void        mq_wakeup(MessageQueue *mq, size_t count);
+bool        mq_batchable(Request *r);
+int         mq_batch_iovec(MessageQueue *mq, Request **requests, size_t count, char **frames, size_t *capacity, char *header, struct iovec *iov);
+void        mq_answered(MessageQueue *mq, Request **requests, size_t count, int status);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,58 @@
+/* frame.h: Binary protocol frames */
+
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Constants */
+
+#define FRAME_HEADER        8           /* Bytes of frame header */
+#define FRAME_ARGUMENT      0xFFFFFF    /* Largest frame argument (and topic ID) */
+#define FRAME_PROTOCOL      "mq-binary" /* Name of protocol in Upgrade header */
+#define FRAME_COMPRESSION   "MQ-Compression"    /* Header offering (and accepting) zlib payloads */
+#define FRAME_COMPRESSED    0x80        /* Opcode flag: payload is compressed (see compress.h) */
+
+/* Structures */
+
+typedef enum {
+    OP_TOPIC = 1,       // Name topic ID (argument) as payload for this connection
+    OP_PUBLISH,         // Publish payload to topic ID (argument)
+    OP_SUBSCRIBE,       // Subscribe connection's queue to topic ID (argument),
+                        // with options as in the HTTP query (payload)
+    OP_UNSUBSCRIBE,     // Unsubscribe connection's queue from topic ID (argument)
+    OP_FETCH,           // Send messages from connection's queue (argument is
+                        // most to send, 0 for no limit)
+    OP_MESSAGE,         // Message (payload) from connection's queue
+    OP_STATUS,          // Answer to publish, subscribe, unsubscribe, or the
+                        // end of a fetch (argument is HTTP status code)
+    OP_BATCH,           // Frames (payload) to handle in turn
+} Opcode;
+
+typedef struct FrameTopic FrameTopic;
+struct FrameTopic {
+    char *      name;           // NULL if slot is free
+    uint32_t    id;
+};
+
+typedef struct FrameTopics FrameTopics;
+struct FrameTopics {
+    FrameTopic *slots;          // Open addressed by hash of name
+    size_t      capacity;       // Number of slots (a power of two)
+    size_t      count;          // IDs handed out (1 through count)
+};
+
+/* Functions */
+
+void        frame_header(char *buffer, Opcode opcode, uint32_t argument, size_t length);
+void        frame_parse(const char *buffer, Opcode *opcode, uint32_t *argument, size_t *length);
+size_t      frame_upgrade(char *buffer, size_t size, const char *host, const char *queue, const char *query, bool compress);
+
+uint32_t    frame_topic(FrameTopics *topics, const char *name, size_t length, bool *fresh);
+void        frame_topics_clear(FrameTopics *topics);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
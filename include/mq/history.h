@@ -0,0 +1,58 @@
+/* history.h: Channel history ring */
+
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Constants */
+
+#define HISTORY_CAPACITY    (64 * 1024)     /* Default bytes of history kept per channel */
+#define HISTORY_SENDER      32              /* Bytes of sender field (name truncated to one less) */
+#define HISTORY_ALIGN       8               /* Records start on multiples of this */
+#define HISTORY_PAD         UINT32_MAX      /* Length of record skipping the rest of the ring */
+
+/* Structures */
+
+typedef struct HistoryRecord HistoryRecord;
+struct HistoryRecord {
+    uint64_t    time;                       // Microseconds since the epoch
+    uint32_t    length;                     // Bytes of body that follow (HISTORY_PAD to wrap)
+    uint32_t    back;                       // Bytes back to start of previous record (0 if none)
+    uint32_t    flags;                      // Left to the caller (parsed once, when appended)
+    char        sender[HISTORY_SENDER];     // NUL terminated
+};
+
+typedef struct History History;
+struct History {
+    char *      buffer;                     // Records, each contiguous (bodies NUL terminated)
+    size_t      capacity;                   // Bytes in buffer (fixed when created)
+    uint64_t    head;                       // Offset of oldest record (counting every byte written)
+    uint64_t    tail;                       // Offset just past newest record
+    uint64_t    last;                       // Offset of newest record (if count)
+    size_t      count;                      // Records between head and tail
+};
+
+typedef struct HistoryEntry HistoryEntry;
+struct HistoryEntry {
+    uint64_t    time;
+    uint32_t    flags;
+    const char *sender;
+    const char *body;                       // Points into the ring (valid until next append)
+    size_t      length;
+};
+
+/* Functions */
+
+History *   history_create(size_t capacity);
+void        history_delete(History *h);
+void        history_append(History *h, const char *sender, const char *body, size_t length, uint64_t time, uint32_t flags);
+bool        history_next(const History *h, uint64_t *cursor, HistoryEntry *entry);
+bool        history_prev(const History *h, uint64_t *cursor, HistoryEntry *entry);
+size_t      history_size(size_t length);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,35 @@
+/* io_pool.h: Shared I/O threads for Message Queue clients */
+
+#ifndef IO_POOL_H
+#define IO_POOL_H
+
+#include "mq/client.h"
+
+/* Constants */
+
+#define IO_POOL_EVENTS  64      /* Most events taken per epoll_wait */
+
+/* Structures */
+
+typedef struct IOWorker IOWorker;
+struct IOWorker {
+    Thread      thread;
+    int         epoll_fd;       // Engines of the queues this worker services
+    int         stop_fd;        // Written to stop the worker
+};
+
+struct IOPool {
+    IOWorker *  workers;
+    size_t      count;          // Number of workers
+    size_t      next;           // Worker the next queue is given to
+};
+
+/* Functions */
+
+IOPool *    io_pool_create(size_t threads);
+void        io_pool_delete(IOPool *pool);
+void        io_pool_add(IOPool *pool, MessageQueue *mq);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,57 @@
+/* journal.h: Persistent channel history */
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "mq/history.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Constants */
+
+#define JOURNAL_SEGMENT     (1024 * 1024)   /* Default bytes per segment file */
+#define JOURNAL_SEGMENTS    8               /* Default segment files kept per channel */
+#define JOURNAL_HEADER      4096            /* Bytes of segment header (one page) */
+#define JOURNAL_STRIDE      16              /* Records between offsets kept in the index */
+#define JOURNAL_MAGIC       0x314C4E524A514DULL  /* "MQJRNL1" */
+#define JOURNAL_INDEX       ((JOURNAL_HEADER - 4 * sizeof(uint64_t)) / sizeof(uint32_t))
+
+/* Structures */
+
+typedef struct JournalHeader JournalHeader;
+struct JournalHeader {
+    uint64_t    magic;
+    uint64_t    used;                       // Bytes of records written after the header
+    uint64_t    count;                      // Records written
+    uint64_t    last;                       // Offset of newest record
+    uint32_t    index[JOURNAL_INDEX];       // Offset of every JOURNAL_STRIDE-th record
+};
+
+typedef struct JournalSegment JournalSegment;
+struct JournalSegment {
+    char *      map;                        // Whole file mapped (NULL until first used)
+    size_t      size;                       // Bytes mapped
+};
+
+typedef struct Journal Journal;
+struct Journal {
+    char *      prefix;                     // Directory and escaped topic files are named after
+    size_t      segment;                    // Bytes per segment file
+    size_t      keep;                       // Segment files kept (older ones are deleted)
+    uint64_t    first;                      // Sequence number of oldest segment kept
+    uint64_t    last;                       // Sequence number of segment appended to
+    JournalSegment *segments;               // Indexed by sequence number modulo keep
+};
+
+/* Functions */
+
+Journal *   journal_open(const char *directory, const char *topic, size_t segment, size_t keep);
+void        journal_close(Journal *j);
+bool        journal_append(Journal *j, const char *sender, const char *body, size_t length, uint64_t time, uint32_t flags);
+bool        journal_read(Journal *j, size_t age, HistoryEntry *entry);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -5,30 +5,82 @@
 
 #include "mq/request.h"
 #include "mq/thread.h"
-#include <semaphore.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Constants */
+
+#define QUEUE_CAPACITY          4096    /* Default number of slots in ring */
+#define QUEUE_SINGLE_PRODUCER   0x01    /* Only one thread ever pushes */
+#define QUEUE_SINGLE_CONSUMER   0x02    /* Only one thread ever pops */
+#define QUEUE_HIGH_WATER        80      /* Default percent full that calls watermark */
+#define QUEUE_LOW_WATER         50      /* Default percent full that calls it again */
+#define CACHE_LINE              64
 
 /* Structures */
 
+typedef enum {
+    QUEUE_BLOCK,        // Wait for room (default)
+    QUEUE_FAIL,         // Refuse request with EAGAIN
+    QUEUE_DROP_OLDEST,  // Discard requests from the front to make room
+} QueuePolicy;
+
 typedef struct Queue Queue;
+typedef void (*QueueWatermark)(Queue *q, bool high, void *arg);
+
+typedef struct QueueLimits QueueLimits;
+struct QueueLimits {
+    size_t          count;      // Most requests held (0 for the ring's capacity)
+    size_t          bytes;      // Most body bytes held (0 for no limit)
+    QueuePolicy     policy;     // What queue_offer does once either is reached
+    int             high;       // Percent full at which watermark is called with high set
+    int             low;        // Percent full at which it is called again with high clear
+    QueueWatermark  watermark;  // Called by whichever thread crosses a mark (NULL for none)
+    void *          arg;        // Passed to watermark
+};
+
+typedef struct QueueSlot QueueSlot;
+struct QueueSlot {
+    size_t      sequence;       // Ticket of the push or pop this slot awaits
+    Request *   request;
+};
+
 struct Queue {
-    Request *head;
-    Request *tail;
-    Request *sentinel;
-    size_t   size;
-
-    // TODO: Add any necessary thread and synchronization primitives
-    sem_t    lock;
-    sem_t    produced;
-    sem_t    consumed;
+    // Written by pushers
+    size_t      tail __attribute__((aligned(CACHE_LINE)));
+    uint32_t    popped;         // Futex bumped on pop while pushers wait
+    uint32_t    pushers_asleep; // Set while pushers sleep on a full ring
+
+    // Written by poppers
+    size_t      head __attribute__((aligned(CACHE_LINE)));
+    uint32_t    pushed;         // Futex bumped on push while poppers wait
+    uint32_t    poppers_asleep; // Set while poppers sleep on an empty ring
+
+    QueueSlot * slots __attribute__((aligned(CACHE_LINE)));
+    size_t      mask;           // Capacity - 1 (capacity is a power of two)
+    int         flags;
+    QueueLimits limits;         // Set before the queue is shared (see queue_limit)
+
+    // Written by both sides (only when limits call for it)
+    size_t      bytes __attribute__((aligned(CACHE_LINE)));  // Body bytes held (with a byte limit)
+    size_t      dropped;        // Requests refused or discarded by policy
+    bool        high;           // Whether watermark was last called with high set
 };
 
 /* Functions */
 
-Queue *	    queue_create();
+Queue *	    queue_create(size_t capacity, int flags);
 void        queue_delete(Queue *q);
-void        queue_delete_helper(Request *r);
+bool        queue_limit(Queue *q, const QueueLimits *limits);
 void	    queue_push(Queue *q, Request *r);
+bool        queue_try_push(Queue *q, Request *r);
+bool        queue_offer(Queue *q, Request *r);
+bool        queue_try_offer(Queue *q, Request *r);
 Request *   queue_pop(Queue *q);
+Request *   queue_pop_timed(Queue *q, long timeout);
+Request *   queue_try_pop(Queue *q);
+size_t      queue_try_pop_many(Queue *q, Request **requests, size_t max);
+size_t      queue_depth(Queue *q);
 
 #endif
 
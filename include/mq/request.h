@@ -3,23 +3,67 @@
 #ifndef REQUEST_H
 #define REQUEST_H
 
+#include "mq/thread.h"
+
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <sys/uio.h>
+
+/* Constants */
+
+#define REQUEST_DATA    1024    /* Bytes of inline storage in a pooled request */
+#define REQUEST_SLAB    64      /* Requests allocated at once when a pool runs dry */
+#define REQUEST_HEADER  (2*BUFSIZ)  /* Bytes needed for request line and headers */
 
 /* Structures */
 
+typedef enum {
+    METHOD_GET,
+    METHOD_PUT,
+    METHOD_DELETE,
+} Method;
+
+typedef struct RequestPool RequestPool;
+
 typedef struct Request Request;
 struct Request {
-    char *	method;
-    char *	uri;
-    char *	body;
-    
+    Method	method;
+    char *	uri;		// Points into data (NULL if none)
+    char *	body;		// Points to start of data (NULL if none)
+    size_t	length;		// Length of body
+    bool	compressed;	// Whether body is still compressed (see compress.h)
+    uint64_t	stamp;		// When publish was queued (microseconds, 0 if not timed)
+    RequestPool *pool;		// Pool request returns to (NULL if malloc'd)
+
     Request *	next;
+    char	data[];		// $BODY\0$URI\0
+};
+
+typedef struct RequestSlab RequestSlab;
+struct RequestSlab {
+    RequestSlab *next;
+};
+
+struct RequestPool {
+    Mutex	    lock;
+    Request *	    free;	// Requests ready for reuse
+    RequestSlab *   slabs;	// Slabs of REQUEST_SLAB requests carved so far
+    size_t	    requests;	// Requests handed out
+    size_t	    mallocs;	// Heap allocations made (slabs and oversized requests)
 };
 
 /* Functions */
 
-Request *   request_create(const char *method, const char *uri, const char *body);
+RequestPool *	request_pool_create();
+void		request_pool_delete(RequestPool *pool);
+
+Request *   request_create(RequestPool *pool, Method method, const char *uri, const char *body);
+Request *   request_reserve(RequestPool *pool, Method method, const char *uri, size_t length);
+Request *   request_from_body(char *body);
 void	    request_delete(Request *r);
-void        request_write(Request *r, FILE *fs);
+size_t      request_header(Request *r, const char *host, size_t length, char *buffer, size_t size);
+int         request_iovec(Request *r, const char *host, char *header, size_t size, struct iovec iov[2]);
+const char *method_name(Method method);
 
 #endif
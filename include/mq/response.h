@@ -0,0 +1,62 @@
+/* response.h: HTTP Response parser */
+
+#ifndef RESPONSE_H
+#define RESPONSE_H
+
+#include "mq/request.h"
+
+#include <stdbool.h>
+
+/* Constants */
+
+#define RESPONSE_BUFFER BUFSIZ  /* Bytes of status line and headers buffered */
+
+/* Structures */
+
+typedef enum {
+    RESPONSE_HEADERS,           // Waiting for status line and headers
+    RESPONSE_CHUNK_SIZE,        // Waiting for size line of next chunk
+    RESPONSE_BODY,              // Waiting for the rest of the body (or chunk)
+    RESPONSE_CHUNK_END,         // Waiting for CRLF that ends a chunk
+    RESPONSE_TRAILER,           // Waiting for blank line that ends trailers
+    RESPONSE_UNTIL_CLOSE,       // Waiting for server to close connection
+    RESPONSE_MESSAGE,           // Waiting for the rest of a binary message frame
+    RESPONSE_DONE,              // Response complete
+} ResponseState;
+
+typedef struct Response Response;
+struct Response {
+    ResponseState state;
+    int         status;         // HTTP status code
+    bool        keep;           // Whether server keeps connection open after
+    bool        chunked;        // Whether body uses chunked transfer encoding
+    bool        binary;         // Whether connection switched to frames (see frame.h)
+    bool        compression;    // Whether server agreed to compressed frames
+    size_t      length;         // Length of body (or of current chunk)
+    size_t      received;       // Bytes of body (or chunk) received so far
+    size_t      total;          // Bytes of body received over all chunks
+    Request *   body;           // Request body is read into (NULL to discard)
+
+    bool        stream;         // Whether body is a stream of framed messages
+    Request *   frame;          // Message being read from stream
+    size_t      frame_length;   // Its length (or the digits of it read so far)
+    size_t      frame_received; // Bytes of it received so far
+    Request *   messages;       // Messages read from stream (linked by next)
+    Request *   last;           // Last of those messages
+    size_t      count;          // Number of those messages
+
+    char        buffer[RESPONSE_BUFFER];
+    size_t      start;          // First byte of buffer not yet parsed
+    size_t      end;            // End of bytes read into buffer
+};
+
+/* Functions */
+
+void    response_init(Response *r);
+void    response_next(Response *r);
+int     response_read(Response *r, int fd, RequestPool *pool, bool keep_body);
+Request *response_messages(Response *r, size_t *count);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
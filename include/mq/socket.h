@@ -3,11 +3,54 @@
 #ifndef SOCKET_H
 #define SOCKET_H
 
+#include <netdb.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* Constants */
+
+#define SOCKET_CACHE            16      /* Host:port pairs whose addresses are cached */
+#define SOCKET_CACHE_TTL        30      /* Seconds a resolved address is reused */
+#define SOCKET_CANDIDATES       8       /* Most addresses kept (and raced) per host */
+#define SOCKET_CONNECT_TIMEOUT  5000    /* Default milliseconds to wait for a connection */
+#define SOCKET_STAGGER          250     /* Milliseconds before racing the next address */
+
+/* Structures */
+
+typedef struct SocketAddress SocketAddress;
+struct SocketAddress {
+    int         family;
+    int         socktype;
+    int         protocol;
+    socklen_t   length;
+    struct sockaddr_storage address;
+};
+
+typedef struct SocketStats SocketStats;
+struct SocketStats {
+    size_t      cache_hits;         // Resolutions answered from the cache
+    size_t      cache_misses;       // Resolutions that called getaddrinfo
+    size_t      connects;           // Connections established
+    size_t      connect_failures;   // Connections given up on
+    uint64_t    connect_usec;       // Total time taken by established connections
+    uint64_t    connect_usec_max;   // Longest time taken by one of them
+};
 
 /* Functions */
 
+size_t  socket_resolve(const char *host, const char *port, SocketAddress *addresses, size_t max);
+void    socket_forget(const char *host, const char *port);
+int     socket_dial(const char *host, const char *port);
+int     socket_dial_timeout(const char *host, const char *port, int timeout);
+int     socket_dial_async(const char *host, const char *port, size_t attempt);
+void    socket_connected(bool success, uint64_t usec);
+void    socket_stats(SocketStats *stats);
 FILE *  socket_connect(const char *host, const char *port);
+ssize_t socket_writev(int fd, struct iovec **iov, int *iovcnt);
+bool    socket_sendv(int fd, struct iovec *iov, int iovcnt);
 
 #endif
-
@@ -0,0 +1,97 @@
+/* stats.h: Runtime statistics */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include "mq/queue.h"
+#include "mq/request.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Constants */
+
+#define STATS_SHARDS        8       /* Counter sets threads are spread over */
+#define STATS_MARK          '\x1e'  /* First byte of a timestamp embedded in a body */
+#define STATS_STAMP         17      /* Bytes of embedded timestamp (mark and 16 hex digits) */
+#define HISTOGRAM_SUB_BITS  4       /* Buckets per power of two are 1 << this (values within 1/16) */
+#define HISTOGRAM_SHIFTS    28      /* Powers of two above the linear range (up to ~71 minutes in usec) */
+#define HISTOGRAM_BUCKETS   ((HISTOGRAM_SHIFTS + 1) << HISTOGRAM_SUB_BITS)
+
+/* Structures */
+
+typedef enum {
+    STATS_PUBLISHED,            // Messages handed to mq_publish (or mq_publish_batch)
+    STATS_PUBLISHED_BYTES,      // Bytes of their bodies
+    STATS_RECEIVED,             // Messages put in the incoming queue
+    STATS_RECEIVED_BYTES,       // Bytes of their bodies (as they arrived)
+    STATS_FAILED,               // Requests refused, never answered, or answered with an error
+    STATS_CONNECTS,             // Connections established
+    STATS_RECONNECTS,           // Of those, ones replacing an earlier connection
+    STATS_CONNECT_FAILURES,     // Connections given up on
+    STATS_COUNTERS,
+} StatsCounter;
+
+typedef enum {
+    STATS_CONNECT,              // Time to establish a connection
+    STATS_ROUND_TRIP,           // Time from publish to the server's answer
+    STATS_DELIVER,              // Time from publish (by any client) to retrieve
+    STATS_HISTOGRAMS,
+} StatsLatency;
+
+typedef enum {
+    STATS_OUTGOING,
+    STATS_INCOMING,
+    STATS_QUEUES,
+} StatsQueue;
+
+typedef struct Histogram Histogram;
+struct Histogram {
+    uint64_t    counts[HISTOGRAM_BUCKETS];  // Log-linear buckets of microseconds
+    uint64_t    count;
+    uint64_t    sum;
+    uint64_t    max;
+};
+
+typedef struct StatsShard StatsShard;
+struct StatsShard {
+    uint64_t    counters[STATS_COUNTERS];
+} __attribute__((aligned(CACHE_LINE)));
+
+typedef struct Stats Stats;
+struct Stats {
+    StatsShard  shards[STATS_SHARDS];       // Indexed by thread (see stats_add)
+    size_t      high[STATS_QUEUES];         // Deepest each queue was seen
+    Histogram   latency[STATS_HISTOGRAMS];  // Written by the threads doing I/O
+};
+
+typedef struct StatsReport StatsReport;
+struct StatsReport {
+    uint64_t    counters[STATS_COUNTERS];   // Indexed by StatsCounter
+    size_t      depth[STATS_QUEUES];        // Requests in each queue now
+    size_t      high[STATS_QUEUES];         // Most seen in it (sampled as it is serviced)
+    size_t      dropped[STATS_QUEUES];      // Requests it refused or discarded (see QueuePolicy)
+    Histogram   latency[STATS_HISTOGRAMS];  // Indexed by StatsLatency
+};
+
+/* Functions */
+
+Stats *     stats_create();
+void        stats_delete(Stats *s);
+void        stats_add(Stats *s, StatsCounter counter, uint64_t n);
+void        stats_depth(Stats *s, StatsQueue queue, size_t depth);
+void        stats_latency(Stats *s, StatsLatency latency, uint64_t usec);
+void        stats_connected(Stats *s, bool success, bool again, uint64_t usec);
+void        stats_report(Stats *s, StatsReport *report);
+void        stats_dump(const StatsReport *report, const char *name, FILE *stream);
+
+size_t      stats_stamp(char *buffer);
+void        stats_unstamp(Stats *s, Request *r);
+uint64_t    stats_now();
+
+uint64_t    histogram_percentile(const Histogram *h, double percentile);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
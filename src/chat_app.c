@@ -1,6 +1,7 @@
 #include "mq/thread.h"
 #include "mq/client.h"
 #include "mq/chat_app.h"
+#include "mq/stats.h"
 
 #include <ctype.h>
 #include <curses.h>
@@ -24,12 +25,29 @@ int main(int argc, char* argv[]) {
     fprintf(stderr, "could not create message queue\n");
     exit(1);
   }
+  // Run the client inside our own epoll loop instead of on its threads
+  if (getenv("CHAT_EVENTS")) mq->mode = MQ_EVENTS;
   mq_start(mq);
-  mq_subscribe(mq, topic);
+  // Our own messages are drawn as we send them, so the server need not echo them
+  mq_subscribe_flags(mq, topic, MQ_NO_LOCAL);
 
-  Channels channel_list = { NULL };
-  if (push_node(&channel_list, "general")) exit(1);
-  Node*    current_chat = channel_list.head;
+  // Directory history is saved in (CHAT_JOURNAL="" keeps it in memory only)
+  char journal[BUFSIZ] = "";
+  if (getenv("CHAT_JOURNAL")) {
+      snprintf(journal, sizeof(journal), "%s", getenv("CHAT_JOURNAL"));
+  } else if (getenv("HOME")) {
+      snprintf(journal, sizeof(journal), "%s/.chat_app/%s", getenv("HOME"), mq->name);
+  }
+
+  // Bytes of history to keep per channel
+  Channels channel_list = {
+      .history = getenv("CHAT_HISTORY") ? strtoul(getenv("CHAT_HISTORY"), NULL, 10) : 0,
+      .journal = journal[0] ? journal : NULL,
+  };
+  if (push_node(&channel_list, topic)) exit(1);
+  Node*    current_chat = find_channel(&channel_list, topic, hash(topic));
+  // Pick up where the saved history left off
+  render_recent(current_chat, current_chat->history->count, LINES - 1, COLS);
 
   struct epoll_event events[100];
   int                epoll_fd = epoll_setup(mq);
@@ -40,14 +58,28 @@ int main(int argc, char* argv[]) {
   }
 
   char   input_buffer[BUFSIZ] = {0};
-  char   inbuf       [BUFSIZ] = {0};
   size_t input_index          = 0;
-  int    num_subs             = 1;
+
+  // Drawing only marks the screen dirty: it is refreshed at most once per
+  // epoll batch, and no more often than every FRAME_INTERVAL
+  bool     dirty      = true;
+  uint64_t last_frame = 0;
 
   while (!mq_shutdown(mq)) {
-      printw("\r> %s", input_buffer);
-      refresh();
-      event_count = epoll_wait(epoll_fd, events, 100, 30000);
+      int timeout = 30000;
+      if (dirty) {
+          uint64_t now = stats_now() / 1000;
+          if (now - last_frame >= FRAME_INTERVAL) {
+              printw("\r> %s", input_buffer);
+              refresh();
+              dirty      = false;
+              last_frame = now;
+          } else {
+              timeout = FRAME_INTERVAL - (now - last_frame);
+          }
+      }
+      event_count = epoll_wait(epoll_fd, events, 100, timeout);
+      if (event_count > 0) dirty = true;
       for (int i = 0; i < event_count; i++) {
           if (!events[i].data.fd) {
               char input_char = 0;
@@ -65,19 +97,13 @@ int main(int argc, char* argv[]) {
                   } else if (!strcmp(input_buffer, "/menu")) {
                       print_menu();
                   } else if (strncmp(input_buffer, "/subscribe", 10) == 0 && strlen(input_buffer) > 10) {
-                      if (num_subs == MAX_SUBS) {
-                          attron(A_UNDERLINE | A_BOLD | COLOR_PAIR(RED));
-                          printw("Cannot subscribe, reached maximum number of subs\n");
-                          attroff(A_UNDERLINE | A_BOLD | COLOR_PAIR(RED));
-                          continue;
-                      }
                       char* topic = strchr(input_buffer, ' ');
                       if (!topic) {
                           printw("Correct usage: /subscribe [topic]\n");
                           continue;
                       }
                       topic++;
-                      if (find_channel(&channel_list, topic)) {
+                      if (find_channel(&channel_list, topic, hash(topic))) {
                           attron(A_UNDERLINE | A_BOLD | COLOR_PAIR(RED));
                           printw("Already subscribed to that topic!\n");
                           attroff(A_UNDERLINE | A_BOLD | COLOR_PAIR(RED));
@@ -86,15 +112,12 @@ int main(int argc, char* argv[]) {
                       attron(A_UNDERLINE | A_BOLD | COLOR_PAIR(MAGENTA));
                       printw("SUBSCRIBED TO TOPIC: %s\n", topic);
                       attroff(A_UNDERLINE | A_BOLD | COLOR_PAIR(MAGENTA));
-                      mq_subscribe(mq, topic);
-                      // Increment subs
-                      num_subs++;
-                      // Push topic into channels linked list
+                      mq_subscribe_flags(mq, topic, MQ_NO_LOCAL);
+                      // Push topic into channel table
                       if (push_node(&channel_list, topic)) {
                           attron(A_UNDERLINE | A_BOLD | COLOR_PAIR(RED));
                           printw("Error creating channel, try again\n");
                           attroff(A_UNDERLINE | A_BOLD | COLOR_PAIR(RED));
-                          num_subs--;
                           mq_unsubscribe(mq, topic);
                       }
                   }
@@ -107,6 +130,13 @@ int main(int argc, char* argv[]) {
                           continue;
                       }
                       topic++;
+                      // Leaving the current channel would leave nothing to show
+                      if (!strcmp(topic, current_chat->topic)) {
+                          attron(A_UNDERLINE | A_BOLD | COLOR_PAIR(RED));
+                          printw("Switch to another channel before unsubscribing from this one\n");
+                          attroff(A_UNDERLINE | A_BOLD | COLOR_PAIR(RED));
+                          continue;
+                      }
                       int deleted = delete_channel(&channel_list, topic);
                       if (!deleted) {
                           attron(A_UNDERLINE | A_BOLD | COLOR_PAIR(RED));
@@ -118,7 +148,18 @@ int main(int argc, char* argv[]) {
                       printw("UNSUBSCRIBED TO TOPIC: %s\n", topic);
                       attroff(A_UNDERLINE | A_BOLD | COLOR_PAIR(MAGENTA));
                       mq_unsubscribe(mq, topic);
-                      num_subs--;
+                  } else if (!strncmp(input_buffer, "/back", 5) && strlen(input_buffer) > 5) {
+                      // Scroll back through saved history, beyond what is kept in memory
+                      if (!current_chat->journal) {
+                          attron(A_UNDERLINE | A_BOLD | COLOR_PAIR(RED));
+                          printw("History is not being saved\n");
+                          attroff(A_UNDERLINE | A_BOLD | COLOR_PAIR(RED));
+                          continue;
+                      }
+                      clear();
+                      if (!render_journal(current_chat, strtoul(input_buffer + 5, NULL, 10), LINES - 1, COLS)) {
+                          printw("No history that far back\n");
+                      }
                   } else if (!strncmp(input_buffer, "/switch", 7) && strlen(input_buffer) > 7) {
                       char* topic = strchr(input_buffer, ' ');
                       if (!topic) {
@@ -128,7 +169,7 @@ int main(int argc, char* argv[]) {
                           continue;
                       }
                       topic++;
-                      Node* switched_channel = find_channel(&channel_list, topic);
+                      Node* switched_channel = find_channel(&channel_list, topic, hash(topic));
                       if (!switched_channel) {
                           attron(A_UNDERLINE | A_BOLD | COLOR_PAIR(RED));
                           printw("You are not subscribed to that topic.\n");
@@ -138,47 +179,14 @@ int main(int argc, char* argv[]) {
                     // Switch current channel to the newly switched channel
                       current_chat = switched_channel;
                       clear();
-                      int start = (current_chat->write > MAX_MESSAGES) ? current_chat->write : 0;
-                      for (int index = start; index < (start + MAX_MESSAGES); index++) {
-                          if (!current_chat->buffer_history[index % MAX_MESSAGES]) break;
-                          char msg[BUFSIZ];
-                          strcpy(msg, current_chat->buffer_history[index % MAX_MESSAGES]);
-                          char* topic = strchr(msg, ' ');
-                          *(topic++) = '\0';
-                          char* body = strchr(topic, ' ');
-                          *(body++) = '\0';
-                          // We sent the message
-                          unsigned long color = hash(name) % NUM_COLORS;
-                          if (!strcmp(msg, mq->name)) {
-                              attron(A_UNDERLINE | A_BOLD | COLOR_PAIR(BLUE));
-                              printw("\r%s", name);
-                              attroff(A_UNDERLINE | A_BOLD | COLOR_PAIR(BLUE));
-                          }
-                          else {
-                              attron(COLOR_PAIR(color));
-                              printw("\r%s on ", msg);
-                              attron(A_UNDERLINE | A_BOLD);
-                              printw("%s>", topic);
-                              attroff(A_UNDERLINE | A_BOLD | COLOR_PAIR(color));
-                          }
-                        // If the message mentions our name, highlight it
-                        if (strstr(body, mq->name)) attron(COLOR_PAIR(MENTION) | A_BOLD);
-                        printw(" %-80s\n", body);
-                        attroff(COLOR_PAIR(MENTION) | A_BOLD);
-                      }
-                      refresh();
+                      // Only the newest messages that fit are drawn
+                      render_recent(current_chat, current_chat->history->count, LINES - 1, COLS);
                   }
                   else {
                       // Im submitting a message
                       mq_publish(mq, current_chat->topic, input_buffer);
-                      attron(A_UNDERLINE | A_BOLD | COLOR_PAIR(BLUE));
-                      printw("\r%s>", name);
-                      attroff(A_UNDERLINE | A_BOLD | COLOR_PAIR(BLUE));
-                      printw(" %-80s\n", input_buffer);
-                      refresh();
-                      char temp_buf[input_index + 1];
-                      strcpy(temp_buf, input_buffer);
-                      save_message(current_chat, name, temp_buf);
+                      save_message(current_chat, name, input_buffer, mq->name);
+                      render_recent(current_chat, 1, LINES - 1, COLS);
                   }
                   input_index = 0;
                   input_buffer[0] = 0;
@@ -190,50 +198,45 @@ int main(int argc, char* argv[]) {
               }
               printw("\r%-80s", "");			// Erase line (hack!)
               printw("\r> %s", input_buffer);		// Write
-              refresh();
-          } else if (events[i].data.fd == mq->p[0]) {
-              // Read the dummy message
-              read(mq->p[0], inbuf, 17);
-              // Pop message from incoming
-              char* name = mq_retrieve(mq);
-              if (name) {
-                  char* topic = strchr(name, ' ');
-                  *(topic++) = '\0';
-                  char* body = strchr(topic, ' ');
-                  *(body++) = '\0';
-                  // We sent this message so disregard it
-                  if (!strcmp(name, mq->name)) {
-                      free(name);
-                      continue;
+          } else if (events[i].data.fd == mq_fd(mq)) {
+              // Take every message that is ready from incoming at once
+              char*  messages[MAX_RETRIEVE];
+              size_t ready;
+              size_t fresh = 0;
+              mq_process_events(mq);
+              while ((ready = mq_retrieve_many(mq, messages, MAX_RETRIEVE)) > 0) {
+                  for (size_t m = 0; m < ready; m++) {
+                      char* name = messages[m];
+                      char* topic = strchr(name, ' ');
+                      *(topic++) = '\0';
+                      char* body = strchr(topic, ' ');
+                      *(body++) = '\0';
+                      // We sent this message so disregard it (only a server
+                      // that ignores MQ_NO_LOCAL sends it back)
+                      if (!strcmp(name, mq->name)) {
+                          mq_release(mq, name);
+                          continue;
+                      }
+                    // Hash the topic once to find its channel
+                    Node* channel = find_channel(&channel_list, topic, hash(topic));
+                    if (!channel) {
+                        printw("Could not find proper channel\n");
+                        mq_release(mq, name);
+                        continue;
+                    }
+                    // Messages to our current topic are drawn once the batch is in
+                    if (channel == current_chat) fresh++;
+                    save_message(channel, name, body, mq->name);
+                    mq_release(mq, name);
                   }
-                // If the message is to our current topic then just print it (and store in buffer)
-                if (!strcmp(topic, current_chat->topic)) {
-                    unsigned long color = hash(name) % NUM_COLORS;
-                    attron(COLOR_PAIR(color));
-                    printw("\r%s on ", name);
-                    attron(A_UNDERLINE | A_BOLD);
-                    printw("%s>", topic);
-                    attroff(A_UNDERLINE | A_BOLD | COLOR_PAIR(color));
-                    // If the message mentions our name, highlight it
-                    if (strstr(body, mq->name)) attron(COLOR_PAIR(MENTION) | A_BOLD);
-                    printw(" %-80s\n", body);
-                    attroff(COLOR_PAIR(MENTION) | A_BOLD);
-                }
-                Node* channel = find_channel(&channel_list, topic);
-                if (!channel) {
-                    printw("Could not find proper channel\n");
-                    continue;
-                }
-                save_message(channel, name, body);
-                free(name);
-            }
+              }
+              render_recent(current_chat, fresh, LINES - 1, COLS);
           }
       }
-      refresh();
     }
 
   endwin();
   mq_delete(mq);
-  free_buffers(channel_list.head);
+  free_channels(&channel_list);
   return 0;
 }
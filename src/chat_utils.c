@@ -5,6 +5,7 @@
 #include <string.h>
 #include <curses.h>
 #include <sys/epoll.h>
+#include <sys/time.h>
 #include <unistd.h>
 
 #include "mq/chat_app.h"
@@ -12,10 +13,15 @@
 void init_curses() {
     initscr();
     scrollok(stdscr,TRUE);
-    if (!has_colors() || start_color()) {
+    if (init_colors()) {
         fprintf(stderr, "Need colored terminal\n");
         exit(1);
     }
+}
+
+// Function to set up the color pairs of the current screen
+int init_colors() {
+    if (!has_colors() || start_color()) return 1;
     init_pair(1, COLOR_RED, 0);
     init_pair(2, COLOR_YELLOW, 0);
     init_pair(3, COLOR_CYAN, 0);
@@ -23,6 +29,7 @@ void init_curses() {
     init_pair(5, COLOR_GREEN, 0);
     init_pair(6, COLOR_BLUE, 0);
     init_pair(7, COLOR_WHITE, COLOR_YELLOW);
+    return 0;
 }
 int epoll_setup(MessageQueue* mq) {
     int s;
@@ -40,18 +47,51 @@ int epoll_setup(MessageQueue* mq) {
         fprintf(stderr, "Failed to add stdin to epoll interest list");
         return -1;
     }
-    server.data.fd = mq->p[0];
+    server.data.fd = mq_fd(mq);
     server.events  = EPOLLIN | EPOLLET;
-    s = epoll_ctl (epoll_fd, EPOLL_CTL_ADD, mq->p[0], &server);
+    s = epoll_ctl (epoll_fd, EPOLL_CTL_ADD, server.data.fd, &server);
     if (s == -1) {
-        fprintf(stderr, "Failed to add second pipe to epoll interest list");
+        fprintf(stderr, "Failed to add message queue to epoll interest list");
         return -1;
     }
     return epoll_fd;
 }
 
-// Function to push a new channel node into the channel list
+// Function to double the slots of the channel table, rehashing the channels already in it
+static int grow_channels(Channels* channels) {
+    size_t capacity = channels->capacity ? channels->capacity * 2 : MIN_CHANNELS;
+    Node** slots    = calloc(capacity, sizeof(Node*));
+    if (!slots) return 1;
+    for (size_t i = 0; i < channels->capacity; i++) {
+        Node* node = channels->slots[i];
+        if (!node) continue;
+        size_t slot = node->hash & (capacity - 1);
+        while (slots[slot]) slot = (slot + 1) & (capacity - 1);
+        slots[slot] = node;
+    }
+    free(channels->slots);
+    channels->slots    = slots;
+    channels->capacity = capacity;
+    return 0;
+}
+
+// Function to fill a new channel's history from its journal, reading back only as far as the ring holds
+static void load_history(Node* node) {
+    HistoryEntry entry;
+    size_t       count = 0;
+    size_t       bytes = 0;
+    while (journal_read(node->journal, count, &entry) && (bytes += history_size(entry.length)) <= node->history->capacity) {
+        count++;
+    }
+    while (count-- > 0 && journal_read(node->journal, count, &entry)) {
+        history_append(node->history, entry.sender, entry.body, entry.length, entry.time, entry.flags);
+    }
+}
+
+// Function to push a new channel node into the channel table
 int push_node(Channels* channels, char* topic) {
+    // Grow while the table is at most three quarters full
+    if (4 * (channels->count + 1) > 3 * channels->capacity && grow_channels(channels)) return 1;
     char* dyn_topic = strdup(topic);
     if (!dyn_topic) return 1;
     Node* new_node = calloc(1, sizeof(Node));
@@ -59,71 +99,135 @@ int push_node(Channels* channels, char* topic) {
         free(dyn_topic);
         return 1;
     }
-    char** temp_buf = (char**)calloc(MAX_MESSAGES, sizeof(char*));
-    if (!temp_buf) {
+    // History is allocated once here, so saving messages never allocates
+    History* history = history_create(channels->history);
+    if (!history) {
         free(dyn_topic);
         free(new_node);
         return 1;
     };
-    new_node->topic          = dyn_topic;
-    new_node->write          = 0;
-    new_node->read           = 0;
-    new_node->buffer_history = temp_buf;
-    new_node->next           = NULL;
-    if (!channels->head) {
-       channels->head = new_node; 
-    } else {
-        new_node->next = channels->head;
-        channels->head = new_node;
+    new_node->topic   = dyn_topic;
+    new_node->hash    = hash(dyn_topic);
+    new_node->history = history;
+    // Saved history is mapped but only its newest messages are read
+    if (channels->journal && (new_node->journal = journal_open(channels->journal, dyn_topic, 0, 0))) {
+        load_history(new_node);
     }
+    size_t slot = new_node->hash & (channels->capacity - 1);
+    while (channels->slots[slot]) slot = (slot + 1) & (channels->capacity - 1);
+    channels->slots[slot] = new_node;
+    channels->count++;
     return 0;
 }
 
-// Function to save the message in the ring buffer
-void save_message(Node* curr_chat, char* name, char* body) {
-    char msg[BUFSIZ];
-    sprintf(msg, "%s %s %s", name, curr_chat->topic, body);
-    char* dyn_msg = strdup(msg);
-    if (!dyn_msg) {
-	printw("could not allocate message\n");	
-	return;
+// Function to save the message in the channel's history ring, parsing out what rendering needs (self is our name)
+void save_message(Node* curr_chat, char* name, char* body, char* self) {
+    struct timeval now;
+    uint32_t       flags = hash(name) % NUM_COLORS;
+    if (!strcmp(name, self)) flags |= MESSAGE_MINE;
+    if (strstr(body, self))  flags |= MESSAGE_MENTION;
+    gettimeofday(&now, NULL);
+    history_append(curr_chat->history, name, body, strlen(body), (uint64_t)now.tv_sec * 1000000 + now.tv_usec, flags);
+    if (curr_chat->journal) {
+        journal_append(curr_chat->journal, name, body, strlen(body), (uint64_t)now.tv_sec * 1000000 + now.tv_usec, flags);
     }
-    // If we reached the end of the circular buffer, wrap around and remove oldest entry and update read
-    if (curr_chat->write >= MAX_MESSAGES) {
-	curr_chat->read++;
-	free(curr_chat->buffer_history[curr_chat->write % MAX_MESSAGES]);
+}
+
+// Function to draw one saved message of a channel
+void render_message(Node* channel, HistoryEntry* entry) {
+    if (entry->flags & MESSAGE_MINE) {
+        attron(A_UNDERLINE | A_BOLD | COLOR_PAIR(BLUE));
+        printw("\r%s>", entry->sender);
+        attroff(A_UNDERLINE | A_BOLD | COLOR_PAIR(BLUE));
+    } else {
+        int color = entry->flags & MESSAGE_COLOR;
+        attron(COLOR_PAIR(color));
+        printw("\r%s on ", entry->sender);
+        attron(A_UNDERLINE | A_BOLD);
+        printw("%s>", channel->topic);
+        attroff(A_UNDERLINE | A_BOLD | COLOR_PAIR(color));
     }
-    curr_chat->buffer_history[curr_chat->write++ % MAX_MESSAGES] = dyn_msg;
-    refresh();
+    // If the message mentions our name, highlight it
+    if (entry->flags & MESSAGE_MENTION) attron(COLOR_PAIR(MENTION) | A_BOLD);
+    printw(" %-80s\n", entry->body);
+    attroff(COLOR_PAIR(MENTION) | A_BOLD);
 }
 
-// Function to delete a channel node from the channel list
+// Function to count the screen rows a saved message takes when drawn cols wide
+int message_rows(Node* channel, HistoryEntry* entry, int cols) {
+    size_t width = strlen(entry->sender) + 1;
+    if (!(entry->flags & MESSAGE_MINE)) width += strlen(" on ") + strlen(channel->topic);
+    width += 1 + (entry->length > 80 ? entry->length : 80);
+    return cols > 0 ? (width + cols - 1) / cols : 1;
+}
+
+// Function to draw the newest count messages of a channel, or as many of them as fit in rows
+size_t render_recent(Node* channel, size_t count, int rows, int cols) {
+    HistoryEntry entry;
+    uint64_t     cursor = channel->history->tail;
+    uint64_t     start  = cursor;
+    size_t       drawn  = 0;
+    // Walk back from the newest message so older ones are never looked at
+    for (int used = 0; drawn < count && history_prev(channel->history, &cursor, &entry); drawn++) {
+        used += message_rows(channel, &entry, cols);
+        if (used > rows && drawn) break;
+        start = cursor;
+    }
+    for (size_t i = 0; i < drawn && history_next(channel->history, &start, &entry); i++) {
+        render_message(channel, &entry);
+    }
+    return drawn;
+}
+
+// Function to draw the saved messages of a channel that fit in rows, the newest of them age messages back
+size_t render_journal(Node* channel, size_t age, int rows, int cols) {
+    HistoryEntry entry;
+    size_t       count = 0;
+    // Read straight from the mapped segments, newest first, until the screen is full
+    for (int used = 0; journal_read(channel->journal, age + count, &entry); count++) {
+        used += message_rows(channel, &entry, cols);
+        if (used > rows && count) break;
+    }
+    for (size_t i = count; i-- > 0 && journal_read(channel->journal, age + i, &entry);) {
+        render_message(channel, &entry);
+    }
+    return count;
+}
+
+// Function to delete a channel node from the channel table
 int delete_channel(Channels* channels, char* topic) {
-    Node* prev = NULL;
-    for (Node* curr_node = channels->head; curr_node; curr_node = curr_node->next) {
-        if (!strcmp(curr_node->topic, topic)) {
-            if (!prev) {
-                channels->head = NULL;
-            } else {
-                prev->next = curr_node->next;
-            }
-            free_node(curr_node);
-            return 1;
+    Node* node = find_channel(channels, topic, hash(topic));
+    if (!node) return 0;
+    size_t mask = channels->capacity - 1;
+    size_t slot = node->hash & mask;
+    while (channels->slots[slot] != node) slot = (slot + 1) & mask;
+    channels->slots[slot] = NULL;
+    free_node(node);
+    channels->count--;
+    // Shift back the channels after it that would no longer be found past the hole
+    for (size_t next = (slot + 1) & mask; channels->slots[next]; next = (next + 1) & mask) {
+        size_t home = channels->slots[next]->hash & mask;
+        if (((next - home) & mask) >= ((next - slot) & mask)) {
+            channels->slots[slot] = channels->slots[next];
+            channels->slots[next] = NULL;
+            slot = next;
         }
-        prev = curr_node;
     }
-    return 0;
+    return 1;
 }
 
-// Function to find a certain channel node from the channel list
-Node* find_channel(Channels* channels, char* topic) {
-    for (Node* curr_node = channels->head; curr_node; curr_node = curr_node->next) {
-        if (!strcmp(curr_node->topic, topic)) {
-            return curr_node;
+// Function to find a certain channel node from the channel table (topic_hash is hash(topic))
+Node* find_channel(Channels* channels, char* topic, unsigned long topic_hash) {
+    if (!channels->capacity) return NULL;
+    size_t mask = channels->capacity - 1;
+    for (size_t slot = topic_hash & mask; channels->slots[slot]; slot = (slot + 1) & mask) {
+        Node* node = channels->slots[slot];
+        if (node->hash == topic_hash && !strcmp(node->topic, topic)) {
+            return node;
         }
     }
     return NULL;
-};
+}
 
 // Function to print all of the current subscriptions
 void print_channels(Channels* channels) {
@@ -132,8 +236,8 @@ void print_channels(Channels* channels) {
     attron(A_UNDERLINE);
     printw("Channels\n");
     attroff(A_UNDERLINE);
-    for (Node* curr_node = channels->head; curr_node; curr_node = curr_node->next) {
-        printw("> %s\n", curr_node->topic);
+    for (size_t slot = 0; slot < channels->capacity; slot++) {
+        if (channels->slots[slot]) printw("> %s\n", channels->slots[slot]->topic);
     }
     printw("--------------------------\n");
     attroff(A_BOLD | COLOR_PAIR(MAGENTA));
@@ -149,24 +253,26 @@ void print_menu() {
 	printw("/switch [topic]\n");
 	printw("/unsubscribe [topic]\n");
 	printw("/topic\n");
+	printw("/back [messages]\n");
 	printw("--------------------------\n");
 	attroff(A_BOLD | COLOR_PAIR(MAGENTA));
 }
-// Function to free all of the buffers
-void free_buffers(Node* curr) {
-    if (!curr) return;
-    free_buffers(curr->next);
-    free_node(curr);
+// Function to free all of the channels
+void free_channels(Channels* channels) {
+    for (size_t slot = 0; slot < channels->capacity; slot++) {
+        if (channels->slots[slot]) free_node(channels->slots[slot]);
+    }
+    free(channels->slots);
+    channels->slots    = NULL;
+    channels->capacity = 0;
+    channels->count    = 0;
 }
 
 // Function to delete a particular channel
 void free_node(Node* curr) {
     free(curr->topic);
-    for (int i = 0; i < MAX_MESSAGES; i++) {
-        if (curr->buffer_history[i]) free(curr->buffer_history[i]);
-        else break;
-    }
-    free(curr->buffer_history);
+    history_delete(curr->history);
+    journal_close(curr->journal);
     free(curr);
 }
 /* djb2 hash (http://www.cse.yorku.ca/~oz/hash.html) */
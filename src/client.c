@@ -1,20 +1,89 @@
 /* client.c: Message Queue Client */
 
 #include "mq/client.h"
+#include "mq/compress.h"
+#include "mq/engine.h"
+#include "mq/frame.h"
+#include "mq/io_pool.h"
 #include "mq/logging.h"
+#include "mq/response.h"
 #include "mq/socket.h"
 #include "mq/string.h"
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <strings.h>
+#include <sys/eventfd.h>
+#include <time.h>
 #include <unistd.h>
 
 /* Internal Constants */
 
 #define SENTINEL "SHUTDOWN"
-sem_t Lock;
-Thread pusher_thread, puller_thread;
+#define BATCH_BYTES     65536   /* Default most body bytes per batch */
+#define BATCH_LINGER    1000    /* Default microseconds to wait for a batch */
+#define RETRIEVE_CHUNK  256     /* Most messages taken from incoming at once */
+#define PUSH_WINDOW     16      /* Default most requests in flight at once */
+#define PUSH_SENDS      2       /* Most times a request is sent (once more after a break) */
+#define STOP_CONNECTS   5       /* Most connection attempts the sentinel makes once shut down */
+
+/* Internal Structures */
+
+typedef struct Connection Connection;
+struct Connection {
+    int         fd;         // Socket (-1 if not connected)
+    Response    response;   // Response parser (keeps bytes read ahead)
+    FrameTopics topics;     // Topic IDs handed out on it (binary frames only)
+    size_t      connects;   // Times opened (more than once means it reconnected)
+};
+
+typedef struct Flight Flight;
+struct Flight {
+    Request *   requests;   // Requests sent together (linked through next)
+    size_t      count;      // Number of requests
+    size_t      replies;    // Answers still owed for them
+    int         status;     // Worst answer so far (-1 if given up)
+    int         sends;      // Times sent
+};
+
+typedef struct Window Window;
+struct Window {
+    Flight *    flights;    // Ring of flights sent but not yet answered, oldest at head
+    size_t      size;       // Slots in ring (most flights at once)
+    size_t      head;       // Oldest flight
+    size_t      count;      // Flights in ring
+};
+
 /* Internal Prototypes */
 
 void * mq_pusher(void *);
 void * mq_puller(void *);
+void * mq_dumper(void *);
+bool   mq_connect(MessageQueue *mq, Connection *server);
+bool   mq_connect_stopping(MessageQueue *mq, Connection *server);
+bool   mq_dial(MessageQueue *mq, Connection *server);
+bool   mq_upgrade(MessageQueue *mq, Connection *server);
+void   mq_disconnect(Connection *server);
+int    mq_request(MessageQueue *mq, Connection *server, struct iovec *iov, int iovcnt, Request **response);
+int    mq_response(MessageQueue *mq, Connection *server, Request **response, bool *keep);
+int    mq_stream(MessageQueue *mq, Connection *server, struct iovec *iov, int iovcnt);
+void   mq_deliver(MessageQueue *mq, Request *messages, size_t count);
+bool   mq_enqueue(MessageQueue *mq, Request *r);
+bool   mq_batch_reserve(char **batch, size_t *capacity, size_t needed);
+bool   mq_batch_frame(char **batch, size_t *capacity, size_t *used, const char *topic, size_t length);
+bool   mq_batch_append(char **batch, size_t *capacity, size_t *used, const char *topic, const char *body);
+Request * mq_push_batch(MessageQueue *mq, Request *first, Flight *flight);
+size_t mq_flight_requests(Flight *flight, Request **requests);
+bool   mq_flight_send(MessageQueue *mq, Connection *server, Flight *flight, char **frames, size_t *capacity);
+bool   mq_window_answer(MessageQueue *mq, Connection *server, Window *window);
+void   mq_window_retire(MessageQueue *mq, Window *window);
+void   mq_window_resend(MessageQueue *mq, Connection *server, Window *window, char **frames, size_t *capacity);
+int    mq_frames_iovec(MessageQueue *mq, Connection *server, Request **requests, size_t count, char **frames, size_t *capacity, struct iovec *iov, size_t *replies);
+bool   mq_frame_append(Connection *server, char **frames, size_t *capacity, size_t *used, Opcode opcode, const char *topic, size_t topic_length, size_t length);
+bool   mq_frame_compress(MessageQueue *mq, char **frames, size_t *capacity, size_t *used, const char *data, size_t length);
+int    mq_frames_batch(MessageQueue *mq, Request **requests, size_t count, const size_t *offsets, char **frames, size_t *capacity, struct iovec *iov);
+char * mq_take(MessageQueue *mq, Request *r, bool *dropped);
 
 /* External Functions */
 
@@ -34,23 +103,47 @@ MessageQueue * mq_create(const char *name, const char *host, const char *port) {
     strcpy(mq->name, name);
     strcpy(mq->host, host);
     strcpy(mq->port, port);
+    if (!(mq->pool = request_pool_create())) return NULL;
     // Allocate the pusher and puller queues
-    if (!(outgoing = queue_create())) return NULL;
-    if (!(incoming = queue_create())) return NULL;
+    // Any app thread may publish, but only the puller fills incoming
+    if (!(outgoing = queue_create(QUEUE_CAPACITY, QUEUE_SINGLE_CONSUMER))) return NULL;
+    if (!(incoming = queue_create(QUEUE_CAPACITY, QUEUE_SINGLE_PRODUCER | QUEUE_SINGLE_CONSUMER))) return NULL;
     mq->outgoing = outgoing;
     mq->incoming = incoming;
     mq->shutdown = false; 
-    sem_init(&Lock, 0, 1);
+    mq->keep_alive = true;
+    mq->batch_count = 1;
+    mq->batch_bytes = BATCH_BYTES;
+    mq->batch_linger = BATCH_LINGER;
+    mq->window = PUSH_WINDOW;
+    mq->connect_timeout = SOCKET_CONNECT_TIMEOUT;
+    mq->streaming = true;
+    mq->capacity = 0;
+    mq->overflow = NULL;
+    mq->binary = true;
+    mq->compress_threshold = COMPRESS_THRESHOLD;
+    memset(&mq->compression, 0, sizeof(mq->compression));
+    mq->outgoing_limits = outgoing->limits;
+    mq->incoming_limits = incoming->limits;
+    if (!(mq->stats = stats_create())) return NULL;
+    mq->stats_interval = 0;
+    mq->stats_file = stderr;
+    mq->timestamps = false;
+    mq->mode = MQ_THREADED;
+    mq->engine = NULL;
+    mq->io_pool = NULL;
+    sem_init(&mq->lock, 0, 1);
+    sem_init(&mq->detached, 0, 0);
+    sem_init(&mq->dumping, 0, 0);
 
-    // Subscribe to a shutdown topic for the user
-    mq_subscribe(mq, SENTINEL);
     char uri[BUFSIZ];
     sprintf(uri, "/topic/%s", SENTINEL);
-    if (!(sentinel = request_create("PUT", uri, SENTINEL))) return NULL;
+    if (!(sentinel = request_create(mq->pool, METHOD_PUT, uri, SENTINEL))) return NULL;
     mq->sentinel = sentinel;
 
-    // Create the pipe
-    if (pipe(mq->p) < 0) return NULL;
+    // Create the eventfd counting incoming messages (writing it never
+    // blocks, so waking the application never holds up a shared pool thread)
+    if ((mq->notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) return NULL;
     
     return mq;
 }
@@ -60,8 +153,17 @@ MessageQueue * mq_create(const char *name, const char *host, const char *port) {
  * @param   mq      Message Queue structure.
  */
 void mq_delete(MessageQueue *mq) {
+    // A pool thread may still be running the engine
+    if (mq->mode == MQ_POOLED && mq->engine && !mq_shutdown(mq)) mq_stop(mq);
+    if (mq->engine) engine_delete(mq->engine);
     queue_delete(mq->outgoing);
     queue_delete(mq->incoming);
+    request_pool_delete(mq->pool);
+    sem_destroy(&mq->lock);
+    sem_destroy(&mq->detached);
+    sem_destroy(&mq->dumping);
+    stats_delete(mq->stats);
+    close(mq->notify_fd);
     free(mq); 
 }
 
@@ -70,72 +172,206 @@ void mq_delete(MessageQueue *mq) {
  * @param   mq      Message Queue structure.
  * @param   topic   Topic to publish to.
  * @param   body    Message body to publish.
+ * @return  Whether or not the message was queued (if not, errno is EAGAIN
+ *          when the outgoing queue is full under QUEUE_FAIL, or EMSGSIZE
+ *          when the message does not fit in BUFSIZ bytes).
  */
-void mq_publish(MessageQueue *mq, const char *topic, const char *body) {
+bool mq_publish(MessageQueue *mq, const char *topic, const char *body) {
     Request* new_request;
-    char dest[] = "/topic/";
+    char dest[BUFSIZ];
     char new_body[BUFSIZ];
-    sprintf(new_body, "%s %s %s", mq->name, topic, body);
-    if ((new_request = request_create("PUT", strcat(dest, topic), new_body))) {
-        queue_push(mq->outgoing, new_request);
+    // The server needs to know who published to honour MQ_NO_LOCAL
+    snprintf(dest, sizeof(dest), "/topic/%s?from=%s", topic, mq->name);
+    size_t stamped = mq->timestamps ? stats_stamp(new_body) : 0;
+    size_t needed  = snprintf(new_body + stamped, sizeof(new_body) - stamped, "%s %s %s", mq->name, topic, body);
+    if (needed >= sizeof(new_body) - stamped) {
+        errno = EMSGSIZE;
+        return false;
     }
+    if (!(new_request = request_create(mq->pool, METHOD_PUT, dest, new_body))) return false;
+    // The request is not ours to look at once queued
+    size_t length = new_request->length;
+    new_request->stamp = stats_now();
+    if (!mq_enqueue(mq, new_request)) return false;
+    stats_add(mq->stats, STATS_PUBLISHED, 1);
+    stats_add(mq->stats, STATS_PUBLISHED_BYTES, length);
+    return true;
 }
 
 /**
- * Retrieve one message (by taking Request from incoming queue).
+ * Publish several messages to topic as a single batch request.
  * @param   mq      Message Queue structure.
- * @return  Newly allocated message body (must be freed).
+ * @param   topic   Topic to publish to.
+ * @param   bodies  Message bodies to publish.
+ * @param   n       Number of message bodies.
+ * @return  Whether or not the batch was queued (see mq_publish).
  */
-char * mq_retrieve(MessageQueue *mq) {
+bool mq_publish_batch(MessageQueue *mq, const char *topic, const char **bodies, size_t n) {
     Request* new_request;
-    char* return_message = NULL;
-    if ((new_request = queue_pop(mq->incoming))) {
-        if (!streq(new_request->body, SENTINEL)){
-            return_message = strdup(new_request->body);
-            request_delete(new_request);
-            return return_message;
-        }
-        // If it is the sentinel then just free it and don't send it to app
-        request_delete(new_request);
-    } 
-    return NULL;
+    char uri[BUFSIZ], new_body[BUFSIZ];
+    char* batch = NULL;
+    size_t capacity = 0, used = 0;
+    for (size_t i = 0; i < n; i++) {
+        size_t stamped = mq->timestamps ? stats_stamp(new_body) : 0;
+        size_t needed  = snprintf(new_body + stamped, BUFSIZ - stamped, "%s %s %s", mq->name, topic, bodies[i]);
+        if (needed >= BUFSIZ - stamped) errno = EMSGSIZE;
+        if (needed >= BUFSIZ - stamped || !mq_batch_append(&batch, &capacity, &used, topic, new_body)) {
+            free(batch);
+            return false;
+        }
+    }
+    snprintf(uri, sizeof(uri), "/batch?from=%s", mq->name);
+    new_request = used ? request_create(mq->pool, METHOD_PUT, uri, batch) : NULL;
+    free(batch);
+    if (!new_request) return false;
+    new_request->stamp = stats_now();
+    if (!mq_enqueue(mq, new_request)) return false;
+    stats_add(mq->stats, STATS_PUBLISHED, n);
+    stats_add(mq->stats, STATS_PUBLISHED_BYTES, used);
+    return true;
+}
+
+/**
+ * Retrieve one message (by taking Request from incoming queue).  In event
+ * mode only as many messages as mq_process_events reported should be
+ * retrieved, since nothing else will fill the queue while this waits.
+ * @param   mq      Message Queue structure.
+ * @return  Message body (must be handed back with mq_release).
+ */
+char * mq_retrieve(MessageQueue *mq) {
+    char* message;
+    bool dropped;
+    // A message that would not inflate is dropped in favour of the next one
+    do message = mq_take(mq, queue_pop(mq->incoming), &dropped); while (dropped);
+    return message;
+}
+
+/**
+ * Retrieve one message if there is one, without waiting.
+ * @param   mq      Message Queue structure.
+ * @return  Message body (must be handed back with mq_release), or NULL if
+ *          none has arrived.
+ */
+char * mq_try_retrieve(MessageQueue *mq) {
+    char* message;
+    bool dropped;
+    do message = mq_take(mq, queue_try_pop(mq->incoming), &dropped); while (dropped);
+    return message;
+}
+
+/**
+ * Retrieve every message that has arrived (up to max) without waiting,
+ * taking them all from the incoming queue at once.
+ * @param   mq          Message Queue structure.
+ * @param   messages    Where to store message bodies (each must be handed
+ *                      back with mq_release).
+ * @param   max         Most messages to retrieve.
+ * @return  Number of messages retrieved (0 if none has arrived).
+ */
+size_t mq_retrieve_many(MessageQueue *mq, char **messages, size_t max) {
+    Request* requests[RETRIEVE_CHUNK];
+    size_t count = 0, popped, wanted;
+    do {
+        wanted = max - count < RETRIEVE_CHUNK ? max - count : RETRIEVE_CHUNK;
+        if (!(popped = queue_try_pop_many(mq->incoming, requests, wanted))) break;
+        for (size_t i = 0; i < popped; i++) {
+            Request* r = requests[i];
+            // Bodies stay compressed until the application takes them
+            if (r->compressed && !(r = compress_inflate(mq->pool, r, &mq->compression))) continue;
+            stats_unstamp(mq->stats, r);
+            // The sentinel is freed rather than handed to the application
+            if (streq(r->body, SENTINEL)) request_delete(r);
+            else messages[count++] = r->body;
+        }
+    } while (popped == wanted && count < max);
+    // Taking messages may make room for ones the pool thread is holding
+    if (count && mq->mode == MQ_POOLED && mq->engine && engine_stalled(mq->engine)) engine_notify(mq->engine);
+    return count;
+}
+
+/**
+ * Release message returned by any of the mq_retrieve functions (back to
+ * the request pool).
+ * @param   mq      Message Queue structure.
+ * @param   message Message body.
+ */
+void mq_release(MessageQueue *mq, char *message) {
+    if (message) request_delete(request_from_body(message));
 }
 
 /**
  * Subscribe to specified topic.
  * @param   mq      Message Queue structure.
  * @param   topic   Topic string to subscribe to.
+ * @return  Whether or not the subscription was queued (see mq_publish).
  **/
-void mq_subscribe(MessageQueue *mq, const char *topic) {
+bool mq_subscribe(MessageQueue *mq, const char *topic) {
+    return mq_subscribe_flags(mq, topic, 0);
+}
+
+/**
+ * Subscribe to specified topic with options (see MQSubscribeFlags).  With
+ * MQ_NO_LOCAL the server leaves this queue out when fanning out messages
+ * the client publishes itself, so they never come back to it.
+ * @param   mq      Message Queue structure.
+ * @param   topic   Topic string to subscribe to.
+ * @param   flags   Subscription options (0 for none).
+ * @return  Whether or not the subscription was queued (see mq_publish).
+ **/
+bool mq_subscribe_flags(MessageQueue *mq, const char *topic, int flags) {
     // create a new string combining "/subscription/" and topic
     Request* new_request;
-    char uri[BUFSIZ];
-    sprintf(uri, "/subscription/%s/%s", mq->name, topic);
-    if ((new_request = request_create("PUT", uri, NULL))) queue_push(mq->outgoing, new_request);
-
+    char uri[BUFSIZ], query[OPTIONS_MAX];
+    // The server makes the queue on the first subscription, so say how
+    mq_queue_options(mq, query, sizeof(query));
+    size_t used = strlen(query);
+    if (flags & MQ_NO_LOCAL) snprintf(query + used, sizeof(query) - used, "%cnolocal=1", used ? '&' : '?');
+    snprintf(uri, sizeof(uri), "/subscription/%s/%s%s", mq->name, topic, query);
+    if (!(new_request = request_create(mq->pool, METHOD_PUT, uri, NULL))) return false;
+    return mq_enqueue(mq, new_request);
 }
 
 /**
  * Unubscribe to specified topic.
  * @param   mq      Message Queue structure.
  * @param   topic   Topic string to unsubscribe from.
+ * @return  Whether or not the request was queued (see mq_publish).
  **/
-void mq_unsubscribe(MessageQueue *mq, const char *topic) {
+bool mq_unsubscribe(MessageQueue *mq, const char *topic) {
     char uri[BUFSIZ];
     Request* new_request;
     sprintf(uri, "/subscription/%s/%s", mq->name, topic);
-    if ((new_request = request_create("DELETE", uri, NULL))) queue_push(mq->outgoing, new_request);
+    if (!(new_request = request_create(mq->pool, METHOD_DELETE, uri, NULL))) return false;
+    return mq_enqueue(mq, new_request);
 }
 
 /**
  * Start running the background threads:
  *  1. First thread should continuously send requests from outgoing queue.
  *  2. Second thread should continuously receive reqeusts to incoming queue.
+ * In event mode no threads are started; instead the same work is done on
+ * non-blocking sockets whenever the application calls mq_process_events.
+ * In pooled mode that work is done by one of the threads of mq->io_pool.
  * @param   mq      Message Queue structure.
  */
 void mq_start(MessageQueue *mq) {
-    thread_create(&pusher_thread, NULL, mq_pusher, mq);
-    thread_create(&puller_thread, NULL, mq_puller, mq); 
+    // Subscribe to a shutdown topic for the user (after any options are set)
+    mq_subscribe(mq, SENTINEL);
+    // Limits can only change while nothing else uses the queues
+    if (!queue_limit(mq->outgoing, &mq->outgoing_limits) || !queue_limit(mq->incoming, &mq->incoming_limits)) {
+        error("Unable to apply queue limits");
+    }
+    if (mq->stats_interval > 0) thread_create(&mq->dumper, NULL, mq_dumper, mq);
+    if (mq->mode == MQ_EVENTS || mq->mode == MQ_POOLED) {
+        if (!(mq->engine = engine_create(mq))) {
+            error("Unable to start event engine");
+            return;
+        }
+        if (mq->mode == MQ_POOLED) io_pool_add(mq->io_pool, mq);
+        return;
+    }
+    thread_create(&mq->pusher, NULL, mq_pusher, mq);
+    thread_create(&mq->puller, NULL, mq_puller, mq); 
 }
 
 /**
@@ -144,13 +380,25 @@ void mq_start(MessageQueue *mq) {
  * @param   mq      Message Queue structure.
  */
 void mq_stop(MessageQueue *mq) {
-    sem_wait(&Lock);
+    sem_wait(&mq->lock);
     mq->shutdown = true;
-    sem_post(&Lock);
+    sem_post(&mq->lock);
+    if (mq->stats_interval > 0) {
+        sem_post(&mq->dumping);
+        thread_join(mq->dumper, NULL);
+    }
+    if (mq->mode == MQ_EVENTS) return;
+    if (mq->mode == MQ_POOLED) {
+        // Wait for the pool thread to let go of the engine
+        if (!mq->engine) return;
+        engine_notify(mq->engine);
+        sem_wait(&mq->detached);
+        return;
+    }
     queue_push(mq->outgoing, mq->sentinel);
     // Join the threads
-    thread_join(pusher_thread, NULL);
-    thread_join(puller_thread, NULL);
+    thread_join(mq->pusher, NULL);
+    thread_join(mq->puller, NULL);
 }
 
 /**
@@ -158,69 +406,1009 @@ void mq_stop(MessageQueue *mq) {
  * @param   mq      Message Queue structure.
  */
 bool mq_shutdown(MessageQueue *mq) {
-    sem_wait(&Lock);
+    sem_wait(&mq->lock);
     bool return_val = false;
     if (mq->shutdown) return_val = true;
-    sem_post(&Lock);
+    sem_post(&mq->lock);
     return return_val;
 }
 
+/**
+ * Returns file descriptor that becomes readable when the client has
+ * something for the application: the eventfd in threaded (and pooled) mode, or the event
+ * engine's epoll descriptor in event mode.  Either way it can be added to
+ * the application's own epoll set and handed to mq_process_events.
+ * @param   mq      Message Queue structure.
+ */
+int mq_fd(MessageQueue *mq) {
+    return mq->mode == MQ_EVENTS && mq->engine ? engine_fd(mq->engine) : mq->notify_fd;
+}
+
+/**
+ * Process whatever is ready on mq_fd without blocking.  In threaded mode
+ * this resets the eventfd; in event mode it does the pusher and puller work.
+ * @param   mq      Message Queue structure.
+ * @return  Number of messages that can now be taken with mq_retrieve.
+ */
+int mq_process_events(MessageQueue *mq) {
+    if (mq->mode == MQ_EVENTS && mq->engine) return engine_process(mq);
+
+    uint64_t count = 0;
+    while (read(mq->notify_fd, &count, sizeof(count)) < 0 && errno == EINTR);
+    return count;
+}
+
+/**
+ * Take a snapshot of the compression counters: what the pusher sent
+ * compressed (and what that saved, see compress_ratio) and what the
+ * application inflated on retrieve (or dropped as corrupt), along with the
+ * CPU time either took.
+ * @param   mq      Message Queue structure.
+ * @param   stats   Where to store counters.
+ */
+void mq_compression_stats(MessageQueue *mq, CompressStats *stats) {
+    CompressStats *c = &mq->compression;
+    stats->compressed     = __atomic_load_n(&c->compressed, __ATOMIC_RELAXED);
+    stats->incompressible = __atomic_load_n(&c->incompressible, __ATOMIC_RELAXED);
+    stats->plain_bytes    = __atomic_load_n(&c->plain_bytes, __ATOMIC_RELAXED);
+    stats->wire_bytes     = __atomic_load_n(&c->wire_bytes, __ATOMIC_RELAXED);
+    stats->compress_usec  = __atomic_load_n(&c->compress_usec, __ATOMIC_RELAXED);
+    stats->inflated       = __atomic_load_n(&c->inflated, __ATOMIC_RELAXED);
+    stats->inflated_bytes = __atomic_load_n(&c->inflated_bytes, __ATOMIC_RELAXED);
+    stats->inflate_usec   = __atomic_load_n(&c->inflate_usec, __ATOMIC_RELAXED);
+    stats->corrupt        = __atomic_load_n(&c->corrupt, __ATOMIC_RELAXED);
+}
+
+/**
+ * Take a snapshot of the client's runtime statistics: messages and bytes
+ * published and received, failed requests, connects, the depth of the
+ * outgoing and incoming queues (now and at most), and histograms of
+ * connect time, publish round trip (from mq_publish to the server's
+ * answer), and publish to retrieve delay (for messages stamped by a
+ * client with timestamps set).
+ * @param   mq      Message Queue structure.
+ * @param   report  Where to store statistics.
+ */
+void mq_stats(MessageQueue *mq, StatsReport *report) {
+    stats_report(mq->stats, report);
+    report->depth[STATS_OUTGOING]   = queue_depth(mq->outgoing);
+    report->depth[STATS_INCOMING]   = queue_depth(mq->incoming);
+    report->dropped[STATS_OUTGOING] = __atomic_load_n(&mq->outgoing->dropped, __ATOMIC_RELAXED);
+    report->dropped[STATS_INCOMING] = __atomic_load_n(&mq->incoming->dropped, __ATOMIC_RELAXED);
+}
+
+/**
+ * Write a snapshot of the client's runtime statistics to stream as one
+ * line (see stats_dump).
+ * @param   mq      Message Queue structure.
+ * @param   stream  Stream to write to.
+ */
+void mq_stats_dump(MessageQueue *mq, FILE *stream) {
+    StatsReport report;
+    mq_stats(mq, &report);
+    stats_dump(&report, mq->name, stream);
+}
+
 /* Internal Functions */
 
 /**
- * Pusher thread takes messages from outgoing queue and sends them to server.
+ * Connect to the server, retrying until connected or shutdown.
+ * @param   mq      Message Queue structure.
+ * @param   server  Connection to open.
+ * @return  Whether or not the connection was opened (false on shutdown).
+ **/
+bool mq_connect(MessageQueue *mq, Connection *server) {
+    while (!mq_shutdown(mq)) {
+        if (mq_dial(mq, server)) return true;
+        usleep(RECONNECT_DELAY);
+    }
+    return false;
+}
+
+/**
+ * Connect to the server after shutdown, for the pusher to get the
+ * sentinel out (the puller waits for it to come back), making at most
+ * STOP_CONNECTS attempts.
+ * @param   mq      Message Queue structure.
+ * @param   server  Connection to open.
+ * @return  Whether or not the connection was opened.
+ **/
+bool mq_connect_stopping(MessageQueue *mq, Connection *server) {
+    for (int attempt = 0; attempt < STOP_CONNECTS; attempt++) {
+        if (attempt) usleep(RECONNECT_DELAY);
+        if (mq_dial(mq, server)) return true;
+    }
+    return false;
+}
+
+/**
+ * Make one attempt at connecting to the server.
+ * @param   mq      Message Queue structure.
+ * @param   server  Connection to open.
+ * @return  Whether or not the connection was opened.
+ **/
+bool mq_dial(MessageQueue *mq, Connection *server) {
+    uint64_t started = stats_now();
+    server->fd = socket_dial_timeout(mq->host, mq->port, mq->connect_timeout);
+    stats_connected(mq->stats, server->fd >= 0, server->connects > 0, stats_now() - started);
+    if (server->fd < 0) return false;
+    // Requests go out whole, so Nagle would only hold back those
+    // sent behind one still waiting for its answer
+    int on = 1;
+    setsockopt(server->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    server->connects++;
+    if (mq_upgrade(mq, server)) return true;
+    mq_disconnect(server);
+    return false;
+}
+
+/**
+ * Ask the server to switch a new connection over to binary frames (see
+ * frame.h).  A server that does not know them is asked no more, and the
+ * connection goes on carrying HTTP.
+ * @param   mq      Message Queue structure.
+ * @param   server  Connection just opened.
+ * @return  Whether or not the connection can be used.
+ **/
+bool mq_upgrade(MessageQueue *mq, Connection *server) {
+    if (!__atomic_load_n(&mq->binary, __ATOMIC_RELAXED)) return true;
+
+    char request[REQUEST_HEADER], query[OPTIONS_MAX];
+    mq_queue_options(mq, query, sizeof(query));
+    struct iovec iov = { .iov_base = request };
+    if (!(iov.iov_len = frame_upgrade(request, sizeof(request), mq->host, mq->name, query, mq->compress_threshold > 0))) return false;
+
+    Response* r = &server->response;
+    int done = -1;
+    if (socket_sendv(server->fd, &iov, 1)) {
+        while ((done = response_read(r, server->fd, mq->pool, false)) == 0);
+    }
+    if (done < 0) return false;
+    bool keep = r->keep;
+    if (r->status == 101) {
+        r->binary = true;
+    } else {
+        __atomic_store_n(&mq->binary, false, __ATOMIC_RELAXED);
+    }
+    response_next(r);
+    return r->binary || keep;
+}
+
+/**
+ * Close connection to the server (if open).
+ * @param   server  Connection to close.
+ **/
+void mq_disconnect(Connection *server) {
+    if (server->fd >= 0) close(server->fd);
+    server->fd = -1;
+    response_init(&server->response);
+    frame_topics_clear(&server->topics);
+}
+
+/**
+ * Returns host to name in request headers: keep-alive requests need one,
+ * while NULL asks for a one-shot HTTP/1.0 request.
+ * @param   mq      Message Queue structure.
+ **/
+const char * mq_host(MessageQueue *mq) {
+    return mq->keep_alive ? mq->host : NULL;
+}
+
+/**
+ * Format the query asking the server to make this client's queue with its
+ * capacity and overflow policy (empty if both are left to the server).
+ * @param   mq      Message Queue structure.
+ * @param   query   Buffer to format query into.
+ * @param   size    Size of query buffer.
+ **/
+void mq_queue_options(MessageQueue *mq, char *query, size_t size) {
+    int used = 0;
+    query[0] = 0;
+    if (mq->capacity > 0) used = snprintf(query, size, "?capacity=%d", mq->capacity);
+    if (mq->overflow && used >= 0 && (size_t)used < size) {
+        snprintf(query + used, size - used, "%coverflow=%s", used ? '&' : '?', mq->overflow);
+    }
+}
+
+/**
+ * Send request on the given connection and read back the response.  If
+ * keep-alive is enabled the connection is left open in server for the
+ * next request; a reused connection that turns out to be broken is
+ * transparently replaced and the request is sent once more.
+ * @param   mq      Message Queue structure.
+ * @param   server  Connection to use (opened if it is not already).
+ * @param   iov     Buffers making up the request (see request_iovec).
+ * @param   iovcnt  Number of buffers.
+ * @param   response    Where to store Request holding response body (NULL to discard).
+ * @return  HTTP status code of response, or -1 on failure.
+ **/
+int mq_request(MessageQueue *mq, Connection *server, struct iovec *iov, int iovcnt, Request **response) {
+    struct iovec pending[iovcnt];
+    for (int attempt = 0; attempt < 2; attempt++) {
+        bool reused = server->fd >= 0;
+        bool keep   = false;
+        int  status = -1;
+        if (!reused && !mq_connect(mq, server)) return -1;
+
+        // Sending advances the buffers, so keep the originals for a resend
+        memcpy(pending, iov, iovcnt * sizeof(struct iovec));
+        if (socket_sendv(server->fd, pending, iovcnt)) status = mq_response(mq, server, response, &keep);
+
+        if (status < 0 || !mq->keep_alive || !keep) mq_disconnect(server);
+        if (status >= 0 || !reused) return status;
+    }
+    return -1;
+}
+
+/**
+ * Read HTTP response from connection, consuming exactly its body so that
+ * the next response can be read from the same connection.  The body is
+ * read straight into a pooled Request so it can be queued without copying.
+ * @param   mq          Message Queue structure.
+ * @param   server      Connection to read from.
+ * @param   response    Where to store Request holding body (NULL to discard).
+ * @param   keep        Set to whether the server will keep the connection open.
+ * @return  HTTP status code of response, or -1 on failure.
+ **/
+int mq_response(MessageQueue *mq, Connection *server, Request **response, bool *keep) {
+    Response* r = &server->response;
+    int done;
+    // The socket blocks, so this only loops if a read is interrupted
+    while ((done = response_read(r, server->fd, mq->pool, response != NULL)) == 0);
+    if (done < 0) return -1;
+
+    *keep = r->keep;
+    if (response) {
+        *response = r->body;
+        r->body   = NULL;
+    }
+    int status = r->status;
+    response_next(r);
+    return status;
+}
+
+/**
+ * Send request for a message stream and deliver its messages to the
+ * incoming queue as they arrive, until the stream ends (or breaks).
+ * @param   mq      Message Queue structure.
+ * @param   server  Connection to use (opened if it is not already).
+ * @param   iov     Buffers making up the stream request.
+ * @param   iovcnt  Number of buffers.
+ * @return  HTTP status code of a response that ended the stream, or -1 if
+ *          it broke off.
+ **/
+int mq_stream(MessageQueue *mq, Connection *server, struct iovec *iov, int iovcnt) {
+    struct iovec pending[iovcnt];
+    Response* r = &server->response;
+    int done = -1;
+    if (server->fd < 0 && !mq_connect(mq, server)) return -1;
+
+    memcpy(pending, iov, iovcnt * sizeof(struct iovec));
+    if (socket_sendv(server->fd, pending, iovcnt)) {
+        r->stream = true;
+        while ((done = response_read(r, server->fd, mq->pool, false)) >= 0) {
+            size_t count;
+            Request* messages = response_messages(r, &count);
+            mq_deliver(mq, messages, count);
+            if (done || mq_shutdown(mq)) break;
+        }
+    }
+    int status = done > 0 ? r->status : -1;
+    // An HTTP stream holds on to its connection, so it is not reused,
+    // while a fetch that ended with a status frame leaves it ready for more
+    if (done > 0 && r->binary) response_next(r);
+    else mq_disconnect(server);
+    return status;
+}
+
+/**
+ * Put messages in incoming queue and wake the application once for all
+ * of them.  A full queue holds up the puller (and with it the server)
+ * unless its policy refuses or discards messages instead.
+ * @param   mq          Message Queue structure.
+ * @param   messages    First message (the rest follow through next).
+ * @param   count       Number of messages.
+ **/
+void mq_deliver(MessageQueue *mq, Request *messages, size_t count) {
+    size_t bytes = 0;
+    for (Request *next; messages; messages = next) {
+        next   = messages->next;
+        bytes += messages->length;
+        if (queue_offer(mq->incoming, messages)) continue;
+        bytes -= messages->length;
+        request_delete(messages);
+        count--;
+    }
+    if (count) {
+        stats_add(mq->stats, STATS_RECEIVED, count);
+        stats_add(mq->stats, STATS_RECEIVED_BYTES, bytes);
+        stats_depth(mq->stats, STATS_INCOMING, queue_depth(mq->incoming));
+    }
+    mq_wakeup(mq, count);
+}
+
+/**
+ * Count requests the server answered (or that were given up on) towards
+ * statistics: failures, and the round trip of timed publishes.
+ * @param   mq          Message Queue structure.
+ * @param   requests    Requests answered.
+ * @param   count       Number of requests.
+ * @param   status      HTTP status code of the answer (the worst, if each
+ *                      had its own), or -1 if there was none.
+ **/
+void mq_answered(MessageQueue *mq, Request **requests, size_t count, int status) {
+    if (status < 0 || status >= 400) stats_add(mq->stats, STATS_FAILED, count);
+    if (status < 0) return;
+    uint64_t now = stats_now();
+    for (size_t i = 0; i < count; i++) {
+        if (requests[i]->stamp) stats_latency(mq->stats, STATS_ROUND_TRIP, now - requests[i]->stamp);
+    }
+}
+
+/**
+ * Tell the application (through the eventfd) about new incoming messages.
+ * @param   mq          Message Queue structure.
+ * @param   count       Number of messages.
+ **/
+void mq_wakeup(MessageQueue *mq, size_t count) {
+    uint64_t value = count;
+    if (count) while (write(mq->notify_fd, &value, sizeof(value)) < 0 && errno == EINTR);
+}
+
+/**
+ * Put request in outgoing queue, within its limits (see queue_offer).  In
+ * event mode there is no pusher thread to make room, so a full queue is
+ * drained by running the engine.
+ * @param   mq      Message Queue structure.
+ * @param   r       Request to send (deleted if it is refused).
+ * @return  Whether or not the request was queued.
+ **/
+bool mq_enqueue(MessageQueue *mq, Request *r) {
+    if (!mq->engine || mq->mode != MQ_EVENTS) {
+        if (!queue_offer(mq->outgoing, r)) {
+            mq_answered(mq, &r, 1, -1);
+            request_delete(r);
+            return false;
+        }
+        // The pool thread only looks at the queue when told to
+        if (mq->engine) engine_notify(mq->engine);
+        return true;
+    }
+    while (!queue_try_offer(mq->outgoing, r)) {
+        if (mq->outgoing->limits.policy != QUEUE_BLOCK) {
+            mq_answered(mq, &r, 1, -1);
+            request_delete(r);
+            return false;
+        }
+        engine_wait(mq);
+    }
+    engine_flush(mq);
+    return true;
+}
+
+/**
+ * Returns whether or not request is a publish that can join a batch.
+ * @param   r       Request structure.
+ **/
+bool mq_batchable(Request *r) {
+    return r->body && r->method == METHOD_PUT && !strncmp(r->uri, "/topic/", 7);
+}
+
+/**
+ * Grow batch buffer so it can hold at least needed bytes.
+ * @param   batch       Batch buffer.
+ * @param   capacity    Allocated size of batch buffer.
+ * @param   needed      Bytes batch buffer must hold.
+ * @return  Whether or not the batch buffer is large enough.
+ **/
+bool mq_batch_reserve(char **batch, size_t *capacity, size_t needed) {
+    if (needed <= *capacity) return true;
+    size_t new_capacity = *capacity ? *capacity : BUFSIZ;
+    while (new_capacity < needed) new_capacity *= 2;
+    char* new_batch = realloc(*batch, new_capacity);
+    if (!new_batch) {
+        error("Unable to grow batch: %s", strerror(errno));
+        return false;
+    }
+    *batch    = new_batch;
+    *capacity = new_capacity;
+    return true;
+}
+
+/**
+ * Append the frame header for one message to batch body using the framing
+ * understood by the server's /batch route:
+ *
+ *  $TOPIC $LENGTH\n
+ *  $BODY
+ *
+ * @param   batch       Batch body buffer (grown as needed).
+ * @param   capacity    Allocated size of batch body buffer.
+ * @param   used        Bytes of batch body buffer in use.
+ * @param   topic       Topic message is published to (up to any query).
+ * @param   length      Length of message body.
+ * @return  Whether or not the frame header was appended.
+ **/
+bool mq_batch_frame(char **batch, size_t *capacity, size_t *used, const char *topic, size_t length) {
+    if (!mq_batch_reserve(batch, capacity, *used + strlen(topic) + 32)) return false;
+    *used += sprintf(*batch + *used, "%.*s %zu\n", (int)strcspn(topic, "?"), topic, length);
+    return true;
+}
+
+/**
+ * Append one whole message (frame header and body) to batch body.
+ * @param   batch       Batch body buffer (grown as needed).
+ * @param   capacity    Allocated size of batch body buffer.
+ * @param   used        Bytes of batch body buffer in use.
+ * @param   topic       Topic message is published to.
+ * @param   body        Message body.
+ * @return  Whether or not the message was appended.
+ **/
+bool mq_batch_append(char **batch, size_t *capacity, size_t *used, const char *topic, const char *body) {
+    size_t length = strlen(body);
+    if (!mq_batch_reserve(batch, capacity, *used + strlen(topic) + 32 + length)) return false;
+    if (!mq_batch_frame(batch, capacity, used, topic, length)) return false;
+    memcpy(*batch + *used, body, length);
+    *used += length;
+    return true;
+}
+
+/**
+ * Format the /batch request carrying the given messages: an HTTP header
+ * and a frame header per message go in the header and frames buffers,
+ * while the bodies are sent from the Requests themselves.
+ * @param   mq          Message Queue structure.
+ * @param   requests    Messages to send.
+ * @param   count       Number of messages (at most BATCH_MAX).
+ * @param   frames      Frame header buffer (grown as needed).
+ * @param   capacity    Allocated size of frame header buffer.
+ * @param   header      HTTP header buffer (REQUEST_HEADER bytes).
+ * @param   iov         Buffers making up the request (1 + 2 * count).
+ * @return  Number of buffers, or 0 on failure.
+ **/
+int mq_batch_iovec(MessageQueue *mq, Request **requests, size_t count, char **frames, size_t *capacity, char *header, struct iovec *iov) {
+    size_t offsets[BATCH_MAX + 1];
+    size_t used = 0, bytes = 0;
+    for (size_t i = 0; i < count; i++) {
+        offsets[i] = used;
+        if (!mq_batch_frame(frames, capacity, &used, requests[i]->uri + 7, requests[i]->length)) return 0;
+        bytes += requests[i]->length;
+    }
+    offsets[count] = used;
+
+    char uri[BUFSIZ];
+    snprintf(uri, sizeof(uri), "/batch?from=%s", mq->name);
+    Request request = { .method = METHOD_PUT, .uri = uri };
+    int iovcnt = 1;
+    iov[0].iov_base = header;
+    iov[0].iov_len  = request_header(&request, mq_host(mq), used + bytes, header, REQUEST_HEADER);
+    if (!iov[0].iov_len) return 0;
+    for (size_t i = 0; i < count; i++) {
+        iov[iovcnt].iov_base   = *frames + offsets[i];
+        iov[iovcnt++].iov_len  = offsets[i + 1] - offsets[i];
+        iov[iovcnt].iov_base   = requests[i]->body;
+        iov[iovcnt++].iov_len  = requests[i]->length;
+    }
+    return iovcnt;
+}
+
+/**
+ * Gather first message along with whatever else is waiting in the outgoing
+ * queue into a flight that is sent as a single batch.  The batch is closed
+ * once it reaches batch_count messages or batch_bytes bytes, or after
+ * batch_linger microseconds have passed since the first message.
+ * @param   mq          Message Queue structure.
+ * @param   first       First message of batch.
+ * @param   flight      Flight to gather messages into (empty).
+ * @return  Request popped that could not join the batch (NULL if none).
+ **/
+Request * mq_push_batch(MessageQueue *mq, Request *first, Flight *flight) {
+    struct timespec start, now;
+    Request** link = &flight->requests;
+    size_t bytes = 0;
+    size_t limit = mq->batch_count < BATCH_MAX ? mq->batch_count : BATCH_MAX;
+    Request* next = first;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // The sentinel goes on its own so the pusher sees it was sent
+    while (next && next != mq->sentinel && mq_batchable(next)) {
+        // An oversized message waits for the next batch unless it is alone
+        if (flight->count && bytes + next->length > mq->batch_bytes) break;
+        *link  = next;
+        link   = &next->next;
+        bytes += next->length;
+        next   = NULL;
+        if (++flight->count >= limit || bytes >= mq->batch_bytes) break;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long waited = (now.tv_sec - start.tv_sec) * 1000000 + (now.tv_nsec - start.tv_nsec) / 1000;
+        next = queue_pop_timed(mq->outgoing, mq->batch_linger - waited);
+    }
+    *link = NULL;
+    return next;
+}
+
+/**
+ * List the requests making up a flight.
+ * @param   flight      Flight structure.
+ * @param   requests    Set to its requests (at most BATCH_MAX).
+ * @return  Number of requests.
+ **/
+size_t mq_flight_requests(Flight *flight, Request **requests) {
+    size_t count = 0;
+    for (Request *r = flight->requests; r && count < BATCH_MAX; r = r->next) requests[count++] = r;
+    return count;
+}
+
+/**
+ * Send a flight without waiting for its answers: as binary frames if the
+ * connection speaks them, or else as one HTTP request (a /batch for more
+ * than one message).  It is formatted afresh each time it is sent, since
+ * topic IDs belong to the connection.  A flight that cannot be formatted
+ * (or connected during shutdown) is given up, and is owed no answers; the
+ * sentinel still gets a few attempts then, since the puller waits for it.
+ * @param   mq          Message Queue structure.
+ * @param   server      Connection to use (opened if it is not already).
+ * @param   flight      Flight to send.
+ * @param   frames      Frame buffer (grown as needed).
+ * @param   capacity    Allocated size of frame buffer.
+ * @return  Whether or not the connection is still good (false if it broke).
+ **/
+bool mq_flight_send(MessageQueue *mq, Connection *server, Flight *flight, char **frames, size_t *capacity) {
+    Request* requests[BATCH_MAX];
+    struct iovec iov[1 + 2 * BATCH_MAX];
+    char header[REQUEST_HEADER];
+    size_t count = mq_flight_requests(flight, requests);
+    int iovcnt = 0;
+
+    flight->sends++;
+    flight->replies = 0;
+    flight->status  = -1;
+    if (server->fd < 0) {
+        bool sentinel = flight->requests == mq->sentinel;
+        if (!(sentinel ? mq_connect_stopping(mq, server) : mq_connect(mq, server))) return true;
+    }
+    if (server->response.binary) {
+        iovcnt = mq_frames_iovec(mq, server, requests, count, frames, capacity, iov, &flight->replies);
+    } else {
+        iovcnt = count > 1 ? mq_batch_iovec(mq, requests, count, frames, capacity, header, iov)
+                           : request_iovec(requests[0], mq_host(mq), header, sizeof(header), iov);
+        flight->replies = 1;
+    }
+    if (!iovcnt) {
+        flight->replies = 0;
+        return true;
+    }
+    flight->status = 0;
+    return socket_sendv(server->fd, iov, iovcnt);
+}
+
+/**
+ * Read the next answer and put it towards the oldest flight still owed
+ * one (answers come back in the order requests went out), then retire the
+ * flights that have all of theirs.
+ * @param   mq          Message Queue structure.
+ * @param   server      Connection flights were sent on.
+ * @param   window      Flights in flight.
+ * @return  Whether or not the connection is still good (false if it broke
+ *          or the server is closing it).
+ **/
+bool mq_window_answer(MessageQueue *mq, Connection *server, Window *window) {
+    Response* r = &server->response;
+    Flight* flight = NULL;
+    for (size_t i = 0; i < window->count && !flight; i++) {
+        Flight* f = &window->flights[(window->head + i) % window->size];
+        if (f->replies) flight = f;
+    }
+    if (!flight) {
+        mq_window_retire(mq, window);
+        return true;
+    }
+
+    int done;
+    // The socket blocks, so this only loops if a read is interrupted
+    while ((done = response_read(r, server->fd, mq->pool, false)) == 0);
+    if (done < 0) return false;
+    if (r->status > flight->status) flight->status = r->status;
+    flight->replies--;
+    bool open = r->binary || (mq->keep_alive && r->keep);
+    response_next(r);
+    mq_window_retire(mq, window);
+    return open;
+}
+
+/**
+ * Retire the oldest flights for as long as they are owed no more answers,
+ * counting them towards statistics.
+ * @param   mq          Message Queue structure.
+ * @param   window      Flights in flight.
+ **/
+void mq_window_retire(MessageQueue *mq, Window *window) {
+    while (window->count && !window->flights[window->head].replies) {
+        Flight* flight = &window->flights[window->head];
+        Request* requests[BATCH_MAX];
+        size_t count = mq_flight_requests(flight, requests);
+        mq_answered(mq, requests, count, flight->status);
+        for (size_t i = 0; i < count; i++) request_delete(requests[i]);
+        window->head = (window->head + 1) % window->size;
+        window->count--;
+    }
+}
+
+/**
+ * Replace a connection that broke (or that the server closed) while
+ * requests were in flight on it, and send those that were not answered
+ * again, in order, on a fresh one.  The server may have handled some of
+ * them already, so they can arrive twice; a flight already sent PUSH_SENDS
+ * times is given up instead.
+ * @param   mq          Message Queue structure.
+ * @param   server      Connection to replace.
+ * @param   window      Flights in flight.
+ * @param   frames      Frame buffer (grown as needed).
+ * @param   capacity    Allocated size of frame buffer.
+ **/
+void mq_window_resend(MessageQueue *mq, Connection *server, Window *window, char **frames, size_t *capacity) {
+    bool sent = false;
+    while (!sent) {
+        mq_disconnect(server);
+        sent = true;
+        for (size_t i = 0; i < window->count && sent; i++) {
+            Flight* flight = &window->flights[(window->head + i) % window->size];
+            if (!flight->replies) continue;
+            if (flight->sends >= PUSH_SENDS) {
+                flight->replies = 0;
+                flight->status  = -1;
+                continue;
+            }
+            sent = mq_flight_send(mq, server, flight, frames, capacity);
+        }
+        mq_window_retire(mq, window);
+    }
+}
+
+/**
+ * Format requests as binary frames: a frame header (preceded by an
+ * OP_TOPIC frame the first time a topic is used on the connection) goes in
+ * the frames buffer, while publish bodies are sent from the Requests
+ * themselves.  A /batch request is unpacked into a publish per message.
+ *
+ * If the server agreed to compression, a body of at least
+ * compress_threshold bytes is compressed into the frames buffer instead,
+ * while several requests that add up to that much go out together as one
+ * compressed OP_BATCH frame.
+ * @param   mq          Message Queue structure.
+ * @param   server      Connection requests will be sent on.
+ * @param   requests    Requests to format.
+ * @param   count       Number of requests (at most BATCH_MAX).
+ * @param   frames      Frame buffer (grown as needed).
+ * @param   capacity    Allocated size of frame buffer.
+ * @param   iov         Buffers making up the frames (2 * count).
+ * @param   replies     Set to number of status frames that will answer.
+ * @return  Number of buffers, or 0 on failure.
+ **/
+int mq_frames_iovec(MessageQueue *mq, Connection *server, Request **requests, size_t count, char **frames, size_t *capacity, struct iovec *iov, size_t *replies) {
+    size_t offsets[BATCH_MAX + 1];
+    bool packed[BATCH_MAX] = { false };
+    size_t used = 0, total = 0;
+    size_t threshold = server->response.compression ? mq->compress_threshold : 0;
+    for (size_t i = 0; i < count; i++) total += requests[i]->length;
+    // Messages compress better together than apart
+    bool batch = threshold && count > 1 && total >= threshold;
+    *replies = 0;
+    for (size_t i = 0; i < count; i++) {
+        Request* r = requests[i];
+        offsets[i] = used;
+        if (!strncmp(r->uri, "/topic/", 7)) {
+            // The publisher is the connection's own queue, so the query is left off
+            if (!mq_frame_append(server, frames, capacity, &used, OP_PUBLISH, r->uri + 7, strcspn(r->uri + 7, "?"), r->length)) return 0;
+            if (threshold && !batch && r->length >= threshold) {
+                packed[i] = mq_frame_compress(mq, frames, capacity, &used, r->body, r->length);
+            }
+            (*replies)++;
+        } else if (!strncmp(r->uri, "/subscription/", 14) && strchr(r->uri + 14, '/')) {
+            // Only the topic is sent, since the queue is the connection's own,
+            // along with any subscription options (the query, as a payload)
+            const char* topic   = strchr(r->uri + 14, '/') + 1;
+            size_t      length  = strcspn(topic, "?");
+            const char* options = topic[length] ? topic + length + 1 : "";
+            size_t      size    = r->method == METHOD_DELETE ? 0 : strlen(options);
+            Opcode opcode = r->method == METHOD_DELETE ? OP_UNSUBSCRIBE : OP_SUBSCRIBE;
+            if (!mq_frame_append(server, frames, capacity, &used, opcode, topic, length, size) ||
+                !mq_batch_reserve(frames, capacity, used + size)) return 0;
+            memcpy(*frames + used, options, size);
+            used += size;
+            (*replies)++;
+        } else if (!strncmp(r->uri, "/batch", 6) && (!r->uri[6] || r->uri[6] == '?') && r->body) {
+            // Each message in the batch is framed as "$TOPIC $LENGTH\n$BODY"
+            // (the query naming the publisher is left off, as for a publish)
+            for (char *frame = r->body, *end = r->body + r->length; frame < end;) {
+                char* space = memchr(frame, ' ', end - frame);
+                char* body  = space ? memchr(space, '\n', end - space) : NULL;
+                if (!body++) return 0;
+                size_t length = strtoul(space + 1, NULL, 10);
+                if (length > (size_t)(end - body)) return 0;
+                if (!mq_frame_append(server, frames, capacity, &used, OP_PUBLISH, frame, space - frame, length) ||
+                    !mq_batch_reserve(frames, capacity, used + length)) return 0;
+                memcpy(*frames + used, body, length);
+                used  += length;
+                frame  = body + length;
+                (*replies)++;
+            }
+        }
+    }
+    offsets[count] = used;
+
+    int iovcnt = batch ? mq_frames_batch(mq, requests, count, offsets, frames, capacity, iov) : 0;
+    if (iovcnt) return iovcnt;
+    for (size_t i = 0; i < count; i++) {
+        if (offsets[i + 1] > offsets[i]) {
+            iov[iovcnt].iov_base   = *frames + offsets[i];
+            iov[iovcnt++].iov_len  = offsets[i + 1] - offsets[i];
+        }
+        if (!strncmp(requests[i]->uri, "/topic/", 7) && requests[i]->length && !packed[i]) {
+            iov[iovcnt].iov_base   = requests[i]->body;
+            iov[iovcnt++].iov_len  = requests[i]->length;
+        }
+    }
+    return iovcnt;
+}
+
+/**
+ * Compress frames formatted by mq_frames_iovec (along with the publish
+ * bodies that go between them) into one OP_BATCH frame, which the server
+ * unpacks and handles frame by frame.
+ * @param   mq          Message Queue structure.
+ * @param   requests    Requests that were formatted.
+ * @param   count       Number of requests.
+ * @param   offsets     Where the frames of each request start in frames
+ *                      buffer (count + 1, the last being where they end).
+ * @param   frames      Frame buffer (grown as needed).
+ * @param   capacity    Allocated size of frame buffer.
+ * @param   iov         Set to the one buffer making up the batch frame.
+ * @return  Number of buffers, or 0 if the frames should go out as they are.
+ **/
+int mq_frames_batch(MessageQueue *mq, Request **requests, size_t count, const size_t *offsets, char **frames, size_t *capacity, struct iovec *iov) {
+    size_t length = offsets[count];
+    for (size_t i = 0; i < count; i++) {
+        if (!strncmp(requests[i]->uri, "/topic/", 7)) length += requests[i]->length;
+    }
+    // Frames are laid out flat after the ones already formatted, then compressed after that
+    size_t flat  = offsets[count];
+    size_t bound = compress_bound(length);
+    if (!mq_batch_reserve(frames, capacity, flat + length + FRAME_HEADER + bound)) return 0;
+    char* cursor = *frames + flat;
+    for (size_t i = 0; i < count; i++) {
+        memcpy(cursor, *frames + offsets[i], offsets[i + 1] - offsets[i]);
+        cursor += offsets[i + 1] - offsets[i];
+        if (!strncmp(requests[i]->uri, "/topic/", 7)) {
+            memcpy(cursor, requests[i]->body, requests[i]->length);
+            cursor += requests[i]->length;
+        }
+    }
+
+    char*  header = *frames + flat + length;
+    size_t packed = compress_data(*frames + flat, length, header + FRAME_HEADER, bound, &mq->compression);
+    if (!packed) return 0;
+    frame_header(header, OP_BATCH | FRAME_COMPRESSED, 0, packed);
+    iov[0].iov_base = header;
+    iov[0].iov_len  = FRAME_HEADER + packed;
+    return 1;
+}
+
+/**
+ * Append the header of a frame naming a topic to frames buffer, along with
+ * the OP_TOPIC frame handing out the topic's ID if it is new.
+ * @param   server      Connection frame will be sent on.
+ * @param   frames      Frame buffer (grown as needed).
+ * @param   capacity    Allocated size of frame buffer.
+ * @param   used        Bytes of frame buffer in use.
+ * @param   opcode      Frame opcode.
+ * @param   topic       Topic name (need not be NUL terminated).
+ * @param   topic_length    Length of topic name.
+ * @param   length      Length of payload that will follow the header.
+ * @return  Whether or not the header was appended.
+ **/
+bool mq_frame_append(Connection *server, char **frames, size_t *capacity, size_t *used, Opcode opcode, const char *topic, size_t topic_length, size_t length) {
+    bool fresh;
+    uint32_t id = frame_topic(&server->topics, topic, topic_length, &fresh);
+    if (!id || !mq_batch_reserve(frames, capacity, *used + 2 * FRAME_HEADER + topic_length)) return false;
+    if (fresh) {
+        frame_header(*frames + *used, OP_TOPIC, id, topic_length);
+        memcpy(*frames + *used + FRAME_HEADER, topic, topic_length);
+        *used += FRAME_HEADER + topic_length;
+    }
+    frame_header(*frames + *used, opcode, id, length);
+    *used += FRAME_HEADER;
+    return true;
+}
+
+/**
+ * Compress publish body into frames buffer right after its frame header,
+ * which is rewritten to carry FRAME_COMPRESSED and the compressed length.
+ * @param   mq          Message Queue structure.
+ * @param   frames      Frame buffer (grown as needed).
+ * @param   capacity    Allocated size of frame buffer.
+ * @param   used        Bytes of frame buffer in use (ending with the header).
+ * @param   data        Body to compress.
+ * @param   length      Length of body.
+ * @return  Whether or not the body was compressed (if not, it must be
+ *          sent as it is).
+ **/
+bool mq_frame_compress(MessageQueue *mq, char **frames, size_t *capacity, size_t *used, const char *data, size_t length) {
+    size_t bound = compress_bound(length), packed;
+    if (!mq_batch_reserve(frames, capacity, *used + bound)) return false;
+    if (!(packed = compress_data(data, length, *frames + *used, bound, &mq->compression))) return false;
+
+    char*    header = *frames + *used - FRAME_HEADER;
+    Opcode   opcode;
+    uint32_t id;
+    frame_parse(header, &opcode, &id, &length);
+    frame_header(header, opcode | FRAME_COMPRESSED, id, packed);
+    *used += packed;
+    return true;
+}
+
+/**
+ * Pusher thread takes messages from outgoing queue and sends them to server,
+ * keeping up to window requests in flight on its connection rather than
+ * waiting out a round trip for each answer.  Answers come back in order,
+ * so each is matched with the oldest request still owed one.
  **/
 void * mq_pusher(void *arg) {
     MessageQueue* mq = (MessageQueue*)arg;
-    FILE* server;
-    char buffer[BUFSIZ];
-    Request* message; 
-    while (!mq_shutdown(mq)) {
-        if (!(server = socket_connect(mq->host, mq->port))) continue;
-        message = queue_pop(mq->outgoing);
-        request_write(message, server);
-        // Read response from server (can disregard for pusher)
-        while (fgets(buffer, BUFSIZ, server));
-        request_delete(message);
-        fclose(server);
+    Connection server = { .fd = -1 };
+    Window window = { .size = mq->window ? mq->window : 1 };
+    Flight single;
+    Request* message = NULL;
+    char* frames = NULL;
+    size_t capacity = 0;
+    bool stopped = false;
+    if (!(window.flights = calloc(window.size, sizeof(Flight)))) {
+        window.flights = &single;
+        window.size    = 1;
+    }
+    // Run until the sentinel is out and answered, since the puller waits for it to come back
+    while (!stopped || window.count) {
+        // A connection the server closes after each answer cannot carry more than one
+        size_t limit = mq->keep_alive || server.response.binary ? window.size : 1;
+        if (!stopped && window.count < limit && !message) {
+            message = window.count ? queue_try_pop(mq->outgoing) : queue_pop(mq->outgoing);
+            if (message) stats_depth(mq->stats, STATS_OUTGOING, queue_depth(mq->outgoing) + 1);
+        }
+        if (!message || window.count >= limit) {
+            // Nothing more can go out until the oldest request is answered
+            if (!mq_window_answer(mq, &server, &window)) mq_window_resend(mq, &server, &window, &frames, &capacity);
+            continue;
+        }
+
+        Flight* flight = &window.flights[(window.head + window.count++) % window.size];
+        memset(flight, 0, sizeof(Flight));
+        if (message != mq->sentinel && mq->batch_count > 1 && mq_batchable(message)) {
+            message = mq_push_batch(mq, message, flight);
+        } else {
+            stopped          = message == mq->sentinel;
+            flight->requests = message;
+            flight->count    = 1;
+            message->next    = NULL;
+            message          = NULL;
+        }
+        if (!mq_flight_send(mq, &server, flight, &frames, &capacity)) mq_window_resend(mq, &server, &window, &frames, &capacity);
+        mq_window_retire(mq, &window);
     }
+    mq_disconnect(&server);
+    if (window.flights != &single) free(window.flights);
+    free(frames);
     return NULL;
 }
 
 /**
- * Puller thread requests new messages from server and then puts them in
- * incoming queue.
+ * Puller thread receives messages from server and then puts them in
+ * incoming queue.  It asks for a stream of messages, falling back to
+ * requesting one message at a time if the server does not stream.
  **/
 void * mq_puller(void *arg) {
     MessageQueue* mq = (MessageQueue*)arg;
-    FILE* server;
-    Request* new_request;
+    Connection server = { .fd = -1 };
+    Request* get_request, *stream_request, *message;
     char uri[BUFSIZ];
-    sprintf(uri, "/queue/%s", mq->name);
-    char buffer[BUFSIZ];
-    size_t content_length;
-    char* body;
+    char header[REQUEST_HEADER], stream_header[REQUEST_HEADER];
+    struct iovec iov[2], stream_iov[2];
+    int iovcnt, stream_iovcnt;
+    bool streaming = mq->streaming;
+    // A fetch with no limit makes a binary connection stream messages
+    char fetch[FRAME_HEADER];
+    struct iovec fetch_iov = { .iov_base = fetch, .iov_len = FRAME_HEADER };
+    frame_header(fetch, OP_FETCH, 0, 0);
+    // The same GETs go out every time, so format them once
+    sprintf(uri, "/queue/%s?timeout=%d", mq->name, POLL_TIMEOUT);
+    if (!(get_request = request_create(mq->pool, METHOD_GET, uri, NULL))) return NULL;
+    char query[OPTIONS_MAX];
+    mq_queue_options(mq, query, sizeof(query));
+    snprintf(uri, sizeof(uri), "/stream/%s%s", mq->name, query);
+    if (!(stream_request = request_create(mq->pool, METHOD_GET, uri, NULL))) {
+        request_delete(get_request);
+        return NULL;
+    }
+    if (!(iovcnt = request_iovec(get_request, mq_host(mq), header, sizeof(header), iov)) ||
+        !(stream_iovcnt = request_iovec(stream_request, mq_host(mq), stream_header, sizeof(stream_header), stream_iov))) {
+        request_delete(get_request);
+        request_delete(stream_request);
+        return NULL;
+    }
     
     while (!mq_shutdown(mq)) {
-        if (!(server = socket_connect(mq->host, mq->port))) continue;
-        if (!(new_request = request_create("GET", uri, NULL))) continue;
-        // If we are able to connect to server and create request, then send it
-        request_write(new_request, server);
-        if (fgets(buffer, BUFSIZ, server) && strstr(buffer, "200 OK")) {
-            while (fgets(buffer, BUFSIZ, server) && !streq(buffer, "\r\n")) {
-                sscanf(buffer, "Content-Length: %ld", &content_length);
-            }
-            if (!(body = calloc(content_length + 1, sizeof(char)))) request_delete(new_request);
-            else {
-                new_request->body = body;
-                fread(new_request->body, 1, content_length, server);
-                queue_push(mq->incoming, new_request);
-                write(mq->p[1], "incoming message", 17);
-            } 
-        // If we don't get a 200 status code, then delete the request
-        } else request_delete(new_request);
-        fclose(server);
+        if (server.fd < 0 && !mq_connect(mq, &server)) break;
+        if (server.response.binary) {
+            mq_stream(mq, &server, &fetch_iov, 1);
+            continue;
+        }
+        if (streaming) {
+            // A server that cannot stream answers with an error instead
+            int status = mq_stream(mq, &server, stream_iov, stream_iovcnt);
+            if (status >= 0 && status != 200) streaming = false;
+            continue;
+        }
+        message = NULL;
+        // If we get a 200 status code, hand the body to the application
+        if (mq_request(mq, &server, iov, iovcnt, &message) == 200 && message) {
+            message->next = NULL;
+            mq_deliver(mq, message, 1);
+        } else if (message) {
+            request_delete(message);
+        }
+    }
+    request_delete(get_request);
+    request_delete(stream_request);
+    mq_disconnect(&server);
+    return NULL;
+}
+
+/**
+ * Dumper thread writes statistics to stats_file every stats_interval
+ * milliseconds until mq_stop posts dumping.
+ **/
+void * mq_dumper(void *arg) {
+    MessageQueue* mq = (MessageQueue*)arg;
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    for (;;) {
+        deadline.tv_sec  += mq->stats_interval / 1000;
+        deadline.tv_nsec += (mq->stats_interval % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        int waited;
+        while ((waited = sem_timedwait(&mq->dumping, &deadline)) < 0 && errno == EINTR);
+        if (waited == 0) break;
+        mq_stats_dump(mq, mq->stats_file);
+    }
+    return NULL;
+}
+
+/**
+ * Hand a request taken from the incoming queue to the application.
+ * @param   mq      Message Queue structure.
+ * @param   r       Request taken (NULL if there was none).
+ * @param   dropped Set to whether it was dropped because it would not
+ *                  inflate (counted in mq->compression).
+ * @return  Message body, or NULL if there was none, it was the sentinel,
+ *          or it was dropped.
+ **/
+char * mq_take(MessageQueue *mq, Request *r, bool *dropped) {
+    *dropped = false;
+    if (!r) return NULL;
+    // Taking a message may make room for ones the pool thread is holding
+    if (mq->mode == MQ_POOLED && mq->engine && engine_stalled(mq->engine)) engine_notify(mq->engine);
+    // Bodies stay compressed until the application takes them
+    if (r->compressed && !(r = compress_inflate(mq->pool, r, &mq->compression))) {
+        *dropped = true;
+        return NULL;
     }
+    stats_unstamp(mq->stats, r);
+    if (!streq(r->body, SENTINEL)) return r->body;
+    // If it is the sentinel then just free it and don't send it to app
+    request_delete(r);
     return NULL;
 }
 
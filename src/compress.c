@@ -0,0 +1,120 @@
+/* compress.c: Message body compression */
+
+#include "mq/compress.h"
+#include "mq/logging.h"
+
+#include <arpa/inet.h>
+#include <time.h>
+#include <zlib.h>
+
+/* Internal Constants */
+
+#define COMPRESS_LEVEL  Z_BEST_SPEED    /* Messages are compressed on the hot path */
+
+/* Internal Prototypes */
+
+uint64_t compress_cpu_usec();
+
+/* External Functions */
+
+/**
+ * Returns the most bytes compress_data may need for length bytes.
+ * @param   length      Length of data to compress.
+ */
+size_t compress_bound(size_t length) {
+    return COMPRESS_PREFIX + compressBound(length);
+}
+
+/**
+ * Compress data into buffer as its inflated length (32 bits, in network
+ * order) followed by a zlib stream, unless that would not be smaller.
+ * @param   data        Data to compress.
+ * @param   length      Length of data.
+ * @param   buffer      Buffer to compress into (compress_bound bytes).
+ * @param   size        Size of buffer.
+ * @param   stats       Counters to update (atomically).
+ * @return  Length of compressed data, or 0 if it was sent as it is.
+ */
+size_t compress_data(const char *data, size_t length, char *buffer, size_t size, CompressStats *stats) {
+    uint64_t started = compress_cpu_usec();
+    uLongf   packed  = size - COMPRESS_PREFIX;
+    uint32_t prefix  = htonl((uint32_t)length);
+    int      status  = compress2((Bytef *)buffer + COMPRESS_PREFIX, &packed, (const Bytef *)data, length, COMPRESS_LEVEL);
+    __atomic_add_fetch(&stats->compress_usec, compress_cpu_usec() - started, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->plain_bytes, length, __ATOMIC_RELAXED);
+
+    if (status != Z_OK || COMPRESS_PREFIX + packed >= length) {
+        __atomic_add_fetch(&stats->incompressible, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&stats->wire_bytes, length, __ATOMIC_RELAXED);
+        return 0;
+    }
+    memcpy(buffer, &prefix, COMPRESS_PREFIX);
+    __atomic_add_fetch(&stats->compressed, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->wire_bytes, COMPRESS_PREFIX + packed, __ATOMIC_RELAXED);
+    return COMPRESS_PREFIX + packed;
+}
+
+/**
+ * Inflate body of a Request that arrived compressed (see compress_data)
+ * into a new one, deleting the compressed one.  Bodies that would inflate
+ * to more than COMPRESS_MAX bytes are refused.
+ * @param   pool        Pool to take new Request from.
+ * @param   r           Request holding compressed body.
+ * @param   stats       Counters to update (atomically).
+ * @return  Request holding inflated body, or NULL if it was corrupt.
+ */
+Request * compress_inflate(RequestPool *pool, Request *r, CompressStats *stats) {
+    uint64_t started = compress_cpu_usec();
+    uint32_t prefix;
+    Request *plain = NULL;
+
+    if (r->length >= COMPRESS_PREFIX) {
+        memcpy(&prefix, r->body, COMPRESS_PREFIX);
+        uLongf length = ntohl(prefix);
+        // The prefix comes from the sender, so it is not trusted with memory
+        if (length > COMPRESS_MAX) {
+            error("Refusing to inflate message to %lu bytes", (unsigned long)length);
+        } else if ((plain = request_reserve(pool, r->method, NULL, length))) {
+            if (uncompress((Bytef *)plain->body, &length, (const Bytef *)r->body + COMPRESS_PREFIX, r->length - COMPRESS_PREFIX) != Z_OK ||
+                length != plain->length) {
+                error("Unable to inflate message of %zu bytes", r->length);
+                request_delete(plain);
+                plain = NULL;
+            }
+        }
+    }
+    request_delete(r);
+    if (!plain) {
+        __atomic_add_fetch(&stats->corrupt, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    __atomic_add_fetch(&stats->inflate_usec, compress_cpu_usec() - started, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->inflated, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->inflated_bytes, plain->length, __ATOMIC_RELAXED);
+    return plain;
+}
+
+/**
+ * Returns how many times fewer bytes went over the wire than were handed
+ * to deflate (0 if nothing has been yet).
+ * @param   stats       Counters.
+ */
+double compress_ratio(const CompressStats *stats) {
+    uint64_t wire  = __atomic_load_n(&stats->wire_bytes, __ATOMIC_RELAXED);
+    uint64_t plain = __atomic_load_n(&stats->plain_bytes, __ATOMIC_RELAXED);
+    return wire ? (double)plain / wire : 0;
+}
+
+/* Internal Functions */
+
+/**
+ * Returns CPU time used by calling thread in microseconds.
+ */
+uint64_t compress_cpu_usec() {
+    struct timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,650 @@
+/* engine.c: Single-threaded event engine for Message Queue client */
+
+#include "mq/engine.h"
+#include "mq/logging.h"
+#include "mq/response.h"
+#include "mq/socket.h"
+#include "mq/string.h"
+
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Internal Constants */
+
+#define ENGINE_EVENTS   8       /* Most events taken per epoll_wait */
+#define ENGINE_IOV      (1 + 2 * BATCH_MAX)
+
+/* Internal Structures */
+
+/* One non-blocking connection carrying one request at a time */
+typedef struct Link Link;
+struct Link {
+    int         fd;             // Socket (-1 if not connected)
+    bool        connecting;     // Whether connect is still under way
+    bool        busy;           // Whether a request is being sent or answered
+    bool        reused;         // Whether request went out on a used connection
+    bool        waiting;        // Whether link is idle until reconnect timer fires
+    size_t      attempt;        // Failed connects in a row (picks next address)
+    bool        opened;         // Whether link connected before (so the next is a reconnect)
+    uint64_t    started;        // When connect began (microseconds)
+    uint64_t    deadline;       // When connect times out or backoff ends
+    bool        keep_body;      // Whether response bodies are kept
+    Response    response;       // Response being parsed
+
+    Request *   requests[BATCH_MAX];    // Requests being sent (freed once answered)
+    size_t      count;
+    struct iovec request[ENGINE_IOV];   // Whole request (kept for a resend)
+    int         iovcnt;
+    struct iovec pending[ENGINE_IOV];   // What is left of it to write
+    struct iovec *next;
+    int         left;
+
+    char        header[REQUEST_HEADER];
+    char *      frames;         // Batch frame headers
+    size_t      capacity;
+};
+
+struct Engine {
+    MessageQueue *mq;
+    int         epoll_fd;       // Handed to the application as mq_fd
+    int         timer_fd;       // Connect timeouts and reconnect backoff
+    int         wake_fd;        // Written by other threads to wake the engine
+    bool        notified;       // Whether wake_fd was written since last read
+    bool        stalled;        // Whether messages wait for room in incoming queue
+    Link        pusher;         // Sends requests from outgoing queue
+    Link        puller;         // Streams (or long polls for) incoming messages
+    Request *   get;            // Puller's GET request for one message
+    Request *   stream;         // Puller's GET request for a message stream
+    bool        streaming;      // Whether puller asks for a stream
+    Request *   leftover;       // Request popped that could not join a batch
+    Request *   held;           // Messages waiting for room in incoming queue
+    Request *   held_last;
+    int         delivered;      // Messages delivered since last engine_process
+};
+
+/* Internal Prototypes */
+
+void    engine_run(Engine *e, int timeout);
+void    engine_woken(Engine *e);
+bool    engine_pull(Engine *e);
+bool    engine_next(Engine *e, Link *link);
+void    engine_kick(Engine *e, Link *link);
+void    engine_begin(Engine *e, Link *link);
+void    engine_send(Engine *e, Link *link);
+void    engine_event(Engine *e, Link *link);
+void    engine_finish(Engine *e, Link *link);
+void    engine_fail(Engine *e, Link *link);
+void    engine_close(Engine *e, Link *link);
+void    engine_watch(Engine *e, Link *link, int op, uint32_t events);
+void    engine_unreachable(Engine *e, Link *link);
+void    engine_retry(Engine *e, Link *link);
+void    engine_arm(Engine *e);
+void    engine_wake(Engine *e);
+void    engine_hold(Engine *e, Request *messages);
+bool    engine_deliver(Engine *e);
+void    engine_resume(Engine *e);
+void    engine_drop(Link *link);
+
+/* External Functions */
+
+/**
+ * Create event engine that does the work of the pusher and puller threads
+ * on non-blocking sockets, driven entirely by engine_process.
+ * @param   mq      Message Queue structure.
+ * @return  Newly allocated Engine structure (NULL on failure).
+ */
+Engine * engine_create(MessageQueue *mq) {
+    Engine *e = calloc(1, sizeof(Engine));
+    if (!e) return NULL;
+    e->mq          = mq;
+    e->pusher.fd   = -1;
+    e->puller.fd   = -1;
+    e->puller.keep_body = true;
+    response_init(&e->pusher.response);
+    response_init(&e->puller.response);
+
+    e->epoll_fd = e->timer_fd = e->wake_fd = -1;
+    if ((e->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+        (e->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0 ||
+        (e->wake_fd  = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        error("Unable to create engine: %s", strerror(errno));
+        if (e->epoll_fd >= 0) close(e->epoll_fd);
+        if (e->timer_fd >= 0) close(e->timer_fd);
+        free(e);
+        return NULL;
+    }
+    struct epoll_event timer = { .events = EPOLLIN, .data.ptr = e };
+    struct epoll_event wake  = { .events = EPOLLIN, .data.ptr = &e->wake_fd };
+    epoll_ctl(e->epoll_fd, EPOLL_CTL_ADD, e->timer_fd, &timer);
+    epoll_ctl(e->epoll_fd, EPOLL_CTL_ADD, e->wake_fd, &wake);
+
+    // The same GET goes out every time, so format it once
+    char uri[BUFSIZ];
+    snprintf(uri, BUFSIZ, "/queue/%s?timeout=%d", mq->name, POLL_TIMEOUT);
+    e->get = request_create(mq->pool, METHOD_GET, uri, NULL);
+    char query[OPTIONS_MAX];
+    mq_queue_options(mq, query, sizeof(query));
+    snprintf(uri, BUFSIZ, "/stream/%s%s", mq->name, query);
+    e->stream    = request_create(mq->pool, METHOD_GET, uri, NULL);
+    e->streaming = mq->streaming;
+    if (!e->get || !e->stream || !engine_pull(e)) {
+        engine_delete(e);
+        return NULL;
+    }
+
+    engine_kick(e, &e->pusher);
+    engine_kick(e, &e->puller);
+    return e;
+}
+
+/**
+ * Delete Engine structure (closing its connections).
+ * @param   e       Engine structure.
+ */
+void engine_delete(Engine *e) {
+    engine_close(e, &e->pusher);
+    engine_close(e, &e->puller);
+    engine_drop(&e->pusher);
+    response_init(&e->pusher.response);
+    response_init(&e->puller.response);
+    if (e->get)      request_delete(e->get);
+    if (e->stream)   request_delete(e->stream);
+    if (e->leftover) request_delete(e->leftover);
+    for (Request *next; e->held; e->held = next) {
+        next = e->held->next;
+        request_delete(e->held);
+    }
+    free(e->pusher.frames);
+    close(e->wake_fd);
+    close(e->timer_fd);
+    close(e->epoll_fd);
+    free(e);
+}
+
+/**
+ * Returns file descriptor that becomes readable whenever the engine has
+ * work to do (it can be added to the application's own epoll set).
+ * @param   e       Engine structure.
+ */
+int engine_fd(Engine *e) {
+    return e->epoll_fd;
+}
+
+/**
+ * Do all of the socket work that is ready without blocking: send queued
+ * requests, read responses, and move received messages to the incoming
+ * queue.
+ * @param   mq      Message Queue structure.
+ * @return  Number of messages delivered to incoming queue (including any
+ *          delivered by engine_wait since the last call).
+ */
+int engine_process(MessageQueue *mq) {
+    Engine *e = mq->engine;
+    engine_run(e, 0);
+    int delivered = e->delivered;
+    e->delivered  = 0;
+    return delivered;
+}
+
+/**
+ * Block until there is socket work to do, and then do it (used to make
+ * room in a full outgoing queue).
+ * @param   mq      Message Queue structure.
+ */
+void engine_wait(MessageQueue *mq) {
+    engine_run(mq->engine, -1);
+}
+
+/**
+ * Wake engine from another thread (so the thread running it looks at the
+ * outgoing and incoming queues again).  Repeated calls before the engine
+ * wakes up cost nothing.
+ * @param   e       Engine structure.
+ */
+void engine_notify(Engine *e) {
+    if (!__atomic_exchange_n(&e->notified, true, __ATOMIC_SEQ_CST)) eventfd_write(e->wake_fd, 1);
+}
+
+/**
+ * Returns whether received messages are waiting for room in the incoming
+ * queue (in which case taking one should be followed by engine_notify).
+ * @param   e       Engine structure.
+ */
+bool engine_stalled(Engine *e) {
+    return __atomic_load_n(&e->stalled, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Start sending whatever was just put in the outgoing queue (if the
+ * pusher is idle).
+ * @param   mq      Message Queue structure.
+ */
+void engine_flush(MessageQueue *mq) {
+    engine_kick(mq->engine, &mq->engine->pusher);
+}
+
+/* Internal Functions */
+
+/**
+ * Handle events until there are none left.
+ * @param   e       Engine structure.
+ * @param   timeout Milliseconds to wait for the first event (-1 forever).
+ */
+void engine_run(Engine *e, int timeout) {
+    struct epoll_event events[ENGINE_EVENTS];
+    int n;
+
+    if (e->held && engine_deliver(e)) engine_resume(e);
+    engine_kick(e, &e->pusher);
+    do {
+        if ((n = epoll_wait(e->epoll_fd, events, ENGINE_EVENTS, timeout)) < 0 && errno != EINTR) {
+            error("Unable to wait for events: %s", strerror(errno));
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == e) engine_wake(e);
+            else if (events[i].data.ptr == &e->wake_fd) engine_woken(e);
+            else engine_event(e, events[i].data.ptr);
+        }
+        timeout = 0;
+    } while (n > 0 && !mq_shutdown(e->mq));
+}
+
+/**
+ * Handle wake up from engine_notify.
+ * @param   e       Engine structure.
+ */
+void engine_woken(Engine *e) {
+    eventfd_t value;
+    eventfd_read(e->wake_fd, &value);
+    // Clear flag before looking at the queues so later changes notify again
+    __atomic_store_n(&e->notified, false, __ATOMIC_SEQ_CST);
+    if (e->held && engine_deliver(e)) engine_resume(e);
+    engine_kick(e, &e->pusher);
+}
+
+/**
+ * Format the puller's request (for a stream or for one message).
+ * @param   e       Engine structure.
+ * @return  Whether or not the request could be formatted.
+ */
+bool engine_pull(Engine *e) {
+    Request *request = e->streaming ? e->stream : e->get;
+    e->puller.iovcnt = request_iovec(request, mq_host(e->mq), e->puller.header, REQUEST_HEADER, e->puller.request);
+    return e->puller.iovcnt > 0;
+}
+
+/**
+ * Load next request for link.  The pusher batches whatever is already in
+ * the outgoing queue, since lingering would stall the event loop; the
+ * puller re-sends its GET unless a message is still waiting for room in
+ * the incoming queue.
+ * @param   e       Engine structure.
+ * @param   link    Link to load.
+ * @return  Whether or not there is a request to send.
+ */
+bool engine_next(Engine *e, Link *link) {
+    MessageQueue *mq = e->mq;
+    if (link == &e->puller) return !e->held;
+
+    Request *next;
+    stats_depth(mq->stats, STATS_OUTGOING, queue_depth(mq->outgoing) + (e->leftover != NULL));
+    while ((next = e->leftover ? e->leftover : queue_try_pop(mq->outgoing))) {
+        e->leftover = NULL;
+        link->count = 0;
+        if (mq->batch_count > 1 && mq_batchable(next)) {
+            size_t limit = mq->batch_count < BATCH_MAX ? mq->batch_count : BATCH_MAX;
+            size_t bytes = 0;
+            while (next && mq_batchable(next)) {
+                // An oversized message waits for the next batch unless it is alone
+                if (link->count && bytes + next->length > mq->batch_bytes) break;
+                link->requests[link->count++] = next;
+                bytes += next->length;
+                next   = NULL;
+                if (link->count >= limit || bytes >= mq->batch_bytes) break;
+                next   = queue_try_pop(mq->outgoing);
+            }
+            e->leftover  = next;
+            link->iovcnt = mq_batch_iovec(mq, link->requests, link->count, &link->frames, &link->capacity, link->header, link->request);
+        } else {
+            link->requests[link->count++] = next;
+            link->iovcnt = request_iovec(next, mq_host(mq), link->header, REQUEST_HEADER, link->request);
+        }
+        if (link->iovcnt) return true;
+        mq_answered(mq, link->requests, link->count, -1);
+        engine_drop(link);
+    }
+    return false;
+}
+
+/**
+ * Start next request on link if it is idle and has one.
+ * @param   e       Engine structure.
+ * @param   link    Link to start.
+ */
+void engine_kick(Engine *e, Link *link) {
+    if (link->busy || link->waiting || mq_shutdown(e->mq)) return;
+    if (engine_next(e, link)) {
+        link->busy = true;
+        engine_begin(e, link);
+    }
+}
+
+/**
+ * (Re)start sending link's whole request from the beginning.
+ * @param   e       Engine structure.
+ * @param   link    Link to send on.
+ */
+void engine_begin(Engine *e, Link *link) {
+    memcpy(link->pending, link->request, link->iovcnt * sizeof(struct iovec));
+    link->next   = link->pending;
+    link->left   = link->iovcnt;
+    link->reused = link->fd >= 0;
+    link->response.stream = link == &e->puller && e->streaming;
+    engine_send(e, link);
+}
+
+/**
+ * Connect link if needed and write as much of its request as the socket
+ * will take, then wait for the socket to drain or for the response.
+ * @param   e       Engine structure.
+ * @param   link    Link to send on.
+ */
+void engine_send(Engine *e, Link *link) {
+    MessageQueue *mq = e->mq;
+    if (link->fd < 0) {
+        if ((link->fd = socket_dial_async(mq->host, mq->port, link->attempt)) < 0) {
+            engine_unreachable(e, link);
+            return;
+        }
+        link->connecting = true;
+        link->started    = stats_now();
+        link->deadline   = link->started + mq->connect_timeout * 1000;
+        engine_watch(e, link, EPOLL_CTL_ADD, EPOLLOUT);
+        engine_arm(e);
+        return;
+    }
+    if (link->connecting) return;
+
+    while (link->left > 0) {
+        if (socket_writev(link->fd, &link->next, &link->left) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                engine_watch(e, link, EPOLL_CTL_MOD, EPOLLOUT);
+            } else {
+                engine_fail(e, link);
+            }
+            return;
+        }
+    }
+    engine_watch(e, link, EPOLL_CTL_MOD, EPOLLIN);
+}
+
+/**
+ * Handle readiness of link's socket.
+ * @param   e       Engine structure.
+ * @param   link    Link whose socket is ready.
+ */
+void engine_event(Engine *e, Link *link) {
+    if (link->fd < 0) return;
+    if (link->connecting) {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        if (getsockopt(link->fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error) {
+            error("Unable to connect to %s:%s: %s", e->mq->host, e->mq->port, strerror(error));
+            engine_unreachable(e, link);
+            return;
+        }
+        socket_connected(true, stats_now() - link->started);
+        stats_connected(e->mq->stats, true, link->opened, stats_now() - link->started);
+        link->opened     = true;
+        link->connecting = false;
+        link->attempt    = 0;
+        engine_send(e, link);
+        return;
+    }
+    if (link->left > 0) {
+        engine_send(e, link);
+        return;
+    }
+    Response *r = &link->response;
+    int done = response_read(r, link->fd, e->mq->pool, link->keep_body && !r->stream);
+    if (r->stream) {
+        size_t count;
+        engine_hold(e, response_messages(r, &count));
+        // Stop reading the stream until the application makes room
+        if (!engine_deliver(e) && !done) engine_watch(e, link, EPOLL_CTL_MOD, 0);
+    }
+    switch (done) {
+        case 1:  engine_finish(e, link); break;
+        case -1: engine_fail(e, link);   break;
+    }
+}
+
+/**
+ * Handle complete response on link and move on to the next request.
+ * @param   e       Engine structure.
+ * @param   link    Link response arrived on.
+ */
+void engine_finish(Engine *e, Link *link) {
+    Response *r = &link->response;
+    bool keep = r->keep && e->mq->keep_alive;
+    if (link == &e->puller) {
+        // If we get a 200 status code, hand the body to the application
+        if (r->status == 200 && r->body) {
+            r->body->next = NULL;
+            engine_hold(e, r->body);
+            r->body = NULL;
+            engine_deliver(e);
+        }
+        // A server that cannot stream answers with an error instead
+        if (e->streaming && r->status != 200) {
+            e->streaming = false;
+            engine_pull(e);
+        }
+    } else {
+        // Answers only count towards statistics for pusher
+        mq_answered(e->mq, link->requests, link->count, r->status);
+        engine_drop(link);
+    }
+    response_next(r);
+    link->busy = false;
+    if (!keep) engine_close(e, link);
+    engine_kick(e, link);
+}
+
+/**
+ * Handle broken connection.  A request that went out on a reused
+ * connection is sent once more on a fresh one; otherwise it is given up
+ * on (as the threaded pusher and puller do) and the link backs off.
+ * @param   e       Engine structure.
+ * @param   link    Link that failed.
+ */
+void engine_fail(Engine *e, Link *link) {
+    bool reused = link->reused;
+    engine_close(e, link);
+    if (reused) {
+        engine_begin(e, link);
+        return;
+    }
+    if (link == &e->pusher) {
+        mq_answered(e->mq, link->requests, link->count, -1);
+        engine_drop(link);
+    }
+    link->busy = false;
+    engine_retry(e, link);
+}
+
+/**
+ * Close link's connection (if open).
+ * @param   e       Engine structure.
+ * @param   link    Link to close.
+ */
+void engine_close(Engine *e, Link *link) {
+    if (link->fd < 0) return;
+    epoll_ctl(e->epoll_fd, EPOLL_CTL_DEL, link->fd, NULL);
+    close(link->fd);
+    link->fd         = -1;
+    link->connecting = false;
+    response_init(&link->response);
+}
+
+/**
+ * Set which readiness of link's socket is waited for.
+ * @param   e       Engine structure.
+ * @param   link    Link to watch.
+ * @param   op      EPOLL_CTL_ADD or EPOLL_CTL_MOD.
+ * @param   events  Events to wait for.
+ */
+void engine_watch(Engine *e, Link *link, int op, uint32_t events) {
+    struct epoll_event event = { .events = events, .data.ptr = link };
+    if (epoll_ctl(e->epoll_fd, op, link->fd, &event) < 0) {
+        error("Unable to watch socket: %s", strerror(errno));
+    }
+}
+
+/**
+ * Handle failed (or timed out) connect: the next attempt goes to the next
+ * of the server's addresses after a reconnect delay, and once a round of
+ * addresses has failed they are resolved again.
+ * @param   e       Engine structure.
+ * @param   link    Link that could not connect.
+ */
+void engine_unreachable(Engine *e, Link *link) {
+    engine_close(e, link);
+    socket_connected(false, 0);
+    stats_connected(e->mq->stats, false, false, 0);
+    if (++link->attempt % SOCKET_CANDIDATES == 0) socket_forget(e->mq->host, e->mq->port);
+    engine_retry(e, link);
+}
+
+/**
+ * Park link until the reconnect delay has passed.
+ * @param   e       Engine structure.
+ * @param   link    Link to park.
+ */
+void engine_retry(Engine *e, Link *link) {
+    link->waiting  = true;
+    link->deadline = stats_now() + RECONNECT_DELAY;
+    engine_arm(e);
+}
+
+/**
+ * Set timer to the nearest connect timeout or end of reconnect delay.
+ * @param   e       Engine structure.
+ */
+void engine_arm(Engine *e) {
+    Link *links[] = { &e->pusher, &e->puller };
+    uint64_t nearest = 0;
+    for (size_t i = 0; i < sizeof(links) / sizeof(Link *); i++) {
+        if (!links[i]->waiting && !links[i]->connecting) continue;
+        if (!nearest || links[i]->deadline < nearest) nearest = links[i]->deadline;
+    }
+    // Absolute monotonic time (all zero disarms the timer)
+    struct itimerspec when = {
+        .it_value = { .tv_sec = nearest / 1000000, .tv_nsec = nearest % 1000000 * 1000 },
+    };
+    timerfd_settime(e->timer_fd, TFD_TIMER_ABSTIME, &when, NULL);
+}
+
+/**
+ * Handle timer: give up on connects that took too long and resume links
+ * whose reconnect delay has passed.
+ * @param   e       Engine structure.
+ */
+void engine_wake(Engine *e) {
+    uint64_t expirations;
+    if (read(e->timer_fd, &expirations, sizeof(expirations)) < 0) return;
+    uint64_t now = stats_now();
+    Link *links[] = { &e->pusher, &e->puller };
+    for (size_t i = 0; i < sizeof(links) / sizeof(Link *); i++) {
+        if (links[i]->deadline > now) continue;
+        if (links[i]->connecting) {
+            error("Unable to connect to %s:%s: %s", e->mq->host, e->mq->port, strerror(ETIMEDOUT));
+            engine_unreachable(e, links[i]);
+        } else if (links[i]->waiting) {
+            links[i]->waiting = false;
+            if (links[i]->busy) engine_send(e, links[i]);
+            else engine_kick(e, links[i]);
+        }
+    }
+    engine_arm(e);
+}
+
+/**
+ * Add messages to those waiting for room in incoming queue.
+ * @param   e           Engine structure.
+ * @param   messages    First message (the rest follow through next).
+ */
+void engine_hold(Engine *e, Request *messages) {
+    if (!messages) return;
+    if (e->held) e->held_last->next = messages;
+    else e->held = messages;
+    for (e->held_last = messages; e->held_last->next; e->held_last = e->held_last->next);
+}
+
+/**
+ * Move held messages to incoming queue while there is room for them (or
+ * drop them if its policy refuses them rather than waiting).
+ * @param   e       Engine structure.
+ * @return  Whether or not all of them were delivered.
+ */
+bool engine_deliver(Engine *e) {
+    Queue *incoming = e->mq->incoming;
+    int delivered = e->delivered;
+    uint64_t bytes = 0;
+    for (int pass = 0; pass < 2 && e->held; pass++) {
+        while (e->held) {
+            Request *next = e->held->next;
+            size_t length = e->held->length;
+            if (queue_try_offer(incoming, e->held)) {
+                e->delivered++;
+                bytes += length;
+            } else if (incoming->limits.policy == QUEUE_BLOCK) {
+                break;
+            } else {
+                request_delete(e->held);
+            }
+            e->held = next;
+        }
+        // Ask mq_retrieve for a notify, then look again in case it already made room
+        __atomic_store_n(&e->stalled, e->held != NULL, __ATOMIC_SEQ_CST);
+    }
+    if (e->delivered > delivered) {
+        stats_add(e->mq->stats, STATS_RECEIVED, e->delivered - delivered);
+        stats_add(e->mq->stats, STATS_RECEIVED_BYTES, bytes);
+        stats_depth(e->mq->stats, STATS_INCOMING, queue_depth(incoming));
+    }
+    return !e->held;
+}
+
+/**
+ * Resume puller once its held messages have been delivered: a stream is
+ * read again (starting with what is already buffered), otherwise the next
+ * GET goes out.
+ * @param   e       Engine structure.
+ */
+void engine_resume(Engine *e) {
+    Link *link = &e->puller;
+    if (link->busy && link->response.stream && link->fd >= 0 && !link->left) {
+        engine_watch(e, link, EPOLL_CTL_MOD, EPOLLIN);
+        engine_event(e, link);
+    } else {
+        engine_kick(e, link);
+    }
+}
+
+/**
+ * Free link's requests (once answered or given up on).
+ * @param   link    Link to clear.
+ */
+void engine_drop(Link *link) {
+    for (size_t i = 0; i < link->count; i++) request_delete(link->requests[i]);
+    link->count = 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
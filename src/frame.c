@@ -0,0 +1,165 @@
+/* frame.c: Binary protocol frames */
+
+#include "mq/frame.h"
+#include "mq/logging.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+
+/* Internal Constants */
+
+#define FRAME_TOPICS    16      /* Slots in a topic table when it is first used */
+
+/* Internal Prototypes */
+
+uint32_t frame_hash(const char *name, size_t length);
+bool     frame_grow(FrameTopics *topics);
+
+/* External Functions */
+
+/**
+ * Format frame header into buffer (FRAME_HEADER bytes, in network order):
+ *
+ *  $LENGTH                     (32 bits, bytes of payload that follow)
+ *  $OPCODE $ARGUMENT           (8 and 24 bits)
+ *
+ * @param   buffer      Buffer to format header into.
+ * @param   opcode      Frame opcode.
+ * @param   argument    Frame argument (topic ID, count, or status).
+ * @param   length      Length of payload that will follow the header.
+ */
+void frame_header(char *buffer, Opcode opcode, uint32_t argument, size_t length) {
+    uint32_t words[2] = {
+        htonl((uint32_t)length),
+        htonl((uint32_t)opcode << 24 | (argument & FRAME_ARGUMENT)),
+    };
+    memcpy(buffer, words, FRAME_HEADER);
+}
+
+/**
+ * Parse frame header from buffer (FRAME_HEADER bytes).
+ * @param   buffer      Buffer holding header.
+ * @param   opcode      Set to frame opcode.
+ * @param   argument    Set to frame argument.
+ * @param   length      Set to length of payload that follows the header.
+ */
+void frame_parse(const char *buffer, Opcode *opcode, uint32_t *argument, size_t *length) {
+    uint32_t words[2];
+    memcpy(words, buffer, FRAME_HEADER);
+    *length   = ntohl(words[0]);
+    *opcode   = ntohl(words[1]) >> 24;
+    *argument = ntohl(words[1]) & FRAME_ARGUMENT;
+}
+
+/**
+ * Format HTTP request asking the server to switch the connection over to
+ * binary frames on behalf of queue:
+ *
+ *  GET /binary/$QUEUE$QUERY HTTP/1.1\r\n
+ *  Host: $HOST\r\n
+ *  Connection: Upgrade\r\n
+ *  Upgrade: mq-binary\r\n
+ *  MQ-Compression: zlib\r\n      (if compress is set)
+ *  \r\n
+ *
+ * A server that agrees answers 101 and speaks frames from then on, and
+ * if it repeats the MQ-Compression header, payloads may be compressed
+ * (and have FRAME_COMPRESSED set in their opcode) both ways.
+ * @param   buffer      Buffer to format request into.
+ * @param   size        Size of buffer.
+ * @param   host        Host of server.
+ * @param   queue       Name of client's queue.
+ * @param   query       Queue options (see mq_queue_options).
+ * @param   compress    Whether to offer compressed payloads.
+ * @return  Length of request, or 0 if it did not fit.
+ */
+size_t frame_upgrade(char *buffer, size_t size, const char *host, const char *queue, const char *query, bool compress) {
+    int used = snprintf(buffer, size,
+        "GET /binary/%s%s HTTP/1.1\r\nHost: %s\r\nConnection: Upgrade\r\nUpgrade: %s\r\n%s\r\n",
+        queue, query, host, FRAME_PROTOCOL, compress ? FRAME_COMPRESSION ": zlib\r\n" : "");
+    return used > 0 && (size_t)used < size ? (size_t)used : 0;
+}
+
+/**
+ * Look up the ID of topic on this connection, handing out the next one if
+ * it has none yet (in which case the server must be told with OP_TOPIC
+ * before the ID is used).
+ * @param   topics      Topic table of connection.
+ * @param   name        Topic name (need not be NUL terminated).
+ * @param   length      Length of topic name.
+ * @param   fresh       Set to whether the ID was just handed out.
+ * @return  Topic ID, or 0 if there was no room for another.
+ */
+uint32_t frame_topic(FrameTopics *topics, const char *name, size_t length, bool *fresh) {
+    *fresh = false;
+    // Grow while the table is at most three quarters full
+    if (4 * (topics->count + 1) > 3 * topics->capacity && !frame_grow(topics)) return 0;
+
+    size_t mask = topics->capacity - 1;
+    size_t slot = frame_hash(name, length) & mask;
+    for (; topics->slots[slot].name; slot = (slot + 1) & mask) {
+        FrameTopic *topic = &topics->slots[slot];
+        if (!strncmp(topic->name, name, length) && !topic->name[length]) return topic->id;
+    }
+    if (topics->count >= FRAME_ARGUMENT) return 0;
+    if (!(topics->slots[slot].name = strndup(name, length))) return 0;
+    topics->slots[slot].id = ++topics->count;
+    *fresh = true;
+    return topics->count;
+}
+
+/**
+ * Forget every topic ID (when the connection they were handed out on is
+ * closed), freeing the table.
+ * @param   topics      Topic table of connection.
+ */
+void frame_topics_clear(FrameTopics *topics) {
+    for (size_t i = 0; i < topics->capacity; i++) free(topics->slots[i].name);
+    free(topics->slots);
+    topics->slots    = NULL;
+    topics->capacity = 0;
+    topics->count    = 0;
+}
+
+/* Internal Functions */
+
+/**
+ * Returns FNV-1a hash of topic name.
+ * @param   name        Topic name.
+ * @param   length      Length of topic name.
+ */
+uint32_t frame_hash(const char *name, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Double the slots of topic table (rehashing the topics already in it).
+ * @param   topics      Topic table.
+ * @return  Whether or not the table was grown.
+ */
+bool frame_grow(FrameTopics *topics) {
+    size_t capacity = topics->capacity ? topics->capacity * 2 : FRAME_TOPICS;
+    FrameTopic *slots = calloc(capacity, sizeof(FrameTopic));
+    if (!slots) {
+        error("Unable to grow topic table: %s", strerror(errno));
+        return false;
+    }
+    for (size_t i = 0; i < topics->capacity; i++) {
+        FrameTopic *topic = &topics->slots[i];
+        if (!topic->name) continue;
+        size_t slot = frame_hash(topic->name, strlen(topic->name)) & (capacity - 1);
+        while (slots[slot].name) slot = (slot + 1) & (capacity - 1);
+        slots[slot] = *topic;
+    }
+    free(topics->slots);
+    topics->slots    = slots;
+    topics->capacity = capacity;
+    return true;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
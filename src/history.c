@@ -0,0 +1,211 @@
+/* history.c: Channel history ring */
+
+#include "mq/history.h"
+#include "mq/logging.h"
+
+#include <errno.h>
+
+/*
+ * Records are written one after another into a single buffer allocated
+ * when the ring is created, each a fixed header followed by its body, so
+ * appending never allocates and replaying is a linear scan.  A record
+ * never wraps: if it does not fit before the end of the buffer, the rest
+ * is skipped (marked HISTORY_PAD if there is room for a header) and it is
+ * written at the front.  Room is made by moving head past the oldest
+ * records, which takes one header read each.  Each header also records
+ * how far back the one before it starts, so the newest few records can be
+ * found without scanning the older ones.
+ */
+
+/* Internal Prototypes */
+
+bool   history_pad(const History *h, uint64_t offset);
+void   history_read(const History *h, uint64_t offset, HistoryEntry *entry);
+void   history_evict(History *h);
+
+/* External Functions */
+
+/**
+ * Create history ring.
+ * @param   capacity    Bytes to keep records in (0 for HISTORY_CAPACITY).
+ * @return  Newly allocated History structure (NULL on failure).
+ */
+History * history_create(size_t capacity) {
+    if (!capacity) capacity = HISTORY_CAPACITY;
+    // Leave room for at least one record with a body
+    if (capacity < 2 * sizeof(HistoryRecord)) capacity = 2 * sizeof(HistoryRecord);
+    capacity = (capacity + HISTORY_ALIGN - 1) & ~(size_t)(HISTORY_ALIGN - 1);
+
+    History *h = calloc(1, sizeof(History));
+    if (!h) {
+        error("Unable to allocate history: %s", strerror(errno));
+        return NULL;
+    }
+    if (!(h->buffer = malloc(capacity))) {
+        error("Unable to allocate history: %s", strerror(errno));
+        free(h);
+        return NULL;
+    }
+    h->capacity = capacity;
+    return h;
+}
+
+/**
+ * Delete history ring.
+ * @param   h           History structure.
+ */
+void history_delete(History *h) {
+    if (!h) return;
+    free(h->buffer);
+    free(h);
+}
+
+/**
+ * Append record to history, evicting the oldest records to make room.
+ * Bodies too long for the ring are truncated to fit.
+ * @param   h           History structure.
+ * @param   sender      Name of sender (truncated to HISTORY_SENDER - 1).
+ * @param   body        Message body.
+ * @param   length      Length of message body.
+ * @param   time        Time of message (microseconds since the epoch).
+ * @param   flags       Anything the caller parsed out of the message.
+ */
+void history_append(History *h, const char *sender, const char *body, size_t length, uint64_t time, uint32_t flags) {
+    if (length > h->capacity - sizeof(HistoryRecord) - 1) {
+        length = h->capacity - sizeof(HistoryRecord) - 1;
+    }
+    size_t size   = history_size(length);
+    size_t offset = h->tail % h->capacity;
+    size_t skip   = h->capacity - offset < size ? h->capacity - offset : 0;
+
+    while (h->tail + skip + size - h->head > h->capacity) {
+        if (h->head == h->tail) {
+            // Nothing left to evict, so start over at the front
+            h->head = h->tail = h->tail + skip;
+            skip    = 0;
+            offset  = 0;
+            break;
+        }
+        history_evict(h);
+    }
+    if (skip) {
+        if (skip >= sizeof(HistoryRecord)) {
+            ((HistoryRecord *)(h->buffer + offset))->length = HISTORY_PAD;
+        }
+        h->tail += skip;
+        offset   = 0;
+    }
+
+    HistoryRecord *r = (HistoryRecord *)(h->buffer + offset);
+    size_t         n = strnlen(sender, HISTORY_SENDER - 1);
+    memset(r, 0, sizeof(HistoryRecord));
+    memcpy(r->sender, sender, n);
+    r->time   = time;
+    r->length = length;
+    r->back   = h->count ? h->tail - h->last : 0;
+    r->flags  = flags;
+    memcpy(r + 1, body, length);
+    ((char *)(r + 1))[length] = 0;
+
+    h->last  = h->tail;
+    h->tail += size;
+    h->count++;
+}
+
+/**
+ * Read the record at cursor and move cursor past it.  Start cursor at
+ * head to replay every record from oldest to newest; a cursor left behind
+ * by eviction picks up at the oldest record still kept.
+ * @param   h           History structure.
+ * @param   cursor      Offset of record to read (updated).
+ * @param   entry       Set to the record (body points into the ring).
+ * @return  Whether or not there was a record to read.
+ */
+bool history_next(const History *h, uint64_t *cursor, HistoryEntry *entry) {
+    if (*cursor < h->head) *cursor = h->head;
+    while (*cursor < h->tail) {
+        size_t offset = *cursor % h->capacity;
+        if (history_pad(h, *cursor)) {
+            *cursor += h->capacity - offset;
+            continue;
+        }
+        history_read(h, *cursor, entry);
+        *cursor += history_size(entry->length);
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Move cursor back to the record before it and read that record.  Start
+ * cursor at tail to walk from newest to oldest; history_next from where it
+ * stops replays just the records walked over.
+ * @param   h           History structure.
+ * @param   cursor      Offset of record (or tail) to step back from (updated).
+ * @param   entry       Set to the record (body points into the ring).
+ * @return  Whether or not there was a record before cursor.
+ */
+bool history_prev(const History *h, uint64_t *cursor, HistoryEntry *entry) {
+    if (!h->count || *cursor <= h->head) return false;
+    uint64_t offset = h->last;
+    if (*cursor < h->tail) {
+        uint32_t back = ((const HistoryRecord *)(h->buffer + *cursor % h->capacity))->back;
+        if (!back || *cursor - back < h->head) return false;
+        offset = *cursor - back;
+    }
+    history_read(h, offset, entry);
+    *cursor = offset;
+    return true;
+}
+
+/**
+ * Returns bytes taken by record with body of length (header, body, and
+ * NUL, rounded up to HISTORY_ALIGN).
+ * @param   length      Length of body.
+ */
+size_t history_size(size_t length) {
+    return (sizeof(HistoryRecord) + length + 1 + HISTORY_ALIGN - 1) & ~(size_t)(HISTORY_ALIGN - 1);
+}
+
+/* Internal Functions */
+
+/**
+ * Returns whether the rest of the ring from offset was skipped over.
+ * @param   h           History structure.
+ * @param   offset      Offset of record.
+ */
+bool history_pad(const History *h, uint64_t offset) {
+    size_t left = h->capacity - offset % h->capacity;
+    return left < sizeof(HistoryRecord) || ((const HistoryRecord *)(h->buffer + h->capacity - left))->length == HISTORY_PAD;
+}
+
+/**
+ * Read record at offset.
+ * @param   h           History structure.
+ * @param   offset      Offset of record.
+ * @param   entry       Set to the record.
+ */
+void history_read(const History *h, uint64_t offset, HistoryEntry *entry) {
+    const HistoryRecord *r = (const HistoryRecord *)(h->buffer + offset % h->capacity);
+    entry->time   = r->time;
+    entry->flags  = r->flags;
+    entry->sender = r->sender;
+    entry->body   = (const char *)(r + 1);
+    entry->length = r->length;
+}
+
+/**
+ * Evict oldest record (or the padding in front of it).
+ * @param   h           History structure.
+ */
+void history_evict(History *h) {
+    size_t offset = h->head % h->capacity;
+    if (history_pad(h, h->head)) {
+        h->head += h->capacity - offset;
+        return;
+    }
+    h->head += history_size(((const HistoryRecord *)(h->buffer + offset))->length);
+    h->count--;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,128 @@
+/* io_pool.c: Shared I/O threads for Message Queue clients */
+
+#include "mq/engine.h"
+#include "mq/io_pool.h"
+#include "mq/logging.h"
+
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+/* Internal Prototypes */
+
+void *  io_pool_worker(void *arg);
+void    io_pool_service(MessageQueue *mq, IOWorker *worker);
+
+/* External Functions */
+
+/**
+ * Create pool of I/O threads that run the event engines of any number of
+ * Message Queues (set mode to MQ_POOLED and io_pool before mq_start),
+ * rather than each queue having its own pusher and puller threads.
+ * @param   threads     Number of threads (0 for one per online CPU).
+ * @return  Newly allocated IOPool structure (NULL on failure).
+ */
+IOPool * io_pool_create(size_t threads) {
+    if (!threads) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? cpus : 1;
+    }
+
+    IOPool *pool = calloc(1, sizeof(IOPool));
+    if (!pool) return NULL;
+    if (!(pool->workers = calloc(threads, sizeof(IOWorker)))) {
+        free(pool);
+        return NULL;
+    }
+
+    for (pool->count = 0; pool->count < threads; pool->count++) {
+        IOWorker *worker = &pool->workers[pool->count];
+        if ((worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+            (worker->stop_fd  = eventfd(0, EFD_CLOEXEC)) < 0) {
+            error("Unable to create I/O worker: %s", strerror(errno));
+            if (worker->epoll_fd >= 0) close(worker->epoll_fd);
+            io_pool_delete(pool);
+            return NULL;
+        }
+        struct epoll_event stop = { .events = EPOLLIN, .data.ptr = worker };
+        epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->stop_fd, &stop);
+        thread_create(&worker->thread, NULL, io_pool_worker, worker);
+    }
+    return pool;
+}
+
+/**
+ * Stop the pool's threads and delete IOPool structure.  Every Message
+ * Queue serviced by the pool must have been stopped first.
+ * @param   pool    IOPool structure.
+ */
+void io_pool_delete(IOPool *pool) {
+    for (size_t i = 0; i < pool->count; i++) {
+        IOWorker *worker = &pool->workers[i];
+        eventfd_write(worker->stop_fd, 1);
+        thread_join(worker->thread, NULL);
+        close(worker->stop_fd);
+        close(worker->epoll_fd);
+    }
+    free(pool->workers);
+    free(pool);
+}
+
+/**
+ * Hand Message Queue's engine to one of the pool's threads (spreading
+ * queues round robin).
+ * @param   pool    IOPool structure.
+ * @param   mq      Message Queue structure (with engine created).
+ */
+void io_pool_add(IOPool *pool, MessageQueue *mq) {
+    size_t next = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+    IOWorker *worker = &pool->workers[next % pool->count];
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = mq };
+    if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, engine_fd(mq->engine), &event) < 0) {
+        error("Unable to add queue to I/O pool: %s", strerror(errno));
+    }
+}
+
+/* Internal Functions */
+
+/**
+ * I/O thread runs the engines of its queues as their sockets get ready.
+ **/
+void * io_pool_worker(void *arg) {
+    IOWorker *worker = (IOWorker *)arg;
+    struct epoll_event events[IO_POOL_EVENTS];
+
+    for (;;) {
+        int n = epoll_wait(worker->epoll_fd, events, IO_POOL_EVENTS, -1);
+        if (n < 0 && errno != EINTR) {
+            error("Unable to wait for events: %s", strerror(errno));
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == worker) return NULL;
+            io_pool_service(events[i].data.ptr, worker);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Run one queue's engine and wake its application for whatever arrived.
+ * Once the queue is stopped the engine is let go of (by this thread, so no
+ * later event can refer to it) and mq_stop is told so.
+ * @param   mq      Message Queue structure.
+ * @param   worker  Worker running the engine.
+ */
+void io_pool_service(MessageQueue *mq, IOWorker *worker) {
+    if (!mq_shutdown(mq)) {
+        int delivered = engine_process(mq);
+        if (delivered) mq_wakeup(mq, delivered);
+    }
+    if (mq_shutdown(mq)) {
+        epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, engine_fd(mq->engine), NULL);
+        sem_post(&mq->detached);
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
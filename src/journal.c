@@ -0,0 +1,348 @@
+/* journal.c: Persistent channel history */
+
+#include "mq/journal.h"
+#include "mq/logging.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * A channel's history is saved in numbered segment files, each a one page
+ * JournalHeader followed by records laid out as in a History ring, and
+ * written through a shared mapping of the whole file.  Only the segment
+ * being appended to is mapped when a journal is opened; older ones are
+ * mapped the first time something in them is read.  The header keeps the
+ * offset of every JOURNAL_STRIDE-th record, so reading the record any
+ * number back from the newest walks at most that many records.  When the
+ * newest segment is full the next is started, and once more than keep
+ * exist the oldest is deleted.  The header is updated after the record
+ * is written, so a client killed mid-append loses only that record.
+ */
+
+/* Internal Prototypes */
+
+char *           journal_name(const Journal *j, uint64_t seq);
+JournalSegment * journal_segment(Journal *j, uint64_t seq);
+bool             journal_create(Journal *j, uint64_t seq);
+bool             journal_rotate(Journal *j);
+bool             journal_scan(Journal *j, const char *directory, const char *base);
+bool             journal_mkdir(const char *directory);
+void             journal_unmap(JournalSegment *s);
+
+/* External Functions */
+
+/**
+ * Open journal of topic in directory (creating the directory, and the
+ * first segment, if need be).
+ * @param   directory   Directory to keep segment files in.
+ * @param   topic       Topic of channel.
+ * @param   segment     Bytes per segment file (0 for JOURNAL_SEGMENT).
+ * @param   keep        Segment files to keep (0 for JOURNAL_SEGMENTS).
+ * @return  Newly allocated Journal structure (NULL on failure).
+ */
+Journal * journal_open(const char *directory, const char *topic, size_t segment, size_t keep) {
+    if (!journal_mkdir(directory)) return NULL;
+
+    Journal *j = calloc(1, sizeof(Journal));
+    if (!j) {
+        error("Unable to allocate journal: %s", strerror(errno));
+        return NULL;
+    }
+    j->segment = segment > 2 * JOURNAL_HEADER ? segment : (segment ? 2 * JOURNAL_HEADER : JOURNAL_SEGMENT);
+    j->keep    = keep ? keep : JOURNAL_SEGMENTS;
+
+    // Topics are escaped so any of them makes a plain file name
+    char   base[3 * strlen(topic) + 1];
+    size_t used = 0;
+    for (const char *c = topic; *c; c++) {
+        if (isalnum((unsigned char)*c) || *c == '-' || *c == '_') base[used++] = *c;
+        else used += sprintf(base + used, "%%%02X", (unsigned char)*c);
+    }
+    base[used] = 0;
+
+    if (!(j->prefix = malloc(strlen(directory) + used + 2)) || !(j->segments = calloc(j->keep, sizeof(JournalSegment)))) {
+        error("Unable to allocate journal: %s", strerror(errno));
+        journal_close(j);
+        return NULL;
+    }
+    sprintf(j->prefix, "%s/%s", directory, base);
+
+    if (!journal_scan(j, directory, base)) {
+        if (!journal_create(j, 0)) {
+            journal_close(j);
+            return NULL;
+        }
+    } else if (!journal_segment(j, j->last) && !journal_rotate(j)) {
+        // An unreadable newest segment is left for a fresh one
+        journal_close(j);
+        return NULL;
+    }
+    return j;
+}
+
+/**
+ * Close journal, unmapping its segments.
+ * @param   j           Journal structure.
+ */
+void journal_close(Journal *j) {
+    if (!j) return;
+    for (size_t i = 0; j->segments && i < j->keep; i++) journal_unmap(&j->segments[i]);
+    free(j->segments);
+    free(j->prefix);
+    free(j);
+}
+
+/**
+ * Append record to journal, starting a new segment if the newest is full.
+ * Bodies too long for a segment are truncated to fit.
+ * @param   j           Journal structure.
+ * @param   sender      Name of sender (truncated to HISTORY_SENDER - 1).
+ * @param   body        Message body.
+ * @param   length      Length of message body.
+ * @param   time        Time of message (microseconds since the epoch).
+ * @param   flags       Anything the caller parsed out of the message.
+ * @return  Whether or not the record was appended.
+ */
+bool journal_append(Journal *j, const char *sender, const char *body, size_t length, uint64_t time, uint32_t flags) {
+    JournalSegment *s = journal_segment(j, j->last);
+    if (!s) return false;
+    JournalHeader  *h = (JournalHeader *)s->map;
+
+    if (length > j->segment - JOURNAL_HEADER - sizeof(HistoryRecord) - 1) {
+        length = j->segment - JOURNAL_HEADER - sizeof(HistoryRecord) - 1;
+    }
+    size_t size = history_size(length);
+    if (JOURNAL_HEADER + h->used + size > s->size || h->count >= JOURNAL_INDEX * JOURNAL_STRIDE) {
+        if (!journal_rotate(j)) return false;
+        s = journal_segment(j, j->last);
+        h = (JournalHeader *)s->map;
+    }
+
+    uint64_t       offset = JOURNAL_HEADER + h->used;
+    HistoryRecord *r      = (HistoryRecord *)(s->map + offset);
+    memset(r, 0, sizeof(HistoryRecord));
+    memcpy(r->sender, sender, strnlen(sender, HISTORY_SENDER - 1));
+    r->time   = time;
+    r->length = length;
+    r->back   = h->count ? offset - h->last : 0;
+    r->flags  = flags;
+    memcpy(r + 1, body, length);
+    ((char *)(r + 1))[length] = 0;
+
+    if (h->count % JOURNAL_STRIDE == 0) h->index[h->count / JOURNAL_STRIDE] = offset;
+    h->last  = offset;
+    h->used += size;
+    h->count++;
+    return true;
+}
+
+/**
+ * Read record age records back from the newest (0 for the newest), mapping
+ * the segment it is in if it is not already.
+ * @param   j           Journal structure.
+ * @param   age         Records back from the newest.
+ * @param   entry       Set to the record (body points into the mapping).
+ * @return  Whether or not the journal goes back that far.
+ */
+bool journal_read(Journal *j, size_t age, HistoryEntry *entry) {
+    for (uint64_t seq = j->last + 1; seq-- > j->first;) {
+        JournalSegment *s = journal_segment(j, seq);
+        if (!s) return false;
+        const JournalHeader *h = (const JournalHeader *)s->map;
+        if (age >= h->count) {
+            age -= h->count;
+            continue;
+        }
+
+        size_t   record = h->count - 1 - age;
+        uint64_t offset = h->index[record / JOURNAL_STRIDE];
+        for (size_t skip = record % JOURNAL_STRIDE; ; skip--) {
+            if (offset + sizeof(HistoryRecord) > s->size) return false;
+            const HistoryRecord *r = (const HistoryRecord *)(s->map + offset);
+            if (offset + history_size(r->length) > s->size) return false;
+            if (!skip) {
+                entry->time   = r->time;
+                entry->flags  = r->flags;
+                entry->sender = r->sender;
+                entry->body   = (const char *)(r + 1);
+                entry->length = r->length;
+                return true;
+            }
+            offset += history_size(r->length);
+        }
+    }
+    return false;
+}
+
+/* Internal Functions */
+
+/**
+ * Returns newly allocated path of segment file (caller frees).
+ * @param   j           Journal structure.
+ * @param   seq         Sequence number of segment.
+ */
+char * journal_name(const Journal *j, uint64_t seq) {
+    // Room for the prefix, a dot, 20 digits and the suffix
+    char *name = malloc(strlen(j->prefix) + 26);
+    if (name) sprintf(name, "%s.%08" PRIu64 ".log", j->prefix, seq);
+    return name;
+}
+
+/**
+ * Returns segment with sequence number, mapping it if need be (NULL if it
+ * could not be, or is not a segment).
+ * @param   j           Journal structure.
+ * @param   seq         Sequence number of segment.
+ */
+JournalSegment * journal_segment(Journal *j, uint64_t seq) {
+    JournalSegment *s = &j->segments[seq % j->keep];
+    if (s->map) return s;
+
+    char *name = journal_name(j, seq);
+    int   fd   = name ? open(name, O_RDWR) : -1;
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || (size_t)st.st_size < JOURNAL_HEADER) {
+        if (fd >= 0) close(fd);
+        free(name);
+        return NULL;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        error("Unable to map %s: %s", name, strerror(errno));
+        free(name);
+        return NULL;
+    }
+    free(name);
+    s->map  = map;
+    s->size = st.st_size;
+
+    const JournalHeader *h = (const JournalHeader *)s->map;
+    if (h->magic != JOURNAL_MAGIC || JOURNAL_HEADER + h->used > s->size || h->count > JOURNAL_INDEX * JOURNAL_STRIDE) {
+        journal_unmap(s);
+        return NULL;
+    }
+    return s;
+}
+
+/**
+ * Create (or truncate) segment file with sequence number and map it.
+ * @param   j           Journal structure.
+ * @param   seq         Sequence number of segment.
+ * @return  Whether or not the segment was created.
+ */
+bool journal_create(Journal *j, uint64_t seq) {
+    JournalSegment *s    = &j->segments[seq % j->keep];
+    char           *name = journal_name(j, seq);
+    int             fd   = name ? open(name, O_RDWR | O_CREAT | O_TRUNC, 0600) : -1;
+    journal_unmap(s);
+    if (fd < 0 || ftruncate(fd, j->segment) < 0) {
+        error("Unable to create %s: %s", name ? name : j->prefix, strerror(errno));
+        if (fd >= 0) close(fd);
+        free(name);
+        return false;
+    }
+    void *map = mmap(NULL, j->segment, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        error("Unable to map %s: %s", name, strerror(errno));
+        free(name);
+        return false;
+    }
+    free(name);
+    s->map  = map;
+    s->size = j->segment;
+    ((JournalHeader *)s->map)->magic = JOURNAL_MAGIC;
+    return true;
+}
+
+/**
+ * Start the next segment, deleting the oldest if that leaves more than
+ * keep.
+ * @param   j           Journal structure.
+ * @return  Whether or not the next segment was started.
+ */
+bool journal_rotate(Journal *j) {
+    if (j->last + 1 - j->first >= j->keep) {
+        char *name = journal_name(j, j->first);
+        journal_unmap(&j->segments[j->first % j->keep]);
+        if (name) unlink(name);
+        free(name);
+        j->first++;
+    }
+    if (!journal_create(j, j->last + 1)) return false;
+    j->last++;
+    return true;
+}
+
+/**
+ * Find the segment files of journal in directory, deleting any beyond the
+ * newest keep.
+ * @param   j           Journal structure.
+ * @param   directory   Directory segment files are kept in.
+ * @param   base        Escaped topic segment files are named after.
+ * @return  Whether or not any were found.
+ */
+bool journal_scan(Journal *j, const char *directory, const char *base) {
+    DIR *dir = opendir(directory);
+    if (!dir) return false;
+
+    size_t  length = strlen(base);
+    bool    found  = false;
+    struct dirent *d;
+    while ((d = readdir(dir))) {
+        if (strncmp(d->d_name, base, length) || d->d_name[length] != '.') continue;
+        char    *end;
+        uint64_t seq = strtoull(d->d_name + length + 1, &end, 10);
+        if (end == d->d_name + length + 1 || strcmp(end, ".log")) continue;
+        if (!found || seq < j->first) j->first = seq;
+        if (!found || seq > j->last)  j->last  = seq;
+        found = true;
+    }
+    closedir(dir);
+
+    for (; found && j->last + 1 - j->first > j->keep; j->first++) {
+        char *name = journal_name(j, j->first);
+        if (name) unlink(name);
+        free(name);
+    }
+    return found;
+}
+
+/**
+ * Create directory and any missing parents.
+ * @param   directory   Directory to create.
+ * @return  Whether or not it exists now.
+ */
+bool journal_mkdir(const char *directory) {
+    char path[strlen(directory) + 1];
+    strcpy(path, directory);
+    for (char *slash = path + 1; (slash = strchr(slash, '/')); slash++) {
+        *slash = 0;
+        mkdir(path, 0700);
+        *slash = '/';
+    }
+    if (mkdir(path, 0700) < 0 && errno != EEXIST) {
+        error("Unable to create %s: %s", directory, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Unmap segment (if it is mapped).
+ * @param   s           Segment.
+ */
+void journal_unmap(JournalSegment *s) {
+    if (s->map) munmap(s->map, s->size);
+    s->map  = NULL;
+    s->size = 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
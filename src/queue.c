@@ -1,62 +1,179 @@
 /* queue.c: Concurrent Queue of Requests */
 
 #include "mq/queue.h"
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
 #include <stdio.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * The queue is a bounded ring of Request pointers (after Vyukov's bounded
+ * MPMC queue).  Each slot carries a sequence number that tells a pusher or
+ * popper holding a given ticket whether the slot is ready for it, so
+ * neither side ever takes a lock; a side declared single in the flags
+ * skips the compare-and-swap on its ticket.  Threads only sleep, on a
+ * futex, when the ring is empty or full.
+ *
+ * Limits set with queue_limit bound it more tightly (by count or by body
+ * bytes) for queue_offer, whose policy decides what happens once they are
+ * reached.  Body bytes are only counted when there is a byte limit, so an
+ * unlimited queue pays nothing for them.
+ */
+
+/* Internal Prototypes */
+
+bool queue_wait(Queue *q, uint32_t *futex, uint32_t *asleep, bool pushing, const struct timespec *deadline);
+void queue_wake(uint32_t *futex, uint32_t *asleep);
+bool queue_ready(Queue *q, bool pushing);
+bool queue_within(Queue *q);
+int  queue_fill(Queue *q);
+void queue_mark(Queue *q, bool high);
+bool queue_grow(Queue *q, size_t capacity);
+
 /**
  * Create queue structure.
+ * @param   capacity    Number of requests queue can hold (rounded up to a
+ *                      power of two).
+ * @param   flags       QUEUE_SINGLE_PRODUCER and/or QUEUE_SINGLE_CONSUMER.
  * @return  Newly allocated queue structure.
  */
-Queue * queue_create() {
-    Queue *q = calloc(1, sizeof(Queue));
-    if (q) {
-        sem_init(&q->lock, 0, 1);
-        sem_init(&q->produced, 0, 0);
+Queue * queue_create(size_t capacity, int flags) {
+    Queue *q;
+    size_t slots = 2;
+    while (slots < capacity) slots <<= 1;
+
+    if (posix_memalign((void **)&q, CACHE_LINE, sizeof(Queue))) return NULL;
+    memset(q, 0, sizeof(Queue));
+    if (posix_memalign((void **)&q->slots, CACHE_LINE, slots * sizeof(QueueSlot))) {
+        free(q);
+        return NULL;
     }
+    for (size_t i = 0; i < slots; i++) {
+        q->slots[i].sequence = i;
+        q->slots[i].request  = NULL;
+    }
+    q->mask  = slots - 1;
+    q->flags = flags;
+    q->limits.high = QUEUE_HIGH_WATER;
+    q->limits.low  = QUEUE_LOW_WATER;
     return q;
 }
 
 /**
- * Delete queue structure.
+ * Delete queue structure (and any requests still in it).
  * @param   q       Queue structure.
  */
 void queue_delete(Queue *q) {
-    // Recursively free all nodes in queue
-    queue_delete_helper(q->head);  
-    q->size = 0;
+    Request *r;
+    while ((r = queue_try_pop(q))) request_delete(r);
+    free(q->slots);
     free(q);
 }
 
 /**
- * Recursively free nodes in queue structure
- * @param  r       Request structure
+ * Bound queue by count and/or body bytes for queue_offer.  The ring grows
+ * to hold a larger count, so this must be called before any other thread
+ * uses the queue (requests already in it are kept).
+ * @param   q       Queue structure.
+ * @param   limits  Limits and policy (see QueueLimits).
+ * @return  Whether or not the limits were applied.
  */
-void queue_delete_helper(Request* r) {
-    if (!r) return;
-    queue_delete_helper(r->next);
-    request_delete(r);
+bool queue_limit(Queue *q, const QueueLimits *limits) {
+    if (limits->count > q->mask + 1 && !queue_grow(q, limits->count)) return false;
+    q->limits = *limits;
+    q->bytes  = 0;
+    for (size_t ticket = q->head; ticket != q->tail; ticket++) {
+        q->bytes += q->slots[ticket & q->mask].request->length;
+    }
+    // Pushers discard from the front themselves, so the consumer is no longer alone
+    if (limits->policy == QUEUE_DROP_OLDEST) q->flags &= ~QUEUE_SINGLE_CONSUMER;
+    return true;
 }
 
 /**
- * Push request to the back of queue.
+ * Push request to the back of queue (block while queue is full).
  * @param   q       Queue structure.
  * @param   r       Request structure.
  */
 void queue_push(Queue *q, Request *r) {
-    sem_wait(&q->lock);
-    // If there is nothing in the queue yet then set tail and head
-    if (!q->head) {
-        q->head = r;
-        q->tail = r;
-        q->size = 1;
+    while (!queue_try_push(q, r)) queue_wait(q, &q->popped, &q->pushers_asleep, true, NULL);
+}
+
+/**
+ * Push request to the back of queue if there is room.
+ * @param   q       Queue structure.
+ * @param   r       Request structure.
+ * @return  Whether or not the request was pushed.
+ */
+bool queue_try_push(Queue *q, Request *r) {
+    size_t tail = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    QueueSlot *slot;
+    for (;;) {
+        slot = &q->slots[tail & q->mask];
+        intptr_t diff = (intptr_t)__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - (intptr_t)tail;
+        if (diff == 0) {
+            if (q->flags & QUEUE_SINGLE_PRODUCER) {
+                __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELAXED);
+                break;
+            }
+            if (__atomic_compare_exchange_n(&q->tail, &tail, tail + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+        } else if (diff < 0) {
+            return false;
+        } else {
+            tail = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+        }
+    }
+    slot->request = r;
+    // Counted before the request can be popped, so bytes never runs below zero
+    if (q->limits.bytes) __atomic_add_fetch(&q->bytes, r->length, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&slot->sequence, tail + 1, __ATOMIC_RELEASE);
+    queue_wake(&q->pushed, &q->poppers_asleep);
+    if (q->limits.watermark && !__atomic_load_n(&q->high, __ATOMIC_RELAXED)) queue_mark(q, true);
+    return true;
+}
+
+/**
+ * Push request to the back of queue within its limits, doing what its
+ * policy says once they are reached: wait for room, refuse the request, or
+ * discard requests from the front until it fits.  A request is let in
+ * while the queue is below its limits, so one larger than the byte limit
+ * still gets through on its own.
+ * @param   q       Queue structure.
+ * @param   r       Request structure.
+ * @return  Whether or not the request was pushed (if not, errno is EAGAIN
+ *          and the request still belongs to the caller).
+ */
+bool queue_offer(Queue *q, Request *r) {
+    while (!queue_try_offer(q, r)) {
+        if (q->limits.policy != QUEUE_BLOCK) return false;
+        queue_wait(q, &q->popped, &q->pushers_asleep, true, NULL);
     }
-    else {
-        // Set the current tails next pointer to r
-        q->tail->next = r;
-        q->tail = r;
-        q->size++;
+    return true;
+}
+
+/**
+ * Push request to the back of queue within its limits, without waiting
+ * (see queue_offer).
+ * @param   q       Queue structure.
+ * @param   r       Request structure.
+ * @return  Whether or not the request was pushed (if not, errno is EAGAIN,
+ *          meaning wait for room under QUEUE_BLOCK and give up otherwise).
+ */
+bool queue_try_offer(Queue *q, Request *r) {
+    for (;;) {
+        if (queue_within(q) && queue_try_push(q, r)) return true;
+        if (q->limits.policy != QUEUE_DROP_OLDEST) break;
+        Request *oldest = queue_try_pop(q);
+        if (!oldest) continue;
+        request_delete(oldest);
+        __atomic_add_fetch(&q->dropped, 1, __ATOMIC_RELAXED);
     }
-    sem_post(&q->lock);
-    sem_post(&q->produced);
+    if (q->limits.policy == QUEUE_FAIL) __atomic_add_fetch(&q->dropped, 1, __ATOMIC_RELAXED);
+    errno = EAGAIN;
+    return false;
 }
 
 /**
@@ -65,13 +182,251 @@ void queue_push(Queue *q, Request *r) {
  * @return  Request structure.
  */
 Request * queue_pop(Queue *q) {
-    sem_wait(&q->produced);
-    sem_wait(&q->lock);
-    Request *curr_request = q->head; 
-        q->head = q->head->next;
-        q->size--;
-    sem_post(&q->lock);
-    return curr_request;
+    Request *r;
+    while (!(r = queue_try_pop(q))) queue_wait(q, &q->pushed, &q->poppers_asleep, false, NULL);
+    return r;
+}
+
+/**
+ * Pop request from the front of queue, waiting at most timeout microseconds
+ * for one to arrive.
+ * @param   q       Queue structure.
+ * @param   timeout Microseconds to wait (0 to return immediately).
+ * @return  Request structure, or NULL if the queue stayed empty.
+ */
+Request * queue_pop_timed(Queue *q, long timeout) {
+    Request *r;
+    struct timespec deadline;
+    if ((r = queue_try_pop(q)) || timeout <= 0) return r;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec  += timeout / 1000000;
+    deadline.tv_nsec += (timeout % 1000000) * 1000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    while (!(r = queue_try_pop(q))) {
+        if (!queue_wait(q, &q->pushed, &q->poppers_asleep, false, &deadline)) return queue_try_pop(q);
+    }
+    return r;
+}
+
+/**
+ * Pop request from the front of queue if there is one.
+ * @param   q       Queue structure.
+ * @return  Request structure, or NULL if the queue is empty.
+ */
+Request * queue_try_pop(Queue *q) {
+    size_t head = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    QueueSlot *slot;
+    for (;;) {
+        slot = &q->slots[head & q->mask];
+        intptr_t diff = (intptr_t)__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - (intptr_t)(head + 1);
+        if (diff == 0) {
+            if (q->flags & QUEUE_SINGLE_CONSUMER) {
+                __atomic_store_n(&q->head, head + 1, __ATOMIC_RELAXED);
+                break;
+            }
+            if (__atomic_compare_exchange_n(&q->head, &head, head + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+        } else if (diff < 0) {
+            return NULL;
+        } else {
+            head = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+        }
+    }
+    Request *r = slot->request;
+    __atomic_store_n(&slot->sequence, head + q->mask + 1, __ATOMIC_RELEASE);
+    if (q->limits.bytes) __atomic_sub_fetch(&q->bytes, r->length, __ATOMIC_SEQ_CST);
+    queue_wake(&q->popped, &q->pushers_asleep);
+    if (q->limits.watermark && __atomic_load_n(&q->high, __ATOMIC_RELAXED)) queue_mark(q, false);
+    return r;
+}
+
+/**
+ * Pop as many requests as are ready (up to max) from the front of queue,
+ * claiming the whole run of slots with one update of the head.
+ * @param   q           Queue structure.
+ * @param   requests    Where to store requests (in queue order).
+ * @param   max         Most requests to pop.
+ * @return  Number of requests popped (0 if the queue is empty).
+ */
+size_t queue_try_pop_many(Queue *q, Request **requests, size_t max) {
+    size_t head = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    size_t count;
+    for (;;) {
+        // Count the filled slots from head on (their sequences only change once popped)
+        for (count = 0; count < max; count++) {
+            QueueSlot *slot = &q->slots[(head + count) & q->mask];
+            if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != head + count + 1) break;
+        }
+        if (!count) {
+            intptr_t diff = (intptr_t)__atomic_load_n(&q->slots[head & q->mask].sequence, __ATOMIC_ACQUIRE) - (intptr_t)(head + 1);
+            if (diff < 0) return 0;
+            head = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+            continue;
+        }
+        if (q->flags & QUEUE_SINGLE_CONSUMER) {
+            __atomic_store_n(&q->head, head + count, __ATOMIC_RELAXED);
+            break;
+        }
+        if (__atomic_compare_exchange_n(&q->head, &head, head + count, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+    }
+    size_t bytes = 0;
+    for (size_t i = 0; i < count; i++) {
+        QueueSlot *slot = &q->slots[(head + i) & q->mask];
+        requests[i] = slot->request;
+        bytes += requests[i]->length;
+        __atomic_store_n(&slot->sequence, head + i + q->mask + 1, __ATOMIC_RELEASE);
+    }
+    if (q->limits.bytes) __atomic_sub_fetch(&q->bytes, bytes, __ATOMIC_SEQ_CST);
+    queue_wake(&q->popped, &q->pushers_asleep);
+    if (q->limits.watermark && __atomic_load_n(&q->high, __ATOMIC_RELAXED)) queue_mark(q, false);
+    return count;
+}
+
+/**
+ * Returns number of requests in queue (a moment ago, if it is in use).
+ * @param   q           Queue structure.
+ */
+size_t queue_depth(Queue *q) {
+    // Head is read first, so the tail read after it can only be further along
+    size_t head = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    return __atomic_load_n(&q->tail, __ATOMIC_RELAXED) - head;
+}
+
+/* Internal Functions */
+
+/**
+ * Sleep on futex until the other side of the queue makes progress.  The
+ * asleep flag is raised before the ring is checked one last time, so a
+ * push or pop that lands in between is either seen here or sees the flag
+ * and bumps the futex.
+ * @param   q           Queue structure.
+ * @param   futex       Futex word to sleep on.
+ * @param   asleep      Flag telling the other side someone sleeps on futex.
+ * @param   pushing     Whether we wait for room (true) or for a request (false).
+ * @param   deadline    CLOCK_MONOTONIC time to give up at (NULL to wait forever).
+ * @return  Whether or not deadline had not yet passed.
+ */
+bool queue_wait(Queue *q, uint32_t *futex, uint32_t *asleep, bool pushing, const struct timespec *deadline) {
+    struct timespec now, remaining, *timeout = NULL;
+    if (deadline) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        remaining.tv_sec  = deadline->tv_sec - now.tv_sec;
+        remaining.tv_nsec = deadline->tv_nsec - now.tv_nsec;
+        if (remaining.tv_nsec < 0) {
+            remaining.tv_sec--;
+            remaining.tv_nsec += 1000000000;
+        }
+        if (remaining.tv_sec < 0) return false;
+        timeout = &remaining;
+    }
+
+    __atomic_store_n(asleep, 1, __ATOMIC_SEQ_CST);
+    uint32_t epoch = __atomic_load_n(futex, __ATOMIC_SEQ_CST);
+    if (!queue_ready(q, pushing)) {
+        syscall(SYS_futex, futex, FUTEX_WAIT_PRIVATE, epoch, timeout, NULL, 0);
+    }
+    return true;
+}
+
+/**
+ * Wake every thread sleeping on futex.  Clearing the flag means only the
+ * first push or pop after someone fell asleep pays for the system call.
+ * @param   futex       Futex word to bump.
+ * @param   asleep      Flag telling us someone sleeps on futex.
+ */
+void queue_wake(uint32_t *futex, uint32_t *asleep) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(asleep, __ATOMIC_RELAXED) && __atomic_exchange_n(asleep, 0, __ATOMIC_SEQ_CST)) {
+        __atomic_add_fetch(futex, 1, __ATOMIC_SEQ_CST);
+        syscall(SYS_futex, futex, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+    }
+}
+
+/**
+ * Returns whether or not the slot at the front (for poppers) or back (for
+ * pushers) of the ring is ready (and for pushers, whether the queue is
+ * below its limits).
+ * @param   q           Queue structure.
+ * @param   pushing     Whether to check for room (true) or a request (false).
+ */
+bool queue_ready(Queue *q, bool pushing) {
+    size_t ticket = __atomic_load_n(pushing ? &q->tail : &q->head, __ATOMIC_SEQ_CST);
+    size_t sequence = __atomic_load_n(&q->slots[ticket & q->mask].sequence, __ATOMIC_SEQ_CST);
+    if (pushing && !queue_within(q)) return false;
+    return sequence == (pushing ? ticket : ticket + 1);
+}
+
+/**
+ * Returns whether or not queue is below both its count and byte limits.
+ * @param   q           Queue structure.
+ */
+bool queue_within(Queue *q) {
+    if (q->limits.bytes && __atomic_load_n(&q->bytes, __ATOMIC_SEQ_CST) >= q->limits.bytes) return false;
+    if (!q->limits.count) return true;
+    // Head is read first, so the tail read after it can only be further along
+    size_t head = __atomic_load_n(&q->head, __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&q->tail, __ATOMIC_SEQ_CST) - head < q->limits.count;
+}
+
+/**
+ * Returns how full queue is, in percent of whichever limit it is closest to.
+ * @param   q           Queue structure.
+ */
+int queue_fill(Queue *q) {
+    size_t count = queue_depth(q);
+    size_t limit = q->limits.count ? q->limits.count : q->mask + 1;
+    int fill = count * 100 / limit;
+    if (q->limits.bytes) {
+        int bytes = __atomic_load_n(&q->bytes, __ATOMIC_RELAXED) * 100 / q->limits.bytes;
+        if (bytes > fill) fill = bytes;
+    }
+    return fill;
+}
+
+/**
+ * Call watermark if queue just crossed its high mark (going up) or its low
+ * mark (going down).  Only the thread that flips the flag makes the call,
+ * so each crossing is reported once and high and low alternate.
+ * @param   q           Queue structure.
+ * @param   high        Whether to check the high mark (true) or the low one.
+ */
+void queue_mark(Queue *q, bool high) {
+    int fill = queue_fill(q);
+    if (high ? fill < q->limits.high : fill > q->limits.low) return;
+    if (__atomic_exchange_n(&q->high, high, __ATOMIC_ACQ_REL) == high) return;
+    q->limits.watermark(q, high, q->limits.arg);
+}
+
+/**
+ * Move requests in queue to a larger ring.  Only safe while no other thread
+ * uses the queue.
+ * @param   q           Queue structure.
+ * @param   capacity    Number of requests ring must hold (rounded up to a
+ *                      power of two).
+ * @return  Whether or not the ring was grown.
+ */
+bool queue_grow(Queue *q, size_t capacity) {
+    QueueSlot *slots;
+    size_t size  = 2;
+    size_t count = q->tail - q->head;
+    while (size < capacity) size <<= 1;
+    if (posix_memalign((void **)&slots, CACHE_LINE, size * sizeof(QueueSlot))) {
+        fprintf(stderr, "Unable to grow queue to %zu slots: %s\n", size, strerror(errno));
+        return false;
+    }
+    for (size_t i = 0; i < size; i++) {
+        slots[i].request  = i < count ? q->slots[(q->head + i) & q->mask].request : NULL;
+        slots[i].sequence = i < count ? i + 1 : i;
+    }
+    free(q->slots);
+    q->slots = slots;
+    q->mask  = size - 1;
+    q->head  = 0;
+    q->tail  = count;
+    return true;
 }
 
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
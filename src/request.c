@@ -2,63 +2,201 @@
 
 #include "mq/request.h"
 
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 
+/* Internal Constants */
+
+#define REQUEST_SIZE    (sizeof(Request) + REQUEST_DATA)
+
+/**
+ * Create pool of Request structures.  Requests whose body and uri fit in
+ * REQUEST_DATA bytes are carved from slabs and recycled, so a steady
+ * stream of messages needs no calls to malloc.
+ * @return  Newly allocated RequestPool structure.
+ */
+RequestPool * request_pool_create() {
+    RequestPool *pool = calloc(1, sizeof(RequestPool));
+    if (pool) mutex_init(&pool->lock, NULL);
+    return pool;
+}
+
+/**
+ * Delete RequestPool structure (and every slab it carved requests from).
+ * @param   pool        RequestPool structure.
+ */
+void request_pool_delete(RequestPool *pool) {
+    RequestSlab *slab = pool->slabs;
+    while (slab) {
+        RequestSlab *next = slab->next;
+        free(slab);
+        slab = next;
+    }
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
 /**
  * Create Request structure.
- * @param   method      Request method string.
+ * @param   pool        Pool to take request from (NULL to malloc it).
+ * @param   method      Request method.
  * @param   uri         Request uri string.
  * @param   body        Request body string.
  * @return  Newly allocated Request structure.
  */
-Request * request_create(const char *method, const char *uri, const char *body) {
-    Request *request;
-    // Allocate the request on the heap
-    if (!(request = malloc(sizeof(Request)))) fprintf(stderr, "malloc: %s\n", strerror(errno));
-    // Allocate the request's method and handle errors
-    if (method && !(request->method = strdup(method))) goto FAILURE;
-    if (uri && !(request->uri = strdup(uri))) goto FAILURE;
-    request->body = NULL;
-    if (body && !(request->body = strdup(body))) goto FAILURE;
-
-    request->next = NULL;
+Request * request_create(RequestPool *pool, Method method, const char *uri, const char *body) {
+    size_t length = body ? strlen(body) : 0;
+    Request *request = request_reserve(pool, method, uri, length);
+    if (!request) return NULL;
+    if (body) memcpy(request->body, body, length);
+    else request->body = NULL;
+    return request;
+}
+
+/**
+ * Create Request structure with room for a body of length bytes (plus a
+ * terminating NUL) for the caller to fill in.
+ * @param   pool        Pool to take request from (NULL to malloc it).
+ * @param   method      Request method.
+ * @param   uri         Request uri string.
+ * @param   length      Length of body.
+ * @return  Newly allocated Request structure.
+ */
+Request * request_reserve(RequestPool *pool, Method method, const char *uri, size_t length) {
+    Request *request = NULL;
+    size_t   needed  = length + 1 + (uri ? strlen(uri) + 1 : 0);
+
+    if (pool && needed <= REQUEST_DATA) {
+        mutex_lock(&pool->lock);
+        if (!pool->free) {
+            // Carve a new slab into requests
+            RequestSlab *slab = malloc(sizeof(RequestSlab) + REQUEST_SLAB * REQUEST_SIZE);
+            if (slab) {
+                slab->next  = pool->slabs;
+                pool->slabs = slab;
+                __atomic_add_fetch(&pool->mallocs, 1, __ATOMIC_RELAXED);
+                for (size_t i = 0; i < REQUEST_SLAB; i++) {
+                    Request *r = (Request *)((char *)(slab + 1) + i * REQUEST_SIZE);
+                    r->pool    = pool;
+                    r->next    = pool->free;
+                    pool->free = r;
+                }
+            }
+        }
+        if ((request = pool->free)) pool->free = request->next;
+        mutex_unlock(&pool->lock);
+    } else {
+        if ((request = malloc(sizeof(Request) + needed))) {
+            request->pool = NULL;
+            if (pool) __atomic_add_fetch(&pool->mallocs, 1, __ATOMIC_RELAXED);
+        }
+    }
+    if (!request) {
+        fprintf(stderr, "error in creating request: %s\n", strerror(errno));
+        return NULL;
+    }
+    if (pool) __atomic_add_fetch(&pool->requests, 1, __ATOMIC_RELAXED);
+
+    request->method = method;
+    request->body   = request->data;
+    request->length = length;
+    request->compressed = false;
+    request->stamp  = 0;
+    request->body[length] = 0;
+    request->uri    = NULL;
+    if (uri) request->uri = strcpy(request->data + length + 1, uri);
+    request->next   = NULL;
     return request;
+}
 
-FAILURE:
-    fprintf(stderr, "error in creating request: %s\n", strerror(errno));
-    free(request);
-    return NULL;
+/**
+ * Find Request structure that holds the given body.
+ * @param   body        Body of a Request structure.
+ * @return  Request structure.
+ */
+Request * request_from_body(char *body) {
+    return (Request *)(body - offsetof(Request, data));
 }
 
 /**
- * Delete Request structure.
+ * Delete Request structure (returning it to its pool, if any).
  * @param   r           Request structure.
  */
 void request_delete(Request *r) {
-    if (r->method) free(r->method);
-    if (r->uri) free(r->uri);
-    if (r->body) free(r->body);
-    free(r);
+    RequestPool *pool = r->pool;
+    if (!pool) {
+        free(r);
+        return;
+    }
+    mutex_lock(&pool->lock);
+    r->next    = pool->free;
+    pool->free = r;
+    mutex_unlock(&pool->lock);
 }
 
 /**
- * Write HTTP Request to stream:
+ * Format HTTP request line and headers into buffer:
  *  
  *  $METHOD $URI HTTP/1.0\r\n
- *  Content-Length: Length($BODY)\r\n
+ *  Content-Length: $LENGTH\r\n
  *  \r\n
- *  $BODY
+ *
+ * If host is given, the request is sent as HTTP/1.1 with a Host header so
+ * the server keeps the connection open for the next request.
  *      
  * @param   r           Request structure.
- * @param   fs          Socket file stream.
+ * @param   host        Host of server (NULL for one-shot HTTP/1.0).
+ * @param   length      Length of body that will follow the headers.
+ * @param   buffer      Buffer to format headers into.
+ * @param   size        Size of buffer.
+ * @return  Length of headers, or 0 if they did not fit.
+ */
+size_t request_header(Request *r, const char *host, size_t length, char *buffer, size_t size) {
+    const char *method = method_name(r->method);
+    int used;
+    if (host) used = snprintf(buffer, size, "%s %s HTTP/1.1\r\nHost: %s\r\n", method, r->uri, host);
+    else used = snprintf(buffer, size, "%s %s HTTP/1.0\r\n", method, r->uri);
+    if (used < 0 || (size_t)used >= size) return 0;
+
+    if (r->body || length) used += snprintf(buffer + used, size - used, "Content-Length: %zu\r\n\r\n", length);
+    else used += snprintf(buffer + used, size - used, "\r\n");
+    return (size_t)used < size ? (size_t)used : 0;
+}
+
+/**
+ * Describe HTTP Request as buffers ready for writev: the headers, formatted
+ * into header, followed by the body straight from the Request's memory.
+ * @param   r           Request structure.
+ * @param   host        Host of server (NULL for one-shot HTTP/1.0).
+ * @param   header      Buffer to format headers into.
+ * @param   size        Size of header buffer.
+ * @param   iov         Buffers to fill in.
+ * @return  Number of buffers filled in (0 if headers did not fit).
+ */
+int request_iovec(Request *r, const char *host, char *header, size_t size, struct iovec iov[2]) {
+    size_t length = request_header(r, host, r->body ? r->length : 0, header, size);
+    if (!length) return 0;
+    iov[0].iov_base = header;
+    iov[0].iov_len  = length;
+    if (!r->body || !r->length) return 1;
+    iov[1].iov_base = r->body;
+    iov[1].iov_len  = r->length;
+    return 2;
+}
+
+/**
+ * Returns HTTP name of request method.
+ * @param   method      Request method.
  */
-void request_write(Request *r, FILE *fs) {
-    // printf("ok writing the request of, %s, %s, %s\n", r->method, r->uri, r->body);
-    fprintf(fs, "%s %s HTTP/1.0\r\n", r->method, r->uri);
-    if (r->body) fprintf(fs, "Content-Length: %zu\r\n\r\n%s", strlen(r->body), r->body);
-    else fprintf(fs, "\r\n");
+const char * method_name(Method method) {
+    switch (method) {
+        case METHOD_GET:    return "GET";
+        case METHOD_PUT:    return "PUT";
+        case METHOD_DELETE: return "DELETE";
+    }
+    return "GET";
 }
 
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */ 
@@ -0,0 +1,454 @@
+/* response.c: HTTP Response parser */
+
+#define _GNU_SOURCE
+#include "mq/frame.h"
+#include "mq/response.h"
+#include "mq/string.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <unistd.h>
+
+/* Internal Constants */
+
+#define WOULD_BLOCK     (-2)
+
+/* Internal Prototypes */
+
+bool    response_headers(Response *r, RequestPool *pool, bool keep_body);
+bool    response_frame(Response *r, RequestPool *pool, bool keep_body);
+void    response_append(Response *r);
+char *  response_line(Response *r);
+bool    response_grow(Response *r, RequestPool *pool, size_t needed);
+bool    response_frames(Response *r, RequestPool *pool, const char *data, size_t length);
+ssize_t response_more(Response *r, int fd);
+ssize_t response_fill(Response *r, int fd);
+
+/**
+ * Initialize Response parser for a new connection (discarding anything
+ * left from the last one).  The structure must start out zeroed.
+ * @param   r           Response structure.
+ */
+void response_init(Response *r) {
+    r->start  = 0;
+    r->end    = 0;
+    r->binary = false;
+    r->compression = false;
+    response_next(r);
+}
+
+/**
+ * Prepare Response parser for the next response on the same connection,
+ * keeping any bytes of it that were already read.  The body of the
+ * previous response must have been taken (or it is discarded).
+ * @param   r           Response structure.
+ */
+void response_next(Response *r) {
+    size_t count;
+    if (r->body)  request_delete(r->body);
+    if (r->frame) request_delete(r->frame);
+    for (Request *m = response_messages(r, &count), *next; m; m = next) {
+        next = m->next;
+        request_delete(m);
+    }
+    r->state    = RESPONSE_HEADERS;
+    r->status   = 0;
+    r->keep     = false;
+    r->chunked  = false;
+    r->length   = 0;
+    r->received = 0;
+    r->total    = 0;
+    r->body     = NULL;
+    r->stream   = false;
+    r->frame    = NULL;
+    r->frame_length = 0;
+}
+
+/**
+ * Read and parse as much of a response as the socket has to offer.
+ * Content-Length, chunked, and close-delimited bodies are understood.
+ * Large bodies are read straight into a pooled Request rather than
+ * through the header buffer.
+ *
+ * If stream is set and the status is 200, the body is instead a stream of
+ * messages each framed as:
+ *
+ *  $LENGTH\n
+ *  $BODY
+ *
+ * and every message is split off into its own Request as soon as it is
+ * complete.  Rather than wait for more of the stream, this returns 0 once
+ * there are messages for response_messages to hand over.
+ *
+ * Once binary is set the connection carries frames instead (see frame.h):
+ * OP_MESSAGE frames are collected the same way as stream messages (still
+ * compressed if they arrived that way), and an OP_STATUS frame is a
+ * complete response whose status is its argument.
+ * @param   r           Response structure.
+ * @param   fd          Socket file descriptor (blocking or not).
+ * @param   pool        Pool to take Request holding body from.
+ * @param   keep_body   Whether to keep body (otherwise it is discarded).
+ * @return  1 if response is complete, 0 if the socket would block, or -1
+ *          on error or end of stream.
+ */
+int response_read(Response *r, int fd, RequestPool *pool, bool keep_body) {
+    ssize_t n = 1;
+    char *line;
+
+    for (;;) {
+        if (n == WOULD_BLOCK) return 0;
+        if (n <= 0) return -1;
+
+        switch (r->state) {
+            case RESPONSE_HEADERS:
+                if (r->binary ? !response_frame(r, pool, keep_body) : !response_headers(r, pool, keep_body)) {
+                    // Headers must fit in buffer
+                    if (r->start == 0 && r->end == RESPONSE_BUFFER) return -1;
+                    n = response_more(r, fd);
+                } else if (r->status < 0) {
+                    return -1;
+                }
+                break;
+
+            case RESPONSE_CHUNK_SIZE:
+                if (!(line = response_line(r))) {
+                    n = response_more(r, fd);
+                    break;
+                }
+                r->length   = strtoul(line, NULL, 16);
+                r->received = 0;
+                r->state    = r->length ? RESPONSE_BODY : RESPONSE_TRAILER;
+                if (keep_body && !response_grow(r, pool, r->total + r->length)) return -1;
+                break;
+
+            case RESPONSE_BODY: {
+                size_t wanted    = r->length - r->received;
+                size_t available = r->end - r->start;
+                size_t chunk     = wanted < available ? wanted : available;
+                if (chunk) {
+                    if (r->body) memcpy(r->body->body + r->total, r->buffer + r->start, chunk);
+                    else if (r->stream && !response_frames(r, pool, r->buffer + r->start, chunk)) return -1;
+                    r->start    += chunk;
+                    r->received += chunk;
+                    r->total    += chunk;
+                    wanted      -= chunk;
+                }
+                if (!wanted) {
+                    r->state = r->chunked ? RESPONSE_CHUNK_END : RESPONSE_DONE;
+                } else if (r->body && wanted >= RESPONSE_BUFFER / 2) {
+                    // Big remainders skip the buffer and land in the body itself
+                    while ((n = read(fd, r->body->body + r->total, wanted)) < 0 && errno == EINTR);
+                    if (n > 0) {
+                        r->received += n;
+                        r->total    += n;
+                    } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                        n = WOULD_BLOCK;
+                    }
+                } else {
+                    n = response_more(r, fd);
+                }
+                break;
+            }
+
+            case RESPONSE_CHUNK_END:
+                if (r->end - r->start < 2) {
+                    n = response_more(r, fd);
+                    break;
+                }
+                r->start += 2;
+                r->state  = RESPONSE_CHUNK_SIZE;
+                break;
+
+            case RESPONSE_UNTIL_CLOSE: {
+                // Without a length the body runs until the server closes
+                size_t available = r->end - r->start;
+                if (available && r->body) {
+                    if (!response_grow(r, pool, r->total + available)) return -1;
+                    memcpy(r->body->body + r->total, r->buffer + r->start, available);
+                } else if (available && r->stream && !response_frames(r, pool, r->buffer + r->start, available)) {
+                    return -1;
+                }
+                r->start += available;
+                r->total += available;
+                if ((n = response_more(r, fd)) == 0) {
+                    r->keep  = false;
+                    r->state = RESPONSE_DONE;
+                    n = 1;
+                }
+                break;
+            }
+
+            case RESPONSE_MESSAGE: {
+                size_t wanted    = r->frame_length - r->frame_received;
+                size_t available = r->end - r->start;
+                size_t chunk     = wanted < available ? wanted : available;
+                memcpy(r->frame->body + r->frame_received, r->buffer + r->start, chunk);
+                r->start          += chunk;
+                r->frame_received += chunk;
+                if (r->frame_received == r->frame_length) {
+                    response_append(r);
+                    r->state = RESPONSE_HEADERS;
+                } else {
+                    n = response_more(r, fd);
+                }
+                break;
+            }
+
+            case RESPONSE_TRAILER:
+                if (!(line = response_line(r))) {
+                    n = response_more(r, fd);
+                    break;
+                }
+                if (!*line) r->state = RESPONSE_DONE;
+                break;
+
+            case RESPONSE_DONE:
+                if (r->body) {
+                    r->body->length = r->total;
+                    r->body->body[r->total] = 0;
+                }
+                return 1;
+        }
+    }
+}
+
+/**
+ * Take the messages read from a stream so far.
+ * @param   r           Response structure.
+ * @param   count       Set to number of messages.
+ * @return  First message (the rest follow through next), or NULL if none.
+ */
+Request * response_messages(Response *r, size_t *count) {
+    Request *messages = r->messages;
+    *count      = r->count;
+    r->messages = NULL;
+    r->last     = NULL;
+    r->count    = 0;
+    return messages;
+}
+
+/* Internal Functions */
+
+/**
+ * Parse status line and headers if all of them have been buffered:
+ *
+ *  HTTP/1.1 $STATUS $REASON\r\n
+ *  Content-Length: $LENGTH\r\n      (or)
+ *  Transfer-Encoding: chunked\r\n   (or neither, ending at close)
+ *  Connection: close\r\n
+ *  \r\n
+ *
+ * @param   r           Response structure.
+ * @param   pool        Pool to take Request holding body from.
+ * @param   keep_body   Whether to keep body.
+ * @return  Whether or not the headers were parsed (status is -1 if they
+ *          were malformed).
+ */
+bool response_headers(Response *r, RequestPool *pool, bool keep_body) {
+    char *head = r->buffer + r->start;
+    char *stop = memmem(head, r->end - r->start, "\r\n\r\n", 4);
+    if (!stop) return false;
+    stop[2] = 0;
+
+    if (sscanf(head, "HTTP/1.%*d %d", &r->status) != 1) r->status = -1;
+    r->keep = !strncmp(head, "HTTP/1.1", 8);
+
+    bool has_length = false;
+    for (char *line = strstr(head, "\r\n"); line && line[2]; line = strstr(line, "\r\n")) {
+        line += 2;
+        if (!strncasecmp(line, "Content-Length:", 15)) {
+            has_length = sscanf(line + 15, "%zu", &r->length) == 1;
+        } else if (!strncasecmp(line, "Transfer-Encoding:", 18)) {
+            r->chunked = strstr(line + 18, "chunked") != NULL;
+        } else if (!strncasecmp(line, "Connection:", 11)) {
+            char *value = line + 11;
+            while (*value == ' ') value++;
+            if (!strncasecmp(value, "close", 5)) r->keep = false;
+            if (!strncasecmp(value, "keep-alive", 10)) r->keep = true;
+        } else if (!strncasecmp(line, FRAME_COMPRESSION ":", sizeof(FRAME_COMPRESSION))) {
+            r->compression = strstr(line + sizeof(FRAME_COMPRESSION), "zlib") != NULL;
+        }
+    }
+
+    r->start = (stop + 4) - r->buffer;
+    if (r->status != 200) r->stream = false;
+    if (r->chunked) {
+        r->length = 0;
+        r->state  = RESPONSE_CHUNK_SIZE;
+    } else if (!has_length && r->status >= 200 && r->status != 204 && r->status != 304) {
+        r->length = 0;
+        r->state  = RESPONSE_UNTIL_CLOSE;
+    } else {
+        r->state  = RESPONSE_BODY;
+    }
+    if (keep_body && !response_grow(r, pool, r->length)) r->status = -1;
+    return true;
+}
+
+/**
+ * Parse frame header if all of it has been buffered.  A message frame is
+ * read into a Request of its own (see response_append), while a status
+ * frame is treated like the headers of a response with a body of the
+ * frame's length.
+ * @param   r           Response structure.
+ * @param   pool        Pool to take Requests from.
+ * @param   keep_body   Whether to keep body of a status frame.
+ * @return  Whether or not the header was parsed (status is -1 if it was
+ *          malformed).
+ */
+bool response_frame(Response *r, RequestPool *pool, bool keep_body) {
+    Opcode   opcode;
+    uint32_t argument;
+    size_t   length;
+    if (r->end - r->start < FRAME_HEADER) return false;
+    frame_parse(r->buffer + r->start, &opcode, &argument, &length);
+    r->start += FRAME_HEADER;
+
+    switch (opcode & ~FRAME_COMPRESSED) {
+        case OP_MESSAGE:
+            if (!(r->frame = request_reserve(pool, METHOD_PUT, NULL, length))) {
+                r->status = -1;
+                break;
+            }
+            // Compressed messages are only inflated once they are retrieved
+            r->frame->compressed = opcode & FRAME_COMPRESSED;
+            r->frame_length   = length;
+            r->frame_received = 0;
+            r->state = RESPONSE_MESSAGE;
+            break;
+        case OP_STATUS:
+            r->status = argument;
+            r->keep   = true;
+            r->length = length;
+            r->state  = RESPONSE_BODY;
+            if (keep_body && !response_grow(r, pool, length)) r->status = -1;
+            break;
+        default:
+            r->status = -1;
+    }
+    return true;
+}
+
+/**
+ * Take one CRLF terminated line from buffer (if a whole one is there).
+ * @param   r           Response structure.
+ * @return  Line without its CRLF, or NULL if none is buffered yet.
+ */
+char * response_line(Response *r) {
+    char *line = r->buffer + r->start;
+    char *stop = memmem(line, r->end - r->start, "\r\n", 2);
+    if (!stop) return NULL;
+    *stop    = 0;
+    r->start = (stop + 2) - r->buffer;
+    return line;
+}
+
+/**
+ * Make sure Request holding body has room for needed bytes.  Chunked
+ * bodies arrive without a total length, so the Request is replaced by one
+ * twice as large whenever it fills up.
+ * @param   r           Response structure.
+ * @param   pool        Pool to take Request holding body from.
+ * @param   needed      Bytes of body Request must hold.
+ * @return  Whether or not the Request is large enough.
+ */
+bool response_grow(Response *r, RequestPool *pool, size_t needed) {
+    if (r->body && r->body->length >= needed) return true;
+    size_t length = r->body ? r->body->length * 2 : needed;
+    if (length < needed) length = needed;
+
+    Request *body = request_reserve(pool, METHOD_PUT, NULL, length);
+    if (!body) return false;
+    if (r->body) {
+        memcpy(body->body, r->body->body, r->total);
+        request_delete(r->body);
+    }
+    r->body = body;
+    return true;
+}
+
+/**
+ * Split stream body bytes into messages.
+ * @param   r           Response structure.
+ * @param   pool        Pool to take Requests holding messages from.
+ * @param   data        Bytes of stream body.
+ * @param   length      Number of bytes.
+ * @return  Whether or not the bytes were well framed.
+ */
+bool response_frames(Response *r, RequestPool *pool, const char *data, size_t length) {
+    while (length > 0) {
+        if (!r->frame) {
+            // Frame header is the decimal length followed by a newline
+            char c = *data++;
+            length--;
+            if (c == '\n') {
+                if (!(r->frame = request_reserve(pool, METHOD_PUT, NULL, r->frame_length))) return false;
+                r->frame_received = 0;
+            } else if (isdigit(c)) {
+                r->frame_length = r->frame_length * 10 + (c - '0');
+            } else {
+                return false;
+            }
+        } else {
+            size_t wanted = r->frame_length - r->frame_received;
+            size_t chunk  = wanted < length ? wanted : length;
+            memcpy(r->frame->body + r->frame_received, data, chunk);
+            r->frame_received += chunk;
+            data   += chunk;
+            length -= chunk;
+        }
+        if (r->frame && r->frame_received == r->frame_length) response_append(r);
+    }
+    return true;
+}
+
+/**
+ * Add the message just read to those response_messages hands over.
+ * @param   r           Response structure.
+ */
+void response_append(Response *r) {
+    r->frame->next = NULL;
+    if (r->last) r->last->next = r->frame;
+    else r->messages = r->frame;
+    r->last  = r->frame;
+    r->count++;
+    r->frame = NULL;
+    r->frame_length = 0;
+}
+
+/**
+ * Read more bytes from socket, unless there are stream messages to hand
+ * over first.
+ * @param   r           Response structure.
+ * @param   fd          Socket file descriptor.
+ * @return  Same as response_fill.
+ */
+ssize_t response_more(Response *r, int fd) {
+    if (r->messages) return WOULD_BLOCK;
+    return response_fill(r, fd);
+}
+
+/**
+ * Read more bytes from socket into buffer (making room first if needed).
+ * @param   r           Response structure.
+ * @param   fd          Socket file descriptor.
+ * @return  Bytes read, 0 on end of stream, WOULD_BLOCK, or -1 on error.
+ */
+ssize_t response_fill(Response *r, int fd) {
+    if (r->start == r->end) {
+        r->start = r->end = 0;
+    } else if (r->start > 0) {
+        memmove(r->buffer, r->buffer + r->start, r->end - r->start);
+        r->end  -= r->start;
+        r->start = 0;
+    }
+    ssize_t n;
+    while ((n = read(fd, r->buffer + r->end, RESPONSE_BUFFER - r->end)) < 0 && errno == EINTR);
+    if (n > 0) r->end += n;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return WOULD_BLOCK;
+    return n;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
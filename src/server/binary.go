@@ -0,0 +1,274 @@
+package main
+
+import (
+	"bufio"
+	"encoding/binary"
+	"fmt"
+	"io"
+	"net/http"
+	"net/url"
+	"strings"
+
+	"github.com/gin-gonic/gin"
+)
+
+// Name of the binary protocol in the Upgrade header
+const binaryProtocol = "mq-binary"
+
+// Bytes of frame header: a 32 bit payload length, then an 8 bit opcode and
+// a 24 bit argument (all in network order)
+const frameHeader = 8
+
+// Largest frame argument (and topic ID)
+const frameArgument = 0xFFFFFF
+
+// Frames read ahead of the one being handled
+const frameBacklog = 64
+
+// Largest frame payload read (the length comes from the client, so it is
+// held to what a compressed payload may inflate to)
+const maxFrame = maxInflated
+
+// Opcode flag marking a compressed payload
+const frameCompressed = 0x80
+
+// Frame opcodes (the same as in the C client's frame.h)
+const (
+	opTopic       = iota + 1 // Name topic ID (argument) as payload for this connection
+	opPublish                // Publish payload to topic ID (argument)
+	opSubscribe              // Subscribe connection's queue to topic ID (argument), with options as in the HTTP query (payload)
+	opUnsubscribe            // Unsubscribe connection's queue from topic ID (argument)
+	opFetch                  // Send messages from connection's queue (argument is most to send, 0 for no limit)
+	opMessage                // Message (payload) from connection's queue
+	opStatus                 // Answer to publish, subscribe, unsubscribe, or the end of a fetch (argument is status)
+	opBatch                  // Frames (payload) to handle in turn
+)
+
+type frame struct {
+	opcode   byte
+	argument uint32
+	payload  []byte
+}
+
+// One connection switched over to binary frames on behalf of a queue
+type binarySession struct {
+	queueName string
+	capacity  int
+	policy    overflowPolicy
+	topics    map[uint32]string // Topic IDs named by the client
+	writer    *bufio.Writer
+	compress  bool // Whether the client takes compressed messages as they were published
+
+	fetching bool   // Whether messages are being sent
+	left     uint32 // Messages left to send (0 for no limit)
+	queue    *queue // Queue being fetched from
+	kicked   <-chan struct{}
+}
+
+// Binary Handler switches the connection to binary frames
+func binaryHandler(c *gin.Context) {
+	queueName := c.Param("id")
+	if !strings.EqualFold(c.GetHeader("Upgrade"), binaryProtocol) {
+		c.String(400, fmt.Sprintf("Expected Upgrade: %s", binaryProtocol))
+		return
+	}
+	capacity, policy, err := queueOptions(c)
+	if err != nil {
+		c.String(400, err.Error())
+		return
+	}
+	hijacker, ok := c.Writer.(http.Hijacker)
+	if !ok {
+		c.String(500, "Connection cannot be upgraded")
+		return
+	}
+	conn, rw, err := hijacker.Hijack()
+	if err != nil {
+		return
+	}
+	defer conn.Close()
+	// Compressed payloads are accepted (and passed on) if the client offers them
+	compress := strings.Contains(c.GetHeader(compressionHeader), compressionName)
+	accepted := ""
+	if compress {
+		accepted = fmt.Sprintf("%s: %s\r\n", compressionHeader, compressionName)
+	}
+	rw.WriteString(fmt.Sprintf("HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: %s\r\n%s\r\n", binaryProtocol, accepted))
+	if rw.Flush() != nil {
+		return
+	}
+	session := &binarySession{
+		queueName: queueName,
+		capacity:  capacity,
+		policy:    policy,
+		topics:    make(map[uint32]string),
+		writer:    rw.Writer,
+		compress:  compress,
+	}
+	session.serve(rw.Reader)
+}
+
+// Read frames from the client until the connection breaks (or a frame is
+// too long, which closes it)
+func readFrames(reader *bufio.Reader, frames chan<- frame) {
+	defer close(frames)
+	header := make([]byte, frameHeader)
+	for {
+		if _, err := io.ReadFull(reader, header); err != nil {
+			return
+		}
+		length := binary.BigEndian.Uint32(header[:4])
+		if length > maxFrame {
+			return
+		}
+		word := binary.BigEndian.Uint32(header[4:])
+		f := frame{opcode: byte(word >> 24), argument: word & frameArgument}
+		f.payload = make([]byte, length)
+		if _, err := io.ReadFull(reader, f.payload); err != nil {
+			return
+		}
+		frames <- f
+	}
+}
+
+// Handle frames from the client, and send messages while it is fetching
+func (s *binarySession) serve(reader *bufio.Reader) {
+	frames := make(chan frame, frameBacklog)
+	go readFrames(reader, frames)
+	for {
+		// Only a fetching connection waits on its queue
+		var messages <-chan envelope
+		if s.fetching {
+			messages = s.queue.messages
+		}
+		select {
+		case f, ok := <-frames:
+			if !ok || !s.handle(f) {
+				return
+			}
+		case message := <-messages:
+			s.deliver(message)
+			// Send whatever else is already waiting along with it
+			for waiting := s.fetching; waiting; {
+				select {
+				case message := <-messages:
+					waiting = s.deliver(message)
+				default:
+					waiting = false
+				}
+			}
+		case <-s.kicked:
+			// The queue overflowed under the disconnect policy
+			s.fetching = false
+			s.kicked = nil
+			s.write(opStatus, 204, nil)
+		}
+		// Answers to frames that are already in are sent along with theirs
+		if len(frames) == 0 && s.writer.Flush() != nil {
+			return
+		}
+	}
+}
+
+// Handle one frame from the client, reporting whether the connection is still good
+func (s *binarySession) handle(f frame) bool {
+	topic, named := s.topics[f.argument]
+	compressed := f.opcode&frameCompressed != 0
+	switch f.opcode &^ frameCompressed {
+	case opTopic:
+		s.topics[f.argument] = string(f.payload)
+		return true
+	case opPublish:
+		if named && publish(topic, envelope{string(f.payload), compressed}, s.queueName) > 0 {
+			return s.write(opStatus, 200, nil)
+		}
+		return s.write(opStatus, 404, nil)
+	case opSubscribe:
+		// Options come as the payload, in the same form as the HTTP query
+		options, err := url.ParseQuery(string(f.payload))
+		if err != nil {
+			return s.write(opStatus, 400, nil)
+		}
+		noLocal, err := parseNoLocal(options.Get("nolocal"))
+		if err != nil {
+			return s.write(opStatus, 400, nil)
+		}
+		if named && subscribe(s.queueName, topic, s.capacity, s.policy, noLocal) {
+			return s.write(opStatus, 200, nil)
+		}
+		return s.write(opStatus, 404, nil)
+	case opUnsubscribe:
+		if _, subscribed := unsubscribe(s.queueName, topic); named && subscribed {
+			return s.write(opStatus, 200, nil)
+		}
+		return s.write(opStatus, 404, nil)
+	case opFetch:
+		s.queue = ensureQueue(s.queueName, s.capacity, s.policy)
+		s.kicked = s.queue.kicks()
+		s.fetching = true
+		s.left = f.argument
+		return true
+	case opBatch:
+		return s.batch(f.payload, compressed)
+	}
+	return s.write(opStatus, 400, nil)
+}
+
+// Handle the frames packed into a batch frame in turn
+func (s *binarySession) batch(payload []byte, compressed bool) bool {
+	if compressed {
+		inflated, err := inflate(payload)
+		if err != nil {
+			return false
+		}
+		payload = inflated
+	}
+	for len(payload) > 0 {
+		if len(payload) < frameHeader {
+			return false
+		}
+		word := binary.BigEndian.Uint32(payload[4:frameHeader])
+		length := int(binary.BigEndian.Uint32(payload[:4]))
+		if length > len(payload)-frameHeader {
+			return false
+		}
+		f := frame{opcode: byte(word >> 24), argument: word & frameArgument, payload: payload[frameHeader : frameHeader+length]}
+		if f.opcode&^frameCompressed == opBatch || !s.handle(f) {
+			return false
+		}
+		payload = payload[frameHeader+length:]
+	}
+	return true
+}
+
+// Send a message to a fetching client, reporting whether it wants more (a
+// message that will not inflate is dropped)
+func (s *binarySession) deliver(message envelope) bool {
+	if message.compressed && s.compress {
+		s.write(opMessage|frameCompressed, 0, []byte(message.body))
+	} else if body, err := message.plain(); err == nil {
+		s.write(opMessage, 0, []byte(body))
+	} else {
+		return s.fetching
+	}
+	if s.left > 0 {
+		if s.left--; s.left == 0 {
+			s.fetching = false
+			s.kicked = nil
+			s.write(opStatus, 200, nil)
+		}
+	}
+	return s.fetching
+}
+
+// Buffer one frame to the client
+func (s *binarySession) write(opcode byte, argument uint32, payload []byte) bool {
+	var header [frameHeader]byte
+	binary.BigEndian.PutUint32(header[:4], uint32(len(payload)))
+	binary.BigEndian.PutUint32(header[4:], uint32(opcode)<<24|argument&frameArgument)
+	if _, err := s.writer.Write(header[:]); err != nil {
+		return false
+	}
+	_, err := s.writer.Write(payload)
+	return err == nil
+}
@@ -0,0 +1,59 @@
+package main
+
+import (
+	"bytes"
+	"compress/zlib"
+	"encoding/binary"
+	"io"
+)
+
+// Compression clients may offer in the upgrade to binary frames
+const compressionHeader = "MQ-Compression"
+const compressionName = "zlib"
+
+// Bytes of inflated length before the zlib stream of a compressed body
+const compressPrefix = 4
+
+// Largest body a compressed payload may inflate to
+const maxInflated = 64 << 20
+
+// A message as it was published: a compressed body stays compressed until
+// a consumer that cannot take it that way needs it
+type envelope struct {
+	body       string
+	compressed bool // Whether body is its inflated length and a zlib stream
+}
+
+// Body of the message as it was before compression (an error if it will
+// not inflate, in which case the message should be dropped)
+func (e envelope) plain() (string, error) {
+	if !e.compressed {
+		return e.body, nil
+	}
+	body, err := inflate([]byte(e.body))
+	if err != nil {
+		return "", err
+	}
+	return string(body), nil
+}
+
+// Inflate a compressed payload (its inflated length followed by a zlib stream)
+func inflate(payload []byte) ([]byte, error) {
+	if len(payload) < compressPrefix {
+		return nil, io.ErrUnexpectedEOF
+	}
+	length := binary.BigEndian.Uint32(payload[:compressPrefix])
+	if length > maxInflated {
+		return nil, zlib.ErrHeader
+	}
+	reader, err := zlib.NewReader(bytes.NewReader(payload[compressPrefix:]))
+	if err != nil {
+		return nil, err
+	}
+	defer reader.Close()
+	body := make([]byte, length)
+	if _, err := io.ReadFull(reader, body); err != nil {
+		return nil, err
+	}
+	return body, nil
+}
@@ -1,40 +1,123 @@
 package main
 
 import (
+	"bufio"
+	"bytes"
 	"flag"
 	"fmt"
 	"io"
+	"net/http"
+	"strconv"
 	"time"
 
 	"github.com/gin-gonic/gin"
 )
 
-// Init data structures to hold queue and subscription info
-var queues = make(map[string]chan string)
-var subscriptions = make(map[string]map[string]struct{})
+// How long a GET /queue waits for a message unless the client says otherwise
+const defaultPollTimeout = 30 * time.Second
+
+// Longest a client may ask a GET /queue to wait
+const maxPollTimeout = 300 * time.Second
 
 // Queue Handler
 func queueHandler(c *gin.Context) {
 	queueName := c.Param("id")
 	// Check if queue is in the system
-	if _, exists := queues[queueName]; !exists {
+	queue := lookupQueue(queueName)
+	if queue == nil {
 		c.String(404, fmt.Sprintf("There is no queue named %s", queueName))
 		return
 	}
-	// Wait until a message is ready
-	func() {
-		for {
-			select {
-			// If a message is ready, send and break
-			case message := <-queues[queueName]:
-				c.String(200, message)
+	// The client may say how many seconds to wait (0 only checks)
+	timeout := defaultPollTimeout
+	if value := c.Query("timeout"); value != "" {
+		seconds, err := strconv.Atoi(value)
+		if err != nil || seconds < 0 {
+			c.String(400, fmt.Sprintf("Bad timeout %s", value))
+			return
+		}
+		timeout = time.Duration(seconds) * time.Second
+		if timeout > maxPollTimeout {
+			timeout = maxPollTimeout
+		}
+	}
+	// Block until a message is ready, the wait runs out, or the client goes away
+	timer := time.NewTimer(timeout)
+	defer timer.Stop()
+	for {
+		select {
+		case message := <-queue.messages:
+			// A message that will not inflate is dropped in favour of the next
+			body, err := message.plain()
+			if err != nil {
+				continue
+			}
+			c.String(200, body)
+		case <-timer.C:
+			c.Status(204)
+		case <-queue.kicks():
+			c.Status(204)
+		case <-c.Request.Context().Done():
+		}
+		return
+	}
+}
+
+// Stream Handler
+func streamHandler(c *gin.Context) {
+	queueName := c.Param("id")
+	// The stream may be opened before the first subscription, so make the
+	// queue here rather than answer 404 (which means streams are unsupported)
+	capacity, policy, err := queueOptions(c)
+	if err != nil {
+		c.String(400, err.Error())
+		return
+	}
+	queue := ensureQueue(queueName, capacity, policy)
+	kicked := queue.kicks()
+	// Each message is framed as "$LENGTH\n$BODY" in one long-lived response
+	c.Header("Content-Type", "application/octet-stream")
+	c.Status(200)
+	flusher, _ := c.Writer.(http.Flusher)
+	for {
+		select {
+		case message := <-queue.messages:
+			if !streamMessage(c.Writer, message) {
 				return
-			default:
-				// If there is no message, wait until one is ready
-				time.Sleep(1 * time.Second)
 			}
+			// Send whatever else is already waiting along with it
+			for waiting := true; waiting; {
+				select {
+				case message := <-queue.messages:
+					if !streamMessage(c.Writer, message) {
+						return
+					}
+				default:
+					waiting = false
+				}
+			}
+			if flusher != nil {
+				flusher.Flush()
+			}
+		case <-kicked:
+			// The queue overflowed under the disconnect policy
+			return
+		case <-c.Request.Context().Done():
+			return
 		}
-	}()
+	}
+}
+
+// Write one message to a stream, framed as "$LENGTH\n$BODY", reporting
+// whether the stream is still good (a message that will not inflate is
+// dropped)
+func streamMessage(writer io.Writer, message envelope) bool {
+	body, err := message.plain()
+	if err != nil {
+		return true
+	}
+	_, err = fmt.Fprintf(writer, "%d\n%s", len(body), body)
+	return err == nil
 }
 
 // Topic Handler
@@ -46,14 +129,7 @@ func topicHandler(c *gin.Context) {
 		c.String(404, "Bad message")
 	}
 	// Send message to anyone who is subscribed to the topic
-	subscribers := 0
-	for queue, topics := range subscriptions {
-		if _, exists := topics[topic]; exists {
-			// Send the message to the queues channel
-			queues[queue] <- string(message)
-			subscribers++
-		}
-	}
+	subscribers := publish(topic, envelope{body: string(message)}, c.Query("from"))
 	if subscribers == 0 {
 		c.String(404, fmt.Sprintf("There are no subscribers for topic %s", topic))
 	} else {
@@ -61,57 +137,161 @@ func topicHandler(c *gin.Context) {
 	}
 }
 
+// Batch Handler
+func batchHandler(c *gin.Context) {
+	// Each message in the batch is framed as "$TOPIC $LENGTH\n$BODY"
+	reader := bufio.NewReader(c.Request.Body)
+	messages, subscribers, size := 0, 0, 0
+	for {
+		header, err := reader.ReadBytes('\n')
+		if err == io.EOF && len(header) == 0 {
+			break
+		}
+		var topic string
+		var length int
+		if err != nil || bytes.Count(header, []byte(" ")) != 1 {
+			c.String(400, fmt.Sprintf("Bad batch header after %d messages", messages))
+			return
+		}
+		if _, err := fmt.Sscanf(string(header), "%s %d\n", &topic, &length); err != nil || length < 0 {
+			c.String(400, fmt.Sprintf("Bad batch header after %d messages", messages))
+			return
+		}
+		message := make([]byte, length)
+		if _, err := io.ReadFull(reader, message); err != nil {
+			c.String(400, fmt.Sprintf("Truncated batch after %d messages", messages))
+			return
+		}
+		subscribers += publish(topic, envelope{body: string(message)}, c.Query("from"))
+		size += length
+		messages++
+	}
+	c.String(200, fmt.Sprintf("Published %d messages (%d bytes) to %d subscribers", messages, size, subscribers))
+}
+
+// Send message published by the client of queue from (empty if unknown) to
+// every queue subscribed to topic and return how many there were
+func publish(topic string, message envelope, from string) int {
+	// Only the topic's own subscribers are visited, however many queues exist
+	subscribers := subscribersOf(topic)
+	for _, s := range subscribers {
+		// A no-local subscriber does not get its own messages back
+		if s.noLocal && s.name == from {
+			continue
+		}
+		// A full queue applies its overflow policy rather than hold up the publisher
+		s.queue.offer(message)
+	}
+	return len(subscribers)
+}
+
 // Subscription Handler
 func subscriptionHandler(c *gin.Context) {
 	queueName := c.Param("queue")
 	topicName := c.Param("id")
 	switch c.Request.Method {
 	case "PUT":
-		// Check if the queue name is in the system
-		if _, exists := queues[queueName]; !exists {
-			queues[queueName] = make(chan string, 100)
+		// The queue is made if it is not in the system yet
+		capacity, policy, err := queueOptions(c)
+		if err != nil {
+			c.String(400, err.Error())
+			return
 		}
-		// Check if the queue is in the subscriptons map, if not add it
-		if _, exists := subscriptions[queueName]; !exists {
-			subscriptions[queueName] = make(map[string]struct{})
+		noLocal, err := parseNoLocal(c.Query("nolocal"))
+		if err != nil {
+			c.String(400, err.Error())
+			return
 		}
-		// Check if topic already exists in subscriptons map
-		if _, exists := subscriptions[queueName][topicName]; exists {
+		if !subscribe(queueName, topicName, capacity, policy, noLocal) {
 			c.String(404, fmt.Sprintf("Queue %s is already subscribed to topic %s", queueName, topicName))
 			return
 		}
-		subscriptions[queueName][topicName] = struct{}{}
 		c.String(200, fmt.Sprintf("Subscribed queue %s to topic %s", queueName, topicName))
-		// Queue does not exist in the system, if not add it
 	case "DELETE":
+		exists, subscribed := unsubscribe(queueName, topicName)
 		// If queue does not exist, raise an error
-		if _, exists := subscriptions[queueName]; !exists {
+		if !exists {
 			c.String(404, fmt.Sprintf("There is no queue named %s", queueName))
 			return
 		}
 		// If queue is not subscribed to the topic, raise an error
-		if _, exists := subscriptions[queueName][topicName]; !exists {
+		if !subscribed {
 			c.String(404, fmt.Sprintf("Queue %s is not subscribed to topic %s", queueName, topicName))
 			return
 		}
-		// Unsubscribe the queue from the topic
-		delete(subscriptions[queueName], topicName)
 		c.String(200, fmt.Sprintf("Unsubscribed queue %s from topic %s", queueName, topicName))
 	default:
 		c.String(405, "Method not allowed")
 	}
 }
 
+// Capacity and overflow policy asked for by ?capacity=N&overflow=POLICY
+// (these only apply to the request that makes the queue)
+func queueOptions(c *gin.Context) (int, overflowPolicy, error) {
+	capacity, policy := defaultCapacity, defaultOverflow
+	if value := c.Query("capacity"); value != "" {
+		n, err := strconv.Atoi(value)
+		if err != nil || n < 1 {
+			return 0, policy, fmt.Errorf("Bad capacity %s", value)
+		}
+		capacity = n
+	}
+	if value := c.Query("overflow"); value != "" {
+		p, err := parseOverflow(value)
+		if err != nil {
+			return 0, policy, err
+		}
+		policy = p
+	}
+	return capacity, policy, nil
+}
+
+// Whether a subscription asked for ?nolocal=1, leaving out messages its own
+// client publishes
+func parseNoLocal(value string) (bool, error) {
+	if value == "" {
+		return false, nil
+	}
+	noLocal, err := strconv.ParseBool(value)
+	if err != nil {
+		return false, fmt.Errorf("Bad nolocal %s", value)
+	}
+	return noLocal, nil
+}
+
+// Stats Handler
+func statsHandler(c *gin.Context) {
+	queueName := c.Param("id")
+	queue := lookupQueue(queueName)
+	if queue == nil {
+		c.String(404, fmt.Sprintf("There is no queue named %s", queueName))
+		return
+	}
+	c.String(200, queue.stats(queueName))
+}
+
 func main() {
 	// Init host and port
 	host := flag.String("h", "localhost", "host of server")
 	port := flag.String("p", "8080", "port of server")
+	flag.IntVar(&defaultCapacity, "capacity", defaultCapacity, "messages a queue holds before overflowing")
+	overflow := flag.String("overflow", defaultOverflow.String(), "overflow policy (drop-oldest, drop-newest, or disconnect)")
 	flag.Parse()
+	policy, err := parseOverflow(*overflow)
+	if err != nil || defaultCapacity < 1 {
+		fmt.Println("Bad -capacity or -overflow")
+		return
+	}
+	defaultOverflow = policy
 	// Init gin server
 	r := gin.Default()
 	// Request handlers
 	r.PUT("/topic/:id", topicHandler)
+	r.PUT("/batch", batchHandler)
 	r.Any("/subscription/:queue/:id", subscriptionHandler)
 	r.GET("/queue/:id", queueHandler)
+	r.GET("/stream/:id", streamHandler)
+	r.GET("/binary/:id", binaryHandler)
+	r.GET("/stats/:id", statsHandler)
 	r.Run(fmt.Sprintf("%s:%s", *host, *port))
 }
@@ -0,0 +1,120 @@
+package main
+
+import (
+	"fmt"
+	"sync"
+	"sync/atomic"
+)
+
+// What to do with a message for a queue that is already full
+type overflowPolicy int
+
+const (
+	dropOldest overflowPolicy = iota // Make room by discarding the oldest message
+	dropNewest                       // Discard the message being published
+	disconnect                       // Discard everything and end the consumer's stream
+)
+
+var overflowNames = map[string]overflowPolicy{
+	"drop-oldest": dropOldest,
+	"drop-newest": dropNewest,
+	"disconnect":  disconnect,
+}
+
+func (p overflowPolicy) String() string {
+	for name, policy := range overflowNames {
+		if policy == p {
+			return name
+		}
+	}
+	return "unknown"
+}
+
+func parseOverflow(name string) (overflowPolicy, error) {
+	if policy, exists := overflowNames[name]; exists {
+		return policy, nil
+	}
+	return dropOldest, fmt.Errorf("Bad overflow policy %s", name)
+}
+
+// Capacity and policy of queues not made with their own (set from flags)
+var defaultCapacity = 100
+var defaultOverflow = dropOldest
+
+// A queue buffers messages for one consumer; publishing to it never blocks
+type queue struct {
+	messages chan envelope
+	policy   overflowPolicy
+	dropped  uint64 // Messages discarded by the policy (updated atomically)
+
+	mu     sync.Mutex
+	kicked chan struct{} // Closed when the consumer is disconnected
+}
+
+func newQueue(capacity int, policy overflowPolicy) *queue {
+	return &queue{
+		messages: make(chan envelope, capacity),
+		policy:   policy,
+		kicked:   make(chan struct{}),
+	}
+}
+
+// Add a message without blocking, applying the overflow policy if the
+// queue is full, and report whether it was added
+func (q *queue) offer(message envelope) bool {
+	for {
+		select {
+		case q.messages <- message:
+			return true
+		default:
+		}
+		switch q.policy {
+		case dropNewest:
+			atomic.AddUint64(&q.dropped, 1)
+			return false
+		case disconnect:
+			atomic.AddUint64(&q.dropped, uint64(q.drain())+1)
+			q.kick()
+			return false
+		default:
+			// Another publisher (or the consumer) may get there first, so try again
+			select {
+			case <-q.messages:
+				atomic.AddUint64(&q.dropped, 1)
+			default:
+			}
+		}
+	}
+}
+
+// Discard every buffered message and return how many there were
+func (q *queue) drain() int {
+	for count := 0; ; count++ {
+		select {
+		case <-q.messages:
+		default:
+			return count
+		}
+	}
+}
+
+// Disconnect whoever is consuming the queue right now
+func (q *queue) kick() {
+	q.mu.Lock()
+	close(q.kicked)
+	q.kicked = make(chan struct{})
+	q.mu.Unlock()
+}
+
+// Channel closed when the current consumer is disconnected
+func (q *queue) kicks() <-chan struct{} {
+	q.mu.Lock()
+	defer q.mu.Unlock()
+	return q.kicked
+}
+
+// Describe the queue's state for the stats route
+func (q *queue) stats(name string) string {
+	return fmt.Sprintf("queue %s capacity %d overflow %s pending %d dropped %d",
+		name, cap(q.messages), q.policy, len(q.messages), atomic.LoadUint64(&q.dropped))
+}
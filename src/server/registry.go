@@ -0,0 +1,161 @@
+package main
+
+import (
+	"hash/fnv"
+	"sync"
+)
+
+// Number of independently locked parts of the registry
+const shardCount = 64
+
+// One queue as seen from the topics it subscribes to
+type subscriber struct {
+	name    string
+	queue   *queue
+	noLocal bool // Leave out messages the queue's own client publishes
+}
+
+// A shard holds the queues whose names hash to it, and the subscriber
+// lists of the topics whose names hash to it
+type shard struct {
+	sync.RWMutex
+	index       int                            // Position in shards (the order they are locked in)
+	queues      map[string]*queue              // Queue name to queue
+	topics      map[string]map[string]struct{} // Queue name to the topics it subscribes to
+	subscribers map[string][]subscriber        // Topic to the queues subscribed to it
+}
+
+var shards [shardCount]*shard
+
+func init() {
+	for i := range shards {
+		shards[i] = &shard{
+			index:       i,
+			queues:      make(map[string]*queue),
+			topics:      make(map[string]map[string]struct{}),
+			subscribers: make(map[string][]subscriber),
+		}
+	}
+}
+
+// Shard responsible for a queue or topic name
+func shardFor(name string) *shard {
+	h := fnv.New32a()
+	h.Write([]byte(name))
+	return shards[h.Sum32()%shardCount]
+}
+
+// Lock the shards of a queue and a topic (in a fixed order so that two
+// subscribers never wait on each other) and return how to unlock them
+func lockPair(a, b *shard) func() {
+	if a == b {
+		a.Lock()
+		return a.Unlock
+	}
+	first, second := a, b
+	if b.index < a.index {
+		first, second = b, a
+	}
+	first.Lock()
+	second.Lock()
+	return func() {
+		second.Unlock()
+		first.Unlock()
+	}
+}
+
+// Look up a queue (nil if it is not in the system)
+func lookupQueue(name string) *queue {
+	s := shardFor(name)
+	s.RLock()
+	defer s.RUnlock()
+	return s.queues[name]
+}
+
+// Look up a queue, making it with the given capacity and policy if it is
+// not in the system yet
+func ensureQueue(name string, capacity int, policy overflowPolicy) *queue {
+	if q := lookupQueue(name); q != nil {
+		return q
+	}
+	s := shardFor(name)
+	s.Lock()
+	defer s.Unlock()
+	q, exists := s.queues[name]
+	if !exists {
+		q = newQueue(capacity, policy)
+		s.queues[name] = q
+	}
+	return q
+}
+
+// Subscribe a queue (made with the given capacity and policy if need be)
+// to a topic, returning false if it already was (with the same options)
+func subscribe(queueName string, topic string, capacity int, policy overflowPolicy, noLocal bool) bool {
+	queue := ensureQueue(queueName, capacity, policy)
+	qs, ts := shardFor(queueName), shardFor(topic)
+	unlock := lockPair(qs, ts)
+	defer unlock()
+	topics, exists := qs.topics[queueName]
+	if !exists {
+		topics = make(map[string]struct{})
+		qs.topics[queueName] = topics
+	}
+	// Publishers iterate the list without the lock, so never change it in place
+	current := ts.subscribers[topic]
+	if _, exists := topics[topic]; exists {
+		// Subscribing again only changes the options
+		for i, s := range current {
+			if s.name == queueName && s.noLocal != noLocal {
+				updated := make([]subscriber, len(current))
+				copy(updated, current)
+				updated[i].noLocal = noLocal
+				ts.subscribers[topic] = updated
+				return true
+			}
+		}
+		return false
+	}
+	topics[topic] = struct{}{}
+	updated := make([]subscriber, len(current), len(current)+1)
+	copy(updated, current)
+	ts.subscribers[topic] = append(updated, subscriber{queueName, queue, noLocal})
+	return true
+}
+
+// Unsubscribe a queue from a topic, reporting whether the queue has ever
+// subscribed to anything and whether it was subscribed to this topic
+func unsubscribe(queueName string, topic string) (bool, bool) {
+	qs, ts := shardFor(queueName), shardFor(topic)
+	unlock := lockPair(qs, ts)
+	defer unlock()
+	topics, exists := qs.topics[queueName]
+	if !exists {
+		return false, false
+	}
+	if _, subscribed := topics[topic]; !subscribed {
+		return true, false
+	}
+	delete(topics, topic)
+	current := ts.subscribers[topic]
+	updated := make([]subscriber, 0, len(current))
+	for _, s := range current {
+		if s.name != queueName {
+			updated = append(updated, s)
+		}
+	}
+	if len(updated) == 0 {
+		delete(ts.subscribers, topic)
+	} else {
+		ts.subscribers[topic] = updated
+	}
+	return true, true
+}
+
+// Queues subscribed to a topic (a snapshot that is safe to use unlocked)
+func subscribersOf(topic string) []subscriber {
+	s := shardFor(topic)
+	s.RLock()
+	defer s.RUnlock()
+	return s.subscribers[topic]
+}
@@ -2,13 +2,249 @@
 
 #include "mq/logging.h"
 #include "mq/socket.h"
+#include "mq/stats.h"
+#include "mq/thread.h"
 
 #include <errno.h>
-#include <netdb.h>
+#include <fcntl.h>
 #include <netinet/in.h>
-#include <sys/socket.h>
+#include <poll.h>
+#include <time.h>
 #include <unistd.h>
 
+/* Internal Structures */
+
+typedef struct SocketCacheEntry SocketCacheEntry;
+struct SocketCacheEntry {
+    char            host[NI_MAXHOST];
+    char            port[NI_MAXSERV];
+    SocketAddress   addresses[SOCKET_CANDIDATES];
+    size_t          count;
+    time_t          expires;        // Entry is unused once this has passed
+};
+
+static SocketCacheEntry Cache[SOCKET_CACHE];
+static Mutex            CacheLock = PTHREAD_MUTEX_INITIALIZER;
+static SocketStats      Counters;
+
+/* Internal Prototypes */
+
+size_t   socket_lookup(const char *host, const char *port, SocketAddress *addresses, size_t max);
+int      socket_start(const SocketAddress *address, bool *connected);
+
+/* External Functions */
+
+/**
+ * Resolve host and port to the addresses worth connecting to, reusing
+ * earlier answers for up to SOCKET_CACHE_TTL seconds.  Addresses alternate
+ * between families (as happy eyeballs prefers) starting with the one the
+ * resolver listed first.
+ * @param   host        Host string to resolve.
+ * @param   port        Port string to resolve.
+ * @param   addresses   Where to store addresses.
+ * @param   max         Most addresses to store.
+ * @return  Number of addresses stored (0 if host could not be resolved).
+ */
+size_t  socket_resolve(const char *host, const char *port, SocketAddress *addresses, size_t max) {
+    time_t now = time(NULL);
+    size_t count = 0;
+
+    mutex_lock(&CacheLock);
+    for (size_t i = 0; i < SOCKET_CACHE; i++) {
+        SocketCacheEntry *entry = &Cache[i];
+        if (entry->expires > now && !strcmp(entry->host, host) && !strcmp(entry->port, port)) {
+            count = entry->count < max ? entry->count : max;
+            memcpy(addresses, entry->addresses, count * sizeof(SocketAddress));
+            break;
+        }
+    }
+    mutex_unlock(&CacheLock);
+    if (count) {
+        __atomic_add_fetch(&Counters.cache_hits, 1, __ATOMIC_RELAXED);
+        return count;
+    }
+
+    __atomic_add_fetch(&Counters.cache_misses, 1, __ATOMIC_RELAXED);
+    SocketAddress found[SOCKET_CANDIDATES];
+    size_t found_count = socket_lookup(host, port, found, SOCKET_CANDIDATES);
+    if (!found_count) return 0;
+
+    /* Replace the entry for this host (or the one closest to expiring) */
+    mutex_lock(&CacheLock);
+    SocketCacheEntry *victim = &Cache[0];
+    for (size_t i = 0; i < SOCKET_CACHE; i++) {
+        if (!strcmp(Cache[i].host, host) && !strcmp(Cache[i].port, port)) {
+            victim = &Cache[i];
+            break;
+        }
+        if (Cache[i].expires < victim->expires) victim = &Cache[i];
+    }
+    snprintf(victim->host, NI_MAXHOST, "%s", host);
+    snprintf(victim->port, NI_MAXSERV, "%s", port);
+    memcpy(victim->addresses, found, found_count * sizeof(SocketAddress));
+    victim->count   = found_count;
+    victim->expires = now + SOCKET_CACHE_TTL;
+    mutex_unlock(&CacheLock);
+
+    count = found_count < max ? found_count : max;
+    memcpy(addresses, found, count * sizeof(SocketAddress));
+    return count;
+}
+
+/**
+ * Drop cached addresses for host and port (after none of them worked).
+ * @param   host    Host string.
+ * @param   port    Port string.
+ */
+void    socket_forget(const char *host, const char *port) {
+    mutex_lock(&CacheLock);
+    for (size_t i = 0; i < SOCKET_CACHE; i++) {
+        if (!strcmp(Cache[i].host, host) && !strcmp(Cache[i].port, port)) Cache[i].expires = 0;
+    }
+    mutex_unlock(&CacheLock);
+}
+
+/**
+ * Create socket connection to specified host and port.
+ * @param   host    Host string to connect to.
+ * @param   port    Port string to connect to.
+ * @return  Socket file descriptor of connection if successful, otherwise -1.
+ */
+int     socket_dial(const char *host, const char *port) {
+    return socket_dial_timeout(host, port, SOCKET_CONNECT_TIMEOUT);
+}
+
+/**
+ * Create socket connection to specified host and port, racing its
+ * addresses happy eyeballs style: a connect is started on the first
+ * address, and every SOCKET_STAGGER milliseconds it has not succeeded
+ * (or as soon as one fails) another is started alongside it.  The first
+ * to connect wins, so one dead address cannot stall the caller.
+ * @param   host    Host string to connect to.
+ * @param   port    Port string to connect to.
+ * @param   timeout Milliseconds to wait for a connection.
+ * @return  Socket file descriptor of connection if successful, otherwise -1.
+ */
+int     socket_dial_timeout(const char *host, const char *port, int timeout) {
+    SocketAddress addresses[SOCKET_CANDIDATES];
+    size_t count = socket_resolve(host, port, addresses, SOCKET_CANDIDATES);
+    if (!count) return -1;
+
+    struct pollfd racing[SOCKET_CANDIDATES];
+    size_t   started = 0, open = 0;
+    uint64_t start = stats_now(), next = 0;
+    int      socket_fd = -1;
+
+    while (socket_fd < 0) {
+        uint64_t elapsed = (stats_now() - start) / 1000;
+
+        /* Start another connect if it is time (or nothing else is running) */
+        if (started < count && (!open || elapsed >= next)) {
+            bool connected = false;
+            int  fd = socket_start(&addresses[started++], &connected);
+            next = elapsed + SOCKET_STAGGER;
+            if (fd < 0) continue;
+            if (connected) {
+                socket_fd = fd;
+                break;
+            }
+            racing[open].fd       = fd;
+            racing[open++].events = POLLOUT;
+            continue;
+        }
+        if (!open || elapsed >= (uint64_t)timeout) {
+            if (open) errno = ETIMEDOUT;
+            break;
+        }
+
+        uint64_t wait = timeout - elapsed;
+        if (started < count && next - elapsed < wait) wait = next - elapsed;
+        if (poll(racing, open, wait) < 0 && errno != EINTR) break;
+
+        /* Take the first connect that finished, drop the ones that failed */
+        for (size_t i = 0; i < open; ) {
+            if (!racing[i].revents) {
+                i++;
+                continue;
+            }
+            int error = 0;
+            socklen_t length = sizeof(error);
+            if (getsockopt(racing[i].fd, SOL_SOCKET, SO_ERROR, &error, &length) == 0 && !error && socket_fd < 0) {
+                socket_fd = racing[i].fd;
+            } else {
+                close(racing[i].fd);
+                errno = error;
+            }
+            racing[i] = racing[--open];
+        }
+    }
+
+    for (size_t i = 0; i < open; i++) close(racing[i].fd);
+
+    if (socket_fd < 0) {
+        error("Unable to connect to %s:%s: %s", host, port, strerror(errno));
+        socket_forget(host, port);
+        socket_connected(false, 0);
+        return -1;
+    }
+    fcntl(socket_fd, F_SETFL, fcntl(socket_fd, F_GETFL) & ~O_NONBLOCK);
+    socket_connected(true, stats_now() - start);
+    return socket_fd;
+}
+
+/**
+ * Start non-blocking socket connection to specified host and port.  The
+ * connection is complete once the socket becomes writable (check SO_ERROR
+ * to find out whether it succeeded); the caller enforces its own timeout
+ * and reports the outcome with socket_connected.
+ * @param   host    Host string to connect to.
+ * @param   port    Port string to connect to.
+ * @param   attempt Number of failed attempts so far (each one moves on to
+ *                  the next address).
+ * @return  Non-blocking socket file descriptor if successful, otherwise -1.
+ */
+int     socket_dial_async(const char *host, const char *port, size_t attempt) {
+    SocketAddress addresses[SOCKET_CANDIDATES];
+    size_t count = socket_resolve(host, port, addresses, SOCKET_CANDIDATES);
+    if (!count) return -1;
+
+    bool connected;
+    int  socket_fd = socket_start(&addresses[attempt % count], &connected);
+    if (socket_fd < 0) {
+        error("Unable to connect to %s:%s: %s", host, port, strerror(errno));
+    }
+    return socket_fd;
+}
+
+/**
+ * Record outcome of a connection attempt in the socket counters.
+ * @param   success Whether or not the connection was established.
+ * @param   usec    Microseconds it took.
+ */
+void    socket_connected(bool success, uint64_t usec) {
+    if (!success) {
+        __atomic_add_fetch(&Counters.connect_failures, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    __atomic_add_fetch(&Counters.connects, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&Counters.connect_usec, usec, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&Counters.connect_usec_max, __ATOMIC_RELAXED);
+    while (usec > max && !__atomic_compare_exchange_n(&Counters.connect_usec_max, &max, usec, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/**
+ * Copy the process wide socket counters.
+ * @param   stats   Where to store counters.
+ */
+void    socket_stats(SocketStats *stats) {
+    stats->cache_hits       = __atomic_load_n(&Counters.cache_hits, __ATOMIC_RELAXED);
+    stats->cache_misses     = __atomic_load_n(&Counters.cache_misses, __ATOMIC_RELAXED);
+    stats->connects         = __atomic_load_n(&Counters.connects, __ATOMIC_RELAXED);
+    stats->connect_failures = __atomic_load_n(&Counters.connect_failures, __ATOMIC_RELAXED);
+    stats->connect_usec     = __atomic_load_n(&Counters.connect_usec, __ATOMIC_RELAXED);
+    stats->connect_usec_max = __atomic_load_n(&Counters.connect_usec_max, __ATOMIC_RELAXED);
+}
+
 /**
  * Create socket connection to specified host and port.
  * @param   host    Host string to connect to.
@@ -16,7 +252,72 @@
  * @return  Socket file stream of connection if successful, otherwise NULL.
  */
 FILE *  socket_connect(const char *host, const char *port) {
-    /* Lookup server address information */
+    int socket_fd = socket_dial(host, port);
+    if (socket_fd < 0) return NULL;
+
+    /* Make file stream */
+    FILE *fs = fdopen(socket_fd, "r+");
+    if (!fs) {
+        error("Unable to make file stream: %s", strerror(errno));
+        close(socket_fd);
+    }
+    return fs;
+}
+
+/**
+ * Write as much of the given buffers to socket as one sendmsg will take.
+ * @param   fd      Socket file descriptor (blocking or not).
+ * @param   iov     Buffers to write (advanced past what was written).
+ * @param   iovcnt  Number of buffers (reduced by those fully written).
+ * @return  Bytes written, or -1 on error (errno is EAGAIN if the
+ *          non-blocking socket is full).
+ */
+ssize_t socket_writev(int fd, struct iovec **iov, int *iovcnt) {
+    struct msghdr message = { .msg_iov = *iov, .msg_iovlen = *iovcnt };
+    ssize_t written;
+    while ((written = sendmsg(fd, &message, MSG_NOSIGNAL)) < 0 && errno == EINTR);
+    if (written < 0) return -1;
+
+    /* Skip past fully written buffers and trim a partially written one */
+    size_t remaining = written;
+    while (*iovcnt > 0 && remaining >= (*iov)->iov_len) {
+        remaining -= (*iov)->iov_len;
+        (*iov)++;
+        (*iovcnt)--;
+    }
+    if (*iovcnt > 0) {
+        (*iov)->iov_base = (char *)(*iov)->iov_base + remaining;
+        (*iov)->iov_len -= remaining;
+    }
+    return written;
+}
+
+/**
+ * Write all of the given buffers to socket with as few system calls as
+ * possible (a single sendmsg unless the socket buffer fills up).
+ * @param   fd      Socket file descriptor.
+ * @param   iov     Buffers to write (advanced past what was written).
+ * @param   iovcnt  Number of buffers.
+ * @return  Whether or not everything was written.
+ */
+bool    socket_sendv(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        if (socket_writev(fd, &iov, &iovcnt) < 0) return false;
+    }
+    return true;
+}
+
+/* Internal Functions */
+
+/**
+ * Resolve host and port with getaddrinfo.
+ * @param   host        Host string to resolve.
+ * @param   port        Port string to resolve.
+ * @param   addresses   Where to store addresses (interleaved by family).
+ * @param   max         Most addresses to store.
+ * @return  Number of addresses stored.
+ */
+size_t  socket_lookup(const char *host, const char *port, SocketAddress *addresses, size_t max) {
     struct addrinfo *results;
     struct addrinfo  hints = {
 	.ai_family   = AF_UNSPEC,   /* Return IPv4 and IPv6 choices */
@@ -25,41 +326,54 @@ FILE *  socket_connect(const char *host, const char *port) {
     int status;
     if ((status = getaddrinfo(host, port, &hints, &results)) != 0) {
         error("Unable to resolve %s:%s: %s", host, port, gai_strerror(status));
-        return NULL;
+        return 0;
     }
 
-    /* For each server entry, allocate socket and try to connect */
-    int socket_fd = -1;
-    for (struct addrinfo *p = results; p != NULL && socket_fd < 0; p = p->ai_next) {
-        /* Allocate socket */
-        if ((socket_fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0) {
-            error("Unable to make socket: %s", strerror(errno));
-            continue;
+    /* Alternate families: first family's addresses go in even slots */
+    struct addrinfo *first[SOCKET_CANDIDATES], *second[SOCKET_CANDIDATES];
+    size_t firsts = 0, seconds = 0, count = 0;
+    for (struct addrinfo *p = results; p != NULL; p = p->ai_next) {
+        if (p->ai_addrlen > sizeof(struct sockaddr_storage)) continue;
+        if (p->ai_family == results->ai_family) {
+            if (firsts < max) first[firsts++] = p;
+        } else if (seconds < max) {
+            second[seconds++] = p;
         }
-
-        /* Connect to host */
-        if (connect(socket_fd, p->ai_addr, p->ai_addrlen) < 0) {
-            close(socket_fd);
-            socket_fd = -1;
-            continue;
+    }
+    for (size_t i = 0; count < max && (i < firsts || i < seconds); i++) {
+        struct addrinfo *pair[] = { i < firsts ? first[i] : NULL, i < seconds ? second[i] : NULL };
+        for (size_t j = 0; j < 2 && count < max; j++) {
+            if (!pair[j]) continue;
+            addresses[count].family   = pair[j]->ai_family;
+            addresses[count].socktype = pair[j]->ai_socktype;
+            addresses[count].protocol = pair[j]->ai_protocol;
+            addresses[count].length   = pair[j]->ai_addrlen;
+            memcpy(&addresses[count++].address, pair[j]->ai_addr, pair[j]->ai_addrlen);
         }
     }
 
-    /* Release allocate address information */
     freeaddrinfo(results);
+    return count;
+}
 
+/**
+ * Start non-blocking connect to one address.
+ * @param   address     Address to connect to.
+ * @param   connected   Set to whether the connect already finished.
+ * @return  Non-blocking socket file descriptor, or -1 on failure.
+ */
+int     socket_start(const SocketAddress *address, bool *connected) {
+    int socket_fd = socket(address->family, address->socktype | SOCK_NONBLOCK, address->protocol);
     if (socket_fd < 0) {
-        error("Unable to connect to %s:%s: %s", host, port, strerror(errno));
-        return NULL;
+        error("Unable to make socket: %s", strerror(errno));
+        return -1;
     }
-
-    /* Make file stream */
-    FILE *fs = fdopen(socket_fd, "r+");
-    if (!fs) {
-        error("Unable to make file stream: %s", strerror(errno));
+    *connected = connect(socket_fd, (const struct sockaddr *)&address->address, address->length) == 0;
+    if (!*connected && errno != EINPROGRESS) {
         close(socket_fd);
+        return -1;
     }
-    return fs;
+    return socket_fd;
 }
 
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,275 @@
+/* stats.c: Runtime statistics */
+
+#include "mq/stats.h"
+#include "mq/logging.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <time.h>
+
+/*
+ * Counters are spread over STATS_SHARDS cache lines, each thread adding to
+ * the one it was handed the first time it counted something, so threads
+ * publishing side by side do not fight over a line; a report sums them.
+ * Histograms and queue marks are only written by the threads doing I/O
+ * (one or two per client), so they are updated in place.  Every update is
+ * a relaxed atomic, which leaves the counters cheap enough to keep on.
+ */
+
+/* Internal Variables */
+
+static __thread unsigned StatsSlot;     /* Shard of calling thread (plus one, 0 if none yet) */
+static unsigned          StatsThreads;  /* Threads handed a shard so far */
+
+static const char *CounterNames[STATS_COUNTERS] = {
+    "published", "published_bytes", "received", "received_bytes",
+    "failed", "connects", "reconnects", "connect_failures",
+};
+static const char *LatencyNames[STATS_HISTOGRAMS] = {
+    "connect_usec", "round_trip_usec", "deliver_usec",
+};
+static const char *QueueNames[STATS_QUEUES] = {
+    "outgoing", "incoming",
+};
+
+/* Internal Prototypes */
+
+size_t   histogram_bucket(uint64_t value);
+uint64_t histogram_value(size_t bucket);
+uint64_t stats_clock(clockid_t clock);
+
+/* External Functions */
+
+/**
+ * Create statistics structure (with every counter at zero).
+ * @return  Newly allocated Stats structure (NULL on failure).
+ */
+Stats * stats_create() {
+    Stats *s;
+    if (posix_memalign((void **)&s, CACHE_LINE, sizeof(Stats))) {
+        error("Unable to allocate statistics: %s", strerror(errno));
+        return NULL;
+    }
+    memset(s, 0, sizeof(Stats));
+    return s;
+}
+
+/**
+ * Delete statistics structure.
+ * @param   s       Stats structure.
+ */
+void stats_delete(Stats *s) {
+    free(s);
+}
+
+/**
+ * Add n to counter in the calling thread's shard.
+ * @param   s       Stats structure.
+ * @param   counter Counter to add to.
+ * @param   n       Amount to add.
+ */
+void stats_add(Stats *s, StatsCounter counter, uint64_t n) {
+    if (!StatsSlot) StatsSlot = __atomic_fetch_add(&StatsThreads, 1, __ATOMIC_RELAXED) % STATS_SHARDS + 1;
+    __atomic_add_fetch(&s->shards[StatsSlot - 1].counters[counter], n, __ATOMIC_RELAXED);
+}
+
+/**
+ * Note depth of queue, keeping the deepest seen.
+ * @param   s       Stats structure.
+ * @param   queue   Queue the depth is of.
+ * @param   depth   Requests in it.
+ */
+void stats_depth(Stats *s, StatsQueue queue, size_t depth) {
+    size_t high = __atomic_load_n(&s->high[queue], __ATOMIC_RELAXED);
+    while (depth > high && !__atomic_compare_exchange_n(&s->high[queue], &high, depth, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/**
+ * Record one latency in its histogram.
+ * @param   s       Stats structure.
+ * @param   latency Histogram to record in.
+ * @param   usec    Microseconds it took.
+ */
+void stats_latency(Stats *s, StatsLatency latency, uint64_t usec) {
+    Histogram *h = &s->latency[latency];
+    __atomic_add_fetch(&h->counts[histogram_bucket(usec)], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->sum, usec, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    while (usec > max && !__atomic_compare_exchange_n(&h->max, &max, usec, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/**
+ * Record outcome of a connection attempt.
+ * @param   s       Stats structure.
+ * @param   success Whether or not the connection was established.
+ * @param   again   Whether it replaces one established before.
+ * @param   usec    Microseconds it took.
+ */
+void stats_connected(Stats *s, bool success, bool again, uint64_t usec) {
+    if (!success) {
+        stats_add(s, STATS_CONNECT_FAILURES, 1);
+        return;
+    }
+    stats_add(s, STATS_CONNECTS, 1);
+    if (again) stats_add(s, STATS_RECONNECTS, 1);
+    stats_latency(s, STATS_CONNECT, usec);
+}
+
+/**
+ * Sum counters over every shard and copy histograms and queue marks into
+ * report (queue depths and drops are left to the caller, which has the
+ * queues).  Taken while other threads count, so figures may be a few
+ * updates apart from each other.
+ * @param   s       Stats structure.
+ * @param   report  Where to store report.
+ */
+void stats_report(Stats *s, StatsReport *report) {
+    memset(report, 0, sizeof(StatsReport));
+    for (size_t i = 0; i < STATS_SHARDS; i++) {
+        for (size_t c = 0; c < STATS_COUNTERS; c++) {
+            report->counters[c] += __atomic_load_n(&s->shards[i].counters[c], __ATOMIC_RELAXED);
+        }
+    }
+    for (size_t q = 0; q < STATS_QUEUES; q++) {
+        report->high[q] = __atomic_load_n(&s->high[q], __ATOMIC_RELAXED);
+    }
+    for (size_t l = 0; l < STATS_HISTOGRAMS; l++) {
+        Histogram *from = &s->latency[l], *to = &report->latency[l];
+        for (size_t b = 0; b < HISTOGRAM_BUCKETS; b++) {
+            to->counts[b] = __atomic_load_n(&from->counts[b], __ATOMIC_RELAXED);
+        }
+        to->count = __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+        to->sum   = __atomic_load_n(&from->sum, __ATOMIC_RELAXED);
+        to->max   = __atomic_load_n(&from->max, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Write report to stream as one line of name=value pairs:
+ *
+ *  stats $NAME published=... outgoing_depth=... connect_usec_p50=... ...
+ *
+ * @param   report  Report to write.
+ * @param   name    Name of client's queue.
+ * @param   stream  Stream to write to.
+ */
+void stats_dump(const StatsReport *report, const char *name, FILE *stream) {
+    fprintf(stream, "stats %s", name);
+    for (size_t c = 0; c < STATS_COUNTERS; c++) {
+        fprintf(stream, " %s=%" PRIu64, CounterNames[c], report->counters[c]);
+    }
+    for (size_t q = 0; q < STATS_QUEUES; q++) {
+        fprintf(stream, " %s_depth=%zu %s_high=%zu %s_dropped=%zu",
+            QueueNames[q], report->depth[q], QueueNames[q], report->high[q], QueueNames[q], report->dropped[q]);
+    }
+    for (size_t l = 0; l < STATS_HISTOGRAMS; l++) {
+        const Histogram *h = &report->latency[l];
+        fprintf(stream, " %s_count=%" PRIu64 " %s_p50=%" PRIu64 " %s_p99=%" PRIu64 " %s_p999=%" PRIu64 " %s_max=%" PRIu64,
+            LatencyNames[l], h->count,
+            LatencyNames[l], histogram_percentile(h, 50),
+            LatencyNames[l], histogram_percentile(h, 99),
+            LatencyNames[l], histogram_percentile(h, 99.9),
+            LatencyNames[l], h->max);
+    }
+    fputc('\n', stream);
+    fflush(stream);
+}
+
+/**
+ * Format timestamp to embed at the front of a message body: STATS_MARK
+ * followed by the wall clock time in microseconds (16 hex digits), which
+ * stats_unstamp takes off again on retrieve.
+ * @param   buffer  Buffer to format into (at least STATS_STAMP + 1 bytes).
+ * @return  Length of timestamp (STATS_STAMP).
+ */
+size_t stats_stamp(char *buffer) {
+    return snprintf(buffer, STATS_STAMP + 1, "%c%016" PRIx64, STATS_MARK, stats_clock(CLOCK_REALTIME));
+}
+
+/**
+ * Take embedded timestamp (if there is one) off the front of a message
+ * body and record how long ago it was published.  Clients on other hosts
+ * can only be compared as well as their clocks agree.
+ * @param   s       Stats structure.
+ * @param   r       Request holding message.
+ */
+void stats_unstamp(Stats *s, Request *r) {
+    if (!r->body || r->length < STATS_STAMP || r->body[0] != STATS_MARK) return;
+    char digits[STATS_STAMP], *end;
+    memcpy(digits, r->body + 1, STATS_STAMP - 1);
+    digits[STATS_STAMP - 1] = 0;
+    uint64_t stamp = strtoull(digits, &end, 16);
+    if (*end) return;
+
+    uint64_t now = stats_clock(CLOCK_REALTIME);
+    stats_latency(s, STATS_DELIVER, now > stamp ? now - stamp : 0);
+    // Moving the body keeps it where request_from_body expects it
+    r->length -= STATS_STAMP;
+    memmove(r->body, r->body + STATS_STAMP, r->length + 1);
+}
+
+/**
+ * Returns monotonic time in microseconds.
+ */
+uint64_t stats_now() {
+    return stats_clock(CLOCK_MONOTONIC);
+}
+
+/**
+ * Returns value below which percentile of the values in histogram fall
+ * (to within the width of its bucket, and no more than the largest).
+ * @param   h           Histogram.
+ * @param   percentile  Percentile (0 to 100).
+ */
+uint64_t histogram_percentile(const Histogram *h, double percentile) {
+    if (!h->count) return 0;
+    uint64_t rank = (uint64_t)(percentile / 100 * h->count + 0.5);
+    uint64_t seen = 0;
+    if (rank < 1) rank = 1;
+    for (size_t b = 0; b < HISTOGRAM_BUCKETS; b++) {
+        if ((seen += h->counts[b]) < rank) continue;
+        uint64_t value = histogram_value(b);
+        return value < h->max ? value : h->max;
+    }
+    return h->max;
+}
+
+/* Internal Functions */
+
+/**
+ * Returns bucket of histogram holding value: values below 1 << SUB_BITS
+ * each have their own, while each power of two above that is split into
+ * 1 << SUB_BITS buckets (as in an HDR histogram).
+ * @param   value       Value to find bucket of.
+ */
+size_t histogram_bucket(uint64_t value) {
+    const uint64_t sub = 1 << HISTOGRAM_SUB_BITS;
+    if (value < sub) return value;
+    int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+    if (shift >= HISTOGRAM_SHIFTS) return HISTOGRAM_BUCKETS - 1;
+    return (shift + 1) * sub + (value >> shift) - sub;
+}
+
+/**
+ * Returns largest value that falls in bucket of histogram.
+ * @param   bucket      Bucket index.
+ */
+uint64_t histogram_value(size_t bucket) {
+    const uint64_t sub = 1 << HISTOGRAM_SUB_BITS;
+    if (bucket < sub) return bucket;
+    int shift = bucket / sub - 1;
+    return ((sub + bucket % sub + 1) << shift) - 1;
+}
+
+/**
+ * Returns time of clock in microseconds.
+ * @param   clock       Clock to read.
+ */
+uint64_t stats_clock(clockid_t clock) {
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */